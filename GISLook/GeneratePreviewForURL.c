@@ -3,6 +3,7 @@
 #include <QuickLook/QuickLook.h>
 #include "ReadRaster.h"
 #include "ReadVector.h"
+#include "File.h"
 
 /* -----------------------------------------------------------------------------
  Generate a preview for file
@@ -17,24 +18,50 @@ OSStatus GeneratePreviewForURL(void *thisInterface,
 							   CFDictionaryRef options)
 {	
 	
-	if (isVector (contentTypeUTI) && readVector(preview, NULL, url, contentTypeUTI))
+	// gzip compressed GIS files are read as the type of the uncompressed data.
+	// Other gzip files are left to the default preview without drawing.
+	CFStringRef type = copyUncompressedContentType(url, contentTypeUTI);
+	if (type == NULL)
 		return noErr;
+	if (isVector (type) && readVector(preview, NULL, url, type)) {
+		CFRelease(type);
+		return noErr;
+	}
+	
+	// readers draw coarse frames of large grids before the grid is complete
+	CoarseFrames frames = {preview, type, NULL, CGSizeZero};
+	setCoarseFrames(&frames);
+	CGImageRef image = readRaster(preview, NULL, url, type, MAX_GRID_SIZE, 
+								  CFAbsoluteTimeGetCurrent() + PREVIEW_TIME_LIMIT);
+	setCoarseFrames(NULL);
+	CFRelease(type);
 	
-	CGImageRef image = readRaster(preview, NULL, url, contentTypeUTI);
-	if (image == NULL)
+	// GeoTIFF files that are not grids, e.g. color images, are shown as images
+	if (image == NULL && UTTypeConformsTo(contentTypeUTI, kUTTypeTIFF))
+		QLPreviewRequestSetURLRepresentation(preview, url, kUTTypeImage, NULL);
+	if (image == NULL) {
+		if (frames.context)
+			CGContextRelease(frames.context);
 		return noErr;
+	}
 	CGSize size = CGSizeMake(CGImageGetWidth(image), CGImageGetHeight(image));
 	// specify size in points (pass false for isBitmap). Finder will display 
-	// previews at a larger size.
-	CGContextRef cgContext = QLPreviewRequestCreateContext(preview, size, false, NULL);
+	// previews at a larger size. The context of the coarse frames is reused.
+	CGContextRef cgContext = frames.context;
+	if (cgContext && !CGSizeEqualToSize(frames.size, size)) {
+		CGContextRelease(cgContext);
+		cgContext = NULL;
+	}
+	if (cgContext == NULL)
+		cgContext = QLPreviewRequestCreateContext(preview, size, false, NULL);
 	if(cgContext) {
 		// draw the image
 		CGRect crt = CGRectMake (0.f, 0.f, size.width, size.height);
 		CGContextDrawImage (cgContext, crt, image);
 		QLPreviewRequestFlushContext(preview, cgContext);
-		CGImageRelease (image);
 		CGContextRelease(cgContext);
 	}
+	CGImageRelease (image);
 	
 	return noErr;
 	
@@ -1,7 +1,29 @@
 #include <CoreFoundation/CoreFoundation.h>
 #include <CoreServices/CoreServices.h>
 #include <QuickLook/QuickLook.h>
+#include <ApplicationServices/ApplicationServices.h>
 #include "ReadRaster.h"
+#include "File.h"
+
+/* Creates a thumbnail of a GeoTIFF color image with ImageIO. */
+CGImageRef createTIFFThumbnail(CFURLRef url, long size) {
+	
+	CGImageSourceRef source = CGImageSourceCreateWithURL(url, NULL);
+	if (source == NULL)
+		return NULL;
+	CFNumberRef maxPixelSize = CFNumberCreate(NULL, kCFNumberLongType, &size);
+	const void *keys[] = {kCGImageSourceCreateThumbnailFromImageIfAbsent, kCGImageSourceThumbnailMaxPixelSize};
+	const void *values[] = {kCFBooleanTrue, maxPixelSize};
+	CFDictionaryRef options = CFDictionaryCreate(NULL, keys, values, 2,
+												 &kCFTypeDictionaryKeyCallBacks,
+												 &kCFTypeDictionaryValueCallBacks);
+	CGImageRef image = CGImageSourceCreateThumbnailAtIndex(source, 0, options);
+	CFRelease(options);
+	CFRelease(maxPixelSize);
+	CFRelease(source);
+	return image;
+	
+}
 
 /* -----------------------------------------------------------------------------
  Generate a thumbnail for file
@@ -17,12 +39,29 @@ OSStatus GenerateThumbnailForURL(void *thisInterface,
 								 CGSize maxSize)
 {
 	
-	if (isVector (contentTypeUTI) && readVector(NULL, thumbnail, url, contentTypeUTI))
+	// gzip compressed GIS files are read as the type of the uncompressed data.
+	// Other gzip files are left to the default thumbnail without drawing.
+	CFStringRef type = copyUncompressedContentType(url, contentTypeUTI);
+	if (type == NULL)
+		return noErr;
+	if (isVector (type) && readVector(NULL, thumbnail, url, type)) {
+		CFRelease(type);
 		return noErr;
+	}
+	
+	// only decode as many grid cells as the thumbnail can show
+	long size = ceil(maxSize.width > maxSize.height ? maxSize.width : maxSize.height);
+	CGImageRef image = readRaster(NULL, thumbnail, url, type, size,
+								  CFAbsoluteTimeGetCurrent() + THUMBNAIL_TIME_LIMIT);
+	CFRelease(type);
 	
-	CGImageRef image = readRaster(NULL, thumbnail, url, contentTypeUTI);
-	if (image != NULL)
+	// GeoTIFF files that are not grids, e.g. color images, are shown as images
+	if (image == NULL && UTTypeConformsTo(contentTypeUTI, kUTTypeTIFF))
+		image = createTIFFThumbnail(url, size);
+	if (image != NULL) {
 		QLThumbnailRequestSetImage(thumbnail, image, NULL);
+		CGImageRelease(image);
+	}
 	
 	return noErr;
 	
@@ -1,5 +1,8 @@
 #include <CoreFoundation/CoreFoundation.h>
 #include <CoreServices/CoreServices.h> 
+#include "Cache.h"
+#include "File.h"
+#include "VectorHeader.h"
 
 /* -----------------------------------------------------------------------------
  Step 1
@@ -35,6 +38,52 @@
 
 
 
+void addNumberAttribute(CFMutableDictionaryRef attributes, 
+						CFStringRef key,
+						CFNumberType type, 
+						const void *value) {
+	CFNumberRef number = CFNumberCreate (NULL, type, value);
+	if (number == NULL)
+		return;
+	CFDictionaryAddValue(attributes, key, number);
+	CFRelease(number);
+}
+
+Boolean addVectorAttributes(CFMutableDictionaryRef attributes, VectorHeader *header) {
+	if (header->hasBounds) {
+		addNumberAttribute(attributes, CFSTR("ch_bernhardjenny_gismeta_xmin"), kCFNumberDoubleType, &header->xmin);
+		addNumberAttribute(attributes, CFSTR("ch_bernhardjenny_gismeta_ymin"), kCFNumberDoubleType, &header->ymin);
+		addNumberAttribute(attributes, CFSTR("ch_bernhardjenny_gismeta_xmax"), kCFNumberDoubleType, &header->xmax);
+		addNumberAttribute(attributes, CFSTR("ch_bernhardjenny_gismeta_ymax"), kCFNumberDoubleType, &header->ymax);
+	}
+	if (header->featureCount >= 0)
+		addNumberAttribute(attributes, CFSTR("ch_bernhardjenny_gismeta_featurecount"), kCFNumberLongType, &header->featureCount);
+	return header->hasBounds || header->featureCount >= 0;
+}
+
+/* Reads the bounding box and the number of features of a vector file. The
+ header is cached, as E00 files have to be scanned to find it. */
+Boolean readVectorHeader(char *path, CFStringRef contentTypeUTI, VectorHeader *header) {
+	CacheEntry entry;
+	if (readCacheEntry(previewCache, path, "vectorheader", &entry)) {
+		Boolean found = entry.length == sizeof(VectorHeader);
+		if (found)
+			memcpy(header, entry.data, sizeof(VectorHeader));
+		releaseCacheEntry(&entry);
+		if (found)
+			return TRUE;
+	}
+	
+	Boolean res = FALSE;
+	if (UTTypeConformsTo(contentTypeUTI, CFSTR("com.esri.shape")))
+		res = readShapefileHeader(path, header);
+	else if (UTTypeConformsTo(contentTypeUTI, CFSTR("com.esri.e00")))
+		res = readE00Header(path, METADATA_READ_BUDGET, header);
+	if (res)
+		writeCacheEntry(previewCache, path, "vectorheader", header, sizeof(VectorHeader));
+	return res;
+}
+
 /* -----------------------------------------------------------------------------
  Get metadata attributes from file
  
@@ -54,7 +103,30 @@ Boolean GetMetadataForFile(void* thisInterface,
 	char path[10240];
 	if (!CFStringGetFileSystemRepresentation (pathToFile, path, 10240))
 		return FALSE;
-	FILE *fp = fopen(path, "r");
+	
+	// gzip compressed files are read as the type of the uncompressed data
+	CFURLRef url = CFURLCreateWithFileSystemPath(NULL, pathToFile, kCFURLPOSIXPathStyle, false);
+	if (url == NULL)
+		return FALSE;
+	CFStringRef type = copyUncompressedContentType(url, contentTypeUTI);
+	CFRelease(url);
+	if (type == NULL)
+		return FALSE;
+	
+	// vector files: bounding box and number of features from headers
+	VectorHeader header;
+	if (UTTypeConformsTo(type, CFSTR("com.esri.shape"))
+		|| UTTypeConformsTo(type, CFSTR("com.esri.e00"))) {
+		bool res = readVectorHeader(path, type, &header) && addVectorAttributes(attributes, &header);
+		CFRelease(type);
+		return res;
+	}
+	CFRelease(type);
+	
+	/* raster files: the probes below only read headers, but the file is opened 
+	 with a budget, so that a probe that does not recognize the format cannot 
+	 read through an entire large file, which would be slow on network volumes. */
+	FILE *fp = openFileWithBudget(path, METADATA_READ_BUDGET);
 	if (fp == NULL)
 		return FALSE;
 	
@@ -68,6 +140,10 @@ Boolean GetMetadataForFile(void* thisInterface,
 		fseek (fp, 0, SEEK_SET);
 		res = readESRIBinaryGridSize(path, &width, &height);
 	}
+	if (!res) {
+		fseek (fp, 0, SEEK_SET);
+		res = readArcInfoGridSize(path, &width, &height);
+	}
 	if (!res) {
 		fseek (fp, 0, SEEK_SET);
 		res = readSRTMSize(path, &width, &height);
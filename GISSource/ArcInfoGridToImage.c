@@ -0,0 +1,731 @@
+/*
+ *  ArcInfoGridToImage.c
+ *  GISLook
+ *
+
+ Importer for ArcInfo binary grids
+
+ A grid is a folder with several files ending in .adf. hdr.adf contains the
+ cell type and the size of blocks and tiles, dblbnd.adf the bounding box. The
+ cells are stored in w001001.adf in blocks of e.g. 256 by 4 cells. Each block
+ is compressed on its own, and w001001x.adf is an index with the position and
+ the size of each block. Large grids are split into tiles, each with its own
+ pair of block and index files. The files of the first row of tiles are named
+ w001001.adf, w002001.adf, etc., of the second row w001000.adf, w002000.adf, 
+ etc., and of the following rows z001001.adf, z002001.adf, etc., where the
+ last three digits count the rows from the third row on. All numbers
+ are big endian. The format is not published; see the description of the
+ format by Frank Warmerdam at http://home.gdal.org/projects/aigrid/
+
+ Only the rows of blocks that contain sampled rows are read and decompressed.
+ The rows of blocks are decoded in parallel.
+
+ */
+
+#include "ArcInfoGridToImage.h"
+#include "ReadRaster.h"
+#include "BufferPool.h"
+#include "Stretch.h"
+#include "Hillshade.h"
+#include "Parallel.h"
+#include "File.h"
+#include <fcntl.h>
+#include <math.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define ARCINFO_HEADER_LENGTH		308
+#define ARCINFO_BOUNDS_LENGTH		32
+// w001001.adf and w001001x.adf start with a header of 100 bytes
+#define ARCINFO_TILE_HEADER_LENGTH	100
+// each entry of the index has the offset and the size of a block in shorts
+#define ARCINFO_INDEX_ENTRY_LENGTH	8
+
+#define ARCINFO_INTEGER_CELLS		1
+#define ARCINFO_FLOAT_CELLS			2
+#define ARCINFO_INTEGER_NODATA		(-2147483647)
+#define ARCINFO_FLOAT_NODATA		(-3.4028234663852886e38f)
+
+// the column and the row in the name of a tile file have three digits
+#define ARCINFO_MAX_TILE_NUMBER		999
+
+// the geometry of a grid, from hdr.adf and dblbnd.adf
+typedef struct {
+	int cellType;
+	long cols, rows;
+	long blockCols, blockRows;	// cells in a block
+	long tileBlockCols;			// blocks in a row of a tile
+	long tileBlockRows;			// rows of blocks in a tile
+	long tileCols, tileRows;	// cells in a tile
+	long tilesPerRow, tilesPerColumn;
+} ArcInfoGridHeader;
+
+long arcInfoInt(const unsigned char *b) {
+	return (SInt32)(((UInt32)b[0] << 24) | ((UInt32)b[1] << 16) | ((UInt32)b[2] << 8) | b[3]);
+}
+
+float arcInfoFloat(const unsigned char *b) {
+	union { float f; UInt32 u; } bits;
+	bits.u = (UInt32)arcInfoInt(b);
+	return bits.f;
+}
+
+double arcInfoDouble(const unsigned char *b) {
+	union { double d; UInt64 u; } bits;
+	memcpy(&bits.u, b, 8);
+	bits.u = CFSwapInt64BigToHost(bits.u);
+	return bits.d;
+}
+
+/* Writes the path of a file in the folder of a grid to filePath. path is any
+ .adf file in the folder. Returns false if path is not an .adf file. */
+bool arcInfoGridFilePath(const char *path, const char *name,
+						 char *filePath, size_t filePathLength) {
+	size_t pathLength = strlen(path);
+	if (pathLength < 4 || strcasecmp(path + pathLength - 4, ".adf") != 0)
+		return FALSE;
+	const char *slash = strrchr(path, '/');
+	int folderLength = slash == NULL ? 0 : (int)(slash - path + 1);
+	int n = snprintf(filePath, filePathLength, "%.*s%s", folderLength, path, name);
+	return n > 0 && n < filePathLength;
+}
+
+/* Reads length bytes from the start of a file in the folder of a grid. The
+ metadata importer reads with a budget. */
+bool readArcInfoGridFile(const char *path, const char *name,
+						 unsigned char *buffer, size_t length, bool budget) {
+	char filePath[10240];
+	if (!arcInfoGridFilePath(path, name, filePath, sizeof(filePath)))
+		return FALSE;
+	FILE *fp = budget ? openFileWithBudget(filePath, METADATA_READ_BUDGET) : fopen(filePath, "rb");
+	if (fp == NULL)
+		return FALSE;
+	bool read = fread(buffer, 1, length, fp) == length;
+	fclose(fp);
+	return read;
+}
+
+/* Reads hdr.adf and dblbnd.adf in the folder of path. Returns false if the
+ folder does not contain a grid. */
+bool readArcInfoGridHeader(char *path, ArcInfoGridHeader *header, bool budget) {
+
+	unsigned char hdr[ARCINFO_HEADER_LENGTH], bounds[ARCINFO_BOUNDS_LENGTH];
+	if (!readArcInfoGridFile(path, "hdr.adf", hdr, sizeof(hdr), budget)
+		|| memcmp(hdr, "GRID1.", 6) != 0
+		|| !readArcInfoGridFile(path, "dblbnd.adf", bounds, sizeof(bounds), budget))
+		return FALSE;
+
+	header->cellType = arcInfoInt(hdr + 16);
+	double cellWidth = arcInfoDouble(hdr + 256);
+	double cellHeight = arcInfoDouble(hdr + 264);
+	header->tileBlockCols = arcInfoInt(hdr + 288);
+	header->tileBlockRows = arcInfoInt(hdr + 292);
+	header->blockCols = arcInfoInt(hdr + 296);
+	header->blockRows = arcInfoInt(hdr + 304);
+	if ((header->cellType != ARCINFO_INTEGER_CELLS && header->cellType != ARCINFO_FLOAT_CELLS)
+		|| !(cellWidth > 0.) || !(cellHeight > 0.)
+		|| header->tileBlockCols <= 0 || header->tileBlockRows <= 0
+		|| header->blockCols <= 0 || header->blockRows <= 0
+		|| header->blockCols * header->blockRows > 1024 * 1024)
+		return FALSE;
+
+	// the size of the grid is only stored with the bounding box
+	double cols = (arcInfoDouble(bounds + 16) - arcInfoDouble(bounds)) / cellWidth + 0.5;
+	double rows = (arcInfoDouble(bounds + 24) - arcInfoDouble(bounds + 8)) / cellHeight + 0.5;
+	if (!(cols >= 1. && cols < 1e8 && rows >= 1. && rows < 1e8))
+		return FALSE;
+	header->cols = cols;
+	header->rows = rows;
+
+	header->tileCols = header->tileBlockCols * header->blockCols;
+	header->tileRows = header->tileBlockRows * header->blockRows;
+	header->tilesPerRow = (header->cols - 1) / header->tileCols + 1;
+	header->tilesPerColumn = (header->rows - 1) / header->tileRows + 1;
+	return TRUE;
+}
+
+bool readArcInfoGridSize(char *path, long *width, long *height) {
+	ArcInfoGridHeader header;
+	if (!readArcInfoGridHeader(path, &header, TRUE))
+		return FALSE;
+	*width = header.cols;
+	*height = header.rows;
+	return TRUE;
+}
+
+unsigned char *scaleArcInfoGridToByte(float *floatBuffer, long gridSize, long cols,
+									  float minVal, float maxVal,
+									  Histogram *histogram,
+									  bool hillshade) {
+
+	if (hillshade)
+		return hillshadeFloatGrid(floatBuffer, cols, gridSize / cols, minVal, maxVal, NAN);
+
+	long i;
+	FloatStretch stretch;
+	if (!initFloatStretch(&stretch, histogram, minVal, maxVal))
+		return allocZeroedBuffer(gridSize); // return an empty gray buffer
+
+	unsigned char * grayBuffer = allocBuffer(gridSize);
+	if (grayBuffer == NULL) {
+		releaseFloatStretch(&stretch);
+		return NULL;
+	}
+	for (i = 0; i < gridSize; i++) {
+		if (!finite(floatBuffer[i]))
+			grayBuffer[i] = 255;
+		else
+			grayBuffer[i] = stretchFloat(floatBuffer[i], &stretch);
+	}
+
+	releaseFloatStretch(&stretch);
+	return grayBuffer;
+}
+
+/* Decompresses a block of integer cells. The block starts with its type, the
+ number of bytes of the minimum value and the minimum value. All cells are
+ stored relative to the minimum, either uncompressed with 1 to 32 bits per
+ cell, or as runs of equal values, literal values and void cells. Returns
+ false if the type is unknown or the block is truncated. */
+bool decodeArcInfoIntegerBlock(const unsigned char *block, long length,
+							   long nCells, SInt32 *cells) {
+
+	if (length < 2)
+		return FALSE;
+	int type = block[0];
+	int minLength = block[1];
+	if (minLength > 4 || 2 + minLength > length)
+		return FALSE;
+	SInt32 min = 0;
+	int i;
+	for (i = 0; i < minLength; i++)
+		min = (SInt32)(((UInt32)min << 8) | block[2 + i]);
+	if (minLength > 0 && minLength < 4 && block[2] > 127)
+		min -= (SInt32)1 << (8 * minLength);
+	const unsigned char *p = block + 2 + minLength;
+	const unsigned char *end = block + length;
+
+	// uncompressed cells, the type is the number of bits per cell
+	long n;
+	int bits = type == 0x01 || type == 0x04 || type == 0x08 || type == 0x10 || type == 0x20 ? type : 0;
+	if (type == 0x00) {
+		for (n = 0; n < nCells; n++)
+			cells[n] = min;
+		return TRUE;
+	}
+	if (bits > 0) {
+		if ((end - p) * 8 < nCells * bits)
+			return FALSE;
+		for (n = 0; n < nCells; n++) {
+			switch (bits) {
+				case 0x01:
+					cells[n] = ((p[n >> 3] >> (7 - (n & 7))) & 1) + min;
+					break;
+				case 0x04:
+					cells[n] = ((p[n >> 1] >> ((n & 1) ? 0 : 4)) & 0xF) + min;
+					break;
+				case 0x08:
+					cells[n] = p[n] + min;
+					break;
+				case 0x10:
+					cells[n] = ((p[2 * n] << 8) | p[2 * n + 1]) + min;
+					break;
+				default:
+					cells[n] = arcInfoInt(p + 4 * n) + min;
+			}
+		}
+		return TRUE;
+	}
+
+	// run length encoded cells: each run starts with a marker byte
+	n = 0;
+	while (n < nCells && p < end) {
+		int marker = *p++;
+		long run = marker, k;
+		SInt32 value = ARCINFO_INTEGER_NODATA;
+		switch (type) {
+			case 0xCF:	// literal 16 bit values or void cells
+			case 0xD7:	// literal 8 bit values or void cells
+				if (marker > 127) {
+					run = 256 - marker;
+					break;
+				}
+				int size = type == 0xCF ? 2 : 1;
+				if (end - p < marker * size)
+					return FALSE;
+				for (k = 0; k < marker && n < nCells; k++, p += size)
+					cells[n++] = (size == 2 ? ((p[0] << 8) | p[1]) : p[0]) + min;
+				run = 0;
+				break;
+			case 0xDF:	// runs of the minimum or of void cells
+				if (marker > 127)
+					run = 256 - marker;
+				else
+					value = min;
+				break;
+			case 0xE0:	// runs of 32 bit values
+				if (end - p < 4)
+					return FALSE;
+				value = arcInfoInt(p) + min;
+				p += 4;
+				break;
+			case 0xF0:	// runs of 16 bit values
+				if (end - p < 2)
+					return FALSE;
+				value = ((p[0] << 8) | p[1]) + min;
+				p += 2;
+				break;
+			case 0xF8:	// runs of 8 bit values
+			case 0xFC:
+				if (end - p < 1)
+					return FALSE;
+				value = *p++ + min;
+				break;
+			default:	// 0xFF is CCITT compressed 1 bit data, which is not supported
+				return FALSE;
+		}
+		for (k = 0; k < run && n < nCells; k++)
+			cells[n++] = value;
+	}
+
+	// cells after the end of the block are void
+	for (; n < nCells; n++)
+		cells[n] = ARCINFO_INTEGER_NODATA;
+	return TRUE;
+}
+
+// the block and the index file of a tile
+typedef struct {
+	int fd, indexFd;	// -1 if the tile does not exist
+	long nBlocks;		// number of blocks in the index
+} ArcInfoTile;
+
+/* Shared by the worker threads that decode the rows of blocks with sampled
+ rows. Workers take the next row of blocks and copy the sampled cells to the
+ grid. The rows are taken in the order of rowReadingOrder(), so that the
+ rows decoded before the deadline are spread over the grid. A row of blocks
+ is always completely decoded, so the rows taken are the rows decoded. */
+typedef struct {
+	ArcInfoGridHeader header;
+	ArcInfoTile *tiles;
+	long *blockRows;
+	long nBlockRows;
+	long nextBlockRow;
+	pthread_mutex_t mutex;
+
+	int sdist;
+	long rw, rh;
+	float *grid;		// void cells are NAN
+
+	bool failed;
+	CFAbsoluteTime *deadline;
+	QLPreviewRequestRef preview;
+	QLThumbnailRequestRef thumbnail;
+} ArcInfoDecoder;
+
+// each worker finds the range and the histogram of the cells it decodes
+typedef struct {
+	ArcInfoDecoder *decoder;
+	float minVal, maxVal;
+	Histogram *histogram;
+
+	unsigned char *index;		// index entries of a row of blocks
+	unsigned char *data;		// compressed blocks
+	size_t dataLength;
+	SInt32 *cells;				// a decompressed block
+} ArcInfoWorker;
+
+/* Returns the first sampled row or column at or after the cell pos, and the
+ number of sampled rows or columns in the following n cells. */
+long arcInfoSamples(long pos, long n, int sdist, long resampledSize, long *first) {
+	*first = (pos + sdist - 1) / sdist;
+	long last = (pos + n - 1) / sdist;
+	if (last >= resampledSize)
+		last = resampledSize - 1;
+	return last >= *first ? last - *first + 1 : 0;
+}
+
+/* Copies the sampled cells of a decompressed block to the grid. */
+void addArcInfoBlock(ArcInfoWorker *worker, const void *block, long blockRow, long blockCol) {
+
+	ArcInfoDecoder *decoder = worker->decoder;
+	const ArcInfoGridHeader *header = &decoder->header;
+	long row0 = blockRow * header->blockRows, col0 = blockCol * header->blockCols;
+	long r0, c0, r, c;
+	long nr = arcInfoSamples(row0, header->blockRows, decoder->sdist, decoder->rh, &r0);
+	long nc = arcInfoSamples(col0, header->blockCols, decoder->sdist, decoder->rw, &c0);
+	for (r = r0; r < r0 + nr; r++) {
+		long cell = (r * decoder->sdist - row0) * header->blockCols;
+		float *gridRow = decoder->grid + r * decoder->rw;
+		for (c = c0; c < c0 + nc; c++) {
+			long i = cell + c * decoder->sdist - col0;
+			float f;
+			if (header->cellType == ARCINFO_FLOAT_CELLS) {
+				f = arcInfoFloat((const unsigned char *)block + 4 * i);
+				if (f == ARCINFO_FLOAT_NODATA || !finite(f))
+					continue;
+			} else {
+				SInt32 v = ((const SInt32 *)block)[i];
+				if (v == ARCINFO_INTEGER_NODATA)
+					continue;
+				f = v;
+			}
+			gridRow[c] = f;
+			if (f < worker->minVal)
+				worker->minVal = f;
+			if (f > worker->maxVal)
+				worker->maxVal = f;
+			if (worker->histogram)
+				addFloatToHistogram(worker->histogram, f);
+		}
+	}
+}
+
+/* Returns an upper limit for the size of a compressed block. A block with 
+ runs of single 32 bit values uses 5 bytes per cell. */
+long arcInfoMaxBlockLength(const ArcInfoGridHeader *header) {
+	return 5 * header->blockCols * header->blockRows + 8;
+}
+
+/* Returns the position and the size in bytes of block b of the index entries
+ of a row of blocks. Returns false if the block is missing, is too large or
+ has no sampled columns. */
+bool arcInfoBlockEntry(const ArcInfoWorker *worker, long b, long blockCol,
+					   long *offset, long *length) {
+	const ArcInfoDecoder *decoder = worker->decoder;
+	const ArcInfoGridHeader *header = &decoder->header;
+	long first;
+	*offset = arcInfoInt(worker->index + b * ARCINFO_INDEX_ENTRY_LENGTH) * 2;
+	*length = arcInfoInt(worker->index + b * ARCINFO_INDEX_ENTRY_LENGTH + 4) * 2;
+	return *length > 0 && *length <= arcInfoMaxBlockLength(header)
+		&& *offset >= ARCINFO_TILE_HEADER_LENGTH
+		&& arcInfoSamples(blockCol * header->blockCols, header->blockCols,
+						  decoder->sdist, decoder->rw, &first) > 0;
+}
+
+/* Decodes the blocks with sampled columns in a row of blocks. All blocks of a
+ row of a tile are read at once if they are stored next to each other, which
+ is usually the case. Blocks that are missing or cannot be decoded are void.
+ Returns false if a file cannot be read. */
+bool decodeArcInfoBlockRow(ArcInfoWorker *worker, long blockRow) {
+
+	ArcInfoDecoder *decoder = worker->decoder;
+	const ArcInfoGridHeader *header = &decoder->header;
+	long tileRow = blockRow / header->tileBlockRows;
+	long firstBlock = (blockRow % header->tileBlockRows) * header->tileBlockCols;
+	long nCells = header->blockCols * header->blockRows;
+	long t, b;
+	for (t = 0; t < header->tilesPerRow; t++) {
+		const ArcInfoTile *tile = &decoder->tiles[tileRow * header->tilesPerRow + t];
+		long nBlocks = header->tileBlockCols;
+		if (tile->fd < 0 || firstBlock >= tile->nBlocks)
+			continue;
+		if (firstBlock + nBlocks > tile->nBlocks)
+			nBlocks = tile->nBlocks - firstBlock;
+
+		// the position and the size of each block in bytes
+		if (pread(tile->indexFd, worker->index, nBlocks * ARCINFO_INDEX_ENTRY_LENGTH,
+				  ARCINFO_TILE_HEADER_LENGTH + firstBlock * ARCINFO_INDEX_ENTRY_LENGTH)
+			!= (ssize_t)(nBlocks * ARCINFO_INDEX_ENTRY_LENGTH))
+			return FALSE;
+		long start = -1, end = 0;
+		size_t total = 0;
+		for (b = 0; b < nBlocks; b++) {
+			long offset, length;
+			if (!arcInfoBlockEntry(worker, b, t * header->tileBlockCols + b, &offset, &length))
+				continue;
+			if (start < 0 || offset < start)
+				start = offset;
+			if (offset + 2 + length > end)
+				end = offset + 2 + length;
+			total += 2 + length;
+		}
+		if (start < 0)
+			continue;
+
+		// read the blocks at once unless there are large gaps between them
+		bool span = end - start <= 2 * total;
+		size_t length = span ? end - start : arcInfoMaxBlockLength(header) + 2;
+		if (length > worker->dataLength) {
+			releaseBuffer(worker->data);
+			worker->data = allocBuffer(length);
+			worker->dataLength = worker->data ? length : 0;
+			if (worker->data == NULL)
+				return FALSE;
+		}
+		if (span && pread(tile->fd, worker->data, length, start) != (ssize_t)length)
+			return FALSE;
+
+		for (b = 0; b < nBlocks; b++) {
+			long offset, length, blockCol = t * header->tileBlockCols + b;
+			if (!arcInfoBlockEntry(worker, b, blockCol, &offset, &length))
+				continue;
+			const unsigned char *block = worker->data + (span ? offset - start : 0);
+			if (!span && pread(tile->fd, worker->data, length + 2, offset) != length + 2)
+				return FALSE;
+
+			// each block starts with its size in shorts
+			if (((block[0] << 8) | block[1]) * 2 != length)
+				continue;
+			block += 2;
+			if (header->cellType == ARCINFO_FLOAT_CELLS) {
+				if (length >= nCells * 4)
+					addArcInfoBlock(worker, block, blockRow, blockCol);
+			} else if (decodeArcInfoIntegerBlock(block, length, nCells, worker->cells))
+				addArcInfoBlock(worker, worker->cells, blockRow, blockCol);
+		}
+	}
+	return TRUE;
+}
+
+/* Worker thread: decodes rows of blocks until all are decoded, the time is
+ up or reading failed. */
+void *decodeArcInfoBlockRows(void *info) {
+	ArcInfoWorker *worker = info;
+	ArcInfoDecoder *decoder = worker->decoder;
+	setDeadline(decoder->deadline);
+	for (;;) {
+		pthread_mutex_lock(&decoder->mutex);
+		long i = decoder->nBlockRows;
+		if (!decoder->failed && (decoder->nextBlockRow == 0 || !isPastDeadline()))
+			i = decoder->nextBlockRow++;
+		pthread_mutex_unlock(&decoder->mutex);
+		if (i >= decoder->nBlockRows)
+			break;
+		if (isCancelled(decoder->preview, decoder->thumbnail)
+			|| !decodeArcInfoBlockRow(worker, decoder->blockRows[i])) {
+			decoder->failed = TRUE;
+			break;
+		}
+	}
+	setDeadline(NULL);
+	return NULL;
+}
+
+/* Writes the name of the block file of the tile at tileCol and tileRow to name,
+ or of its index file if index is true, following AIGAccessTile() of GDAL. 
+ Returns FALSE if the tile cannot be named. */
+bool arcInfoTileName(long tileCol, long tileRow, bool index, char *name, size_t nameLength) {
+	const char *suffix = index ? "x.adf" : ".adf";
+	if (tileCol + 1 > ARCINFO_MAX_TILE_NUMBER || tileRow - 1 > ARCINFO_MAX_TILE_NUMBER)
+		return FALSE;
+	if (tileRow == 0)
+		snprintf(name, nameLength, "w%03ld001%s", tileCol + 1, suffix);
+	else if (tileRow == 1)
+		snprintf(name, nameLength, "w%03ld000%s", tileCol + 1, suffix);
+	else
+		snprintf(name, nameLength, "z%03ld%03ld%s", tileCol + 1, tileRow - 1, suffix);
+	return TRUE;
+}
+
+/* Opens the block and index files of the tiles. Tiles without files are
+ void. */
+bool openArcInfoTiles(char *path, ArcInfoDecoder *decoder) {
+
+	long nTiles = decoder->header.tilesPerRow * decoder->header.tilesPerColumn;
+	decoder->tiles = malloc(nTiles * sizeof(ArcInfoTile));
+	if (decoder->tiles == NULL)
+		return FALSE;
+	long t, nFound = 0;
+	for (t = 0; t < nTiles; t++) {
+		ArcInfoTile *tile = &decoder->tiles[t];
+		char name[32], filePath[10240];
+		struct stat st;
+		tile->fd = tile->indexFd = -1;
+		tile->nBlocks = 0;
+		long tileCol = t % decoder->header.tilesPerRow;
+		long tileRow = t / decoder->header.tilesPerRow;
+		if (!arcInfoTileName(tileCol, tileRow, TRUE, name, sizeof(name))
+			|| !arcInfoGridFilePath(path, name, filePath, sizeof(filePath)))
+			continue;
+		tile->indexFd = open(filePath, O_RDONLY);
+		if (tile->indexFd < 0)
+			continue;
+		arcInfoTileName(tileCol, tileRow, FALSE, name, sizeof(name));
+		arcInfoGridFilePath(path, name, filePath, sizeof(filePath));
+		tile->fd = open(filePath, O_RDONLY);
+		if (tile->fd < 0 || fstat(tile->indexFd, &st) != 0) {
+			close(tile->indexFd);
+			tile->indexFd = -1;
+			continue;
+		}
+		tile->nBlocks = (st.st_size - ARCINFO_TILE_HEADER_LENGTH) / ARCINFO_INDEX_ENTRY_LENGTH;
+		nFound++;
+	}
+	return nFound > 0;
+}
+
+void closeArcInfoTiles(ArcInfoDecoder *decoder) {
+	long t, nTiles = decoder->header.tilesPerRow * decoder->header.tilesPerColumn;
+	for (t = 0; decoder->tiles != NULL && t < nTiles; t++) {
+		if (decoder->tiles[t].fd >= 0)
+			close(decoder->tiles[t].fd);
+		if (decoder->tiles[t].indexFd >= 0)
+			close(decoder->tiles[t].indexFd);
+	}
+	free(decoder->tiles);
+	decoder->tiles = NULL;
+}
+
+/* Returns the rows of blocks that contain sampled rows in the order of
+ rowReadingOrder(). */
+long *arcInfoBlockRows(const ArcInfoDecoder *decoder, long *nBlockRows) {
+
+	const ArcInfoGridHeader *header = &decoder->header;
+	long nRows = (header->rows - 1) / header->blockRows + 1;
+	long *sampled = malloc(nRows * sizeof(long));
+	if (sampled == NULL)
+		return NULL;
+	long b, i, first;
+	*nBlockRows = 0;
+	for (b = 0; b < nRows; b++) {
+		if (arcInfoSamples(b * header->blockRows, header->blockRows,
+						   decoder->sdist, decoder->rh, &first) > 0)
+			sampled[(*nBlockRows)++] = b;
+	}
+	long *order = rowReadingOrder(*nBlockRows, header->cols * sizeof(float) * header->blockRows);
+	if (order == NULL) {
+		free(sampled);
+		return NULL;
+	}
+	for (i = 0; i < *nBlockRows; i++)
+		order[i] = sampled[order[i]];
+	free(sampled);
+	return order;
+}
+
+/* Replaces the sampled rows in the rows of blocks that were not decoded before
+ the deadline. */
+void fillUndecodedArcInfoRows(const ArcInfoDecoder *decoder) {
+
+	long nDecoded = decoder->nextBlockRow < decoder->nBlockRows ? decoder->nextBlockRow : decoder->nBlockRows;
+	long *order = malloc(decoder->rh * sizeof(long));
+	if (order == NULL)
+		return;
+	long i, r, first, nRead = 0;
+	for (i = 0; i < nDecoded; i++) {
+		long row0 = decoder->blockRows[i] * decoder->header.blockRows;
+		long n = arcInfoSamples(row0, decoder->header.blockRows, decoder->sdist, decoder->rh, &first);
+		for (r = first; r < first + n; r++)
+			order[nRead++] = r;
+	}
+	fillUnreadRows(decoder->grid, decoder->rw * sizeof(float), decoder->rh, order, nRead);
+	free(order);
+}
+
+/* Reads the grid in the folder of an .adf file. Returns NULL if the folder
+ does not contain an ArcInfo binary grid. */
+CGImageRef readArcInfoGridImage(char *path,
+								long maxSize,
+								QLPreviewRequestRef preview,
+								QLThumbnailRequestRef thumbnail) {
+
+	ArcInfoDecoder decoder;
+	memset(&decoder, 0, sizeof(decoder));
+	if (!readArcInfoGridHeader(path, &decoder.header, FALSE))
+		return NULL;
+	if (!openArcInfoTiles(path, &decoder)) {
+		closeArcInfoTiles(&decoder);
+		return NULL;
+	}
+
+	long cols = decoder.header.cols, rows = decoder.header.rows;
+	decoder.rw = resampledWidth(cols, rows, maxSize);
+	decoder.rh = resampledHeight(cols, rows, maxSize);
+	decoder.sdist = sampleDist(cols, rows, maxSize);
+	long i, gridSize = decoder.rw * decoder.rh;
+	decoder.grid = allocBuffer(gridSize * sizeof(float));
+	decoder.blockRows = arcInfoBlockRows(&decoder, &decoder.nBlockRows);
+	if (decoder.grid == NULL || decoder.blockRows == NULL) {
+		releaseBuffer(decoder.grid);
+		free(decoder.blockRows);
+		closeArcInfoTiles(&decoder);
+		return NULL;
+	}
+
+	// missing blocks are void
+	for (i = 0; i < gridSize; i++)
+		decoder.grid[i] = NAN;
+
+	bool hillshade = hillshadePreference();
+	Histogram *histogram = hillshade ? NULL : createHistogram(stretchForFormat(CFSTR("ArcInfoGridStretch"), percentileStretch));
+	decoder.deadline = getDeadline();
+	decoder.preview = preview;
+	decoder.thumbnail = thumbnail;
+	pthread_mutex_init(&decoder.mutex, NULL);
+
+	// each worker has its own buffers, range and histogram
+	ArcInfoWorker workers[MAX_WORKER_THREADS];
+	pthread_t threads[MAX_WORKER_THREADS];
+	int maxThreads = workerThreadCount();
+	if (maxThreads > decoder.nBlockRows)
+		maxThreads = decoder.nBlockRows > 0 ? decoder.nBlockRows : 1;
+	int w, nWorkers, nThreads = 0;
+	for (nWorkers = 0; nWorkers < maxThreads; nWorkers++) {
+		ArcInfoWorker *worker = &workers[nWorkers];
+		memset(worker, 0, sizeof(ArcInfoWorker));
+		worker->decoder = &decoder;
+		worker->minVal = MAXFLOAT;
+		worker->maxVal = -MAXFLOAT;
+		worker->index = allocBuffer(decoder.header.tileBlockCols * ARCINFO_INDEX_ENTRY_LENGTH);
+		worker->cells = allocBuffer(decoder.header.blockCols * decoder.header.blockRows * sizeof(SInt32));
+		worker->histogram = histogram ? createHistogram(histogram->stretch) : NULL;
+		if (worker->index == NULL || worker->cells == NULL || (histogram && worker->histogram == NULL)) {
+			releaseBuffer(worker->index);
+			releaseBuffer(worker->cells);
+			releaseHistogram(worker->histogram);
+			break;
+		}
+	}
+	if (nWorkers == 0)
+		decoder.failed = TRUE;
+	while (nThreads < nWorkers
+		   && pthread_create(&threads[nThreads], NULL, decodeArcInfoBlockRows, &workers[nThreads]) == 0)
+		nThreads++;
+	if (nWorkers > 0 && nThreads == 0)
+		decodeArcInfoBlockRows(&workers[0]);
+	for (w = 0; w < nThreads; w++)
+		pthread_join(threads[w], NULL);
+	pthread_mutex_destroy(&decoder.mutex);
+	if (nThreads == 0)
+		setDeadline(decoder.deadline);
+	closeArcInfoTiles(&decoder);
+
+	// merge the ranges and histograms of the workers
+	float minVal = MAXFLOAT, maxVal = -MAXFLOAT;
+	for (w = 0; w < nWorkers; w++) {
+		if (workers[w].minVal < minVal)
+			minVal = workers[w].minVal;
+		if (workers[w].maxVal > maxVal)
+			maxVal = workers[w].maxVal;
+		if (workers[w].histogram)
+			mergeHistogram(histogram, workers[w].histogram);
+		releaseHistogram(workers[w].histogram);
+		releaseBuffer(workers[w].index);
+		releaseBuffer(workers[w].data);
+		releaseBuffer(workers[w].cells);
+	}
+
+	if (decoder.failed || isCancelled(preview, thumbnail)) {
+		releaseHistogram(histogram);
+		releaseBuffer(decoder.grid);
+		free(decoder.blockRows);
+		return NULL;
+	}
+	fillUndecodedArcInfoRows(&decoder);
+	free(decoder.blockRows);
+
+	unsigned char *grayBuffer = scaleArcInfoGridToByte(decoder.grid, gridSize, decoder.rw,
+													   minVal, maxVal, histogram, hillshade);
+	releaseHistogram(histogram);
+	releaseBuffer(decoder.grid);
+	if (grayBuffer == NULL)
+		return NULL;
+
+	// the gradation curve is only applied to stretched values
+	if (hillshade)
+		return createGradedGrayScaleImage(grayBuffer, decoder.rw, decoder.rh);
+	return createGrayScaleImage(grayBuffer, decoder.rw, decoder.rh);
+
+}
@@ -0,0 +1,21 @@
+/*
+ *  ArcInfoGridToImage.h
+ *  GISLook
+ *
+ */
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <CoreFoundation/CFPlugInCOM.h>
+#include <CoreServices/CoreServices.h>
+#include <QuickLook/QuickLook.h>
+
+#ifndef __ARCINFOGRID2IMAGE__
+#define __ARCINFOGRID2IMAGE__
+
+bool readArcInfoGridSize(char *path, long *width, long *height);
+CGImageRef readArcInfoGridImage(char *path,
+								long maxSize,
+								QLPreviewRequestRef preview,
+								QLThumbnailRequestRef thumbnail);
+
+#endif
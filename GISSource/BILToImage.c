@@ -11,6 +11,10 @@
 #include "File.h"
 #include "HdrFile.h"
 #include "ReadRaster.h"
+#include "BufferPool.h"
+#include "Stretch.h"
+#include "Hillshade.h"
+#include "BoxFilter.h"
 
 bool readBILSize(char *path, long *width, long *height) {
 	
@@ -25,7 +29,7 @@ bool readBILSize(char *path, long *width, long *height) {
 	char * hdrPath = changeExtension(path, "hdr");
 	if (hdrPath == NULL)
 		return FALSE;
-	FILE *hdrfp = fopen(hdrPath, "r");
+	FILE *hdrfp = openFileWithBudget(hdrPath, METADATA_READ_BUDGET);
 	free(hdrPath);
 	if (hdrfp == NULL)
 		return FALSE;
@@ -50,6 +54,70 @@ bool readBILSize(char *path, long *width, long *height) {
 	return TRUE;
 }
 
+/* Returns the distance in bytes between two rows of the first band. Rows of
+ all bands alternate in BIL and BIP files, BSQ files store the bands one 
+ after the other, with rows that are padded to bandRowBytes if the header
+ defines it. */
+unsigned long firstBandRowStride(int layout, 
+								 unsigned long rowLength, 
+								 unsigned long bandRowBytes, 
+								 unsigned long totalRowBytes) {
+	if (layout == bsq)
+		return bandRowBytes > 0 ? bandRowBytes : rowLength;
+	if (totalRowBytes == 0)
+		return rowLength;
+	return totalRowBytes;
+}
+
+/* Stretches 8 bit values between minVal and maxVal to 0..255. The no data 
+ value 255 is not changed. */
+void stretch8BitGrid(unsigned char *grid, long gridSize, unsigned char minVal, unsigned char maxVal) {
+	short diff = maxVal - minVal;
+	if (diff <= 0)
+		return;
+	long i;
+	for (i = 0; i < gridSize; i++) {
+		short v = grid[i];
+		if (v != 255)
+			grid[i] = (unsigned char)((v - minVal) * 255 / diff);
+	}
+}
+
+/* Converts 16 bit values between minVal and maxVal to stretched and graded 
+ gray values, or to a hillshade. The grid and the histogram are not 
+ released. */
+unsigned char *scale16BitGrid(const short *grid, long rw, long rh, 
+							  short minVal, short maxVal, short voidValue,
+							  Histogram *histogram, bool hillshade) {
+	
+	if (hillshade)
+		return hillshadeShortGrid(grid, rw, rh, minVal, maxVal, &voidValue, 1);
+	
+	// scale to gray values
+	long diff = maxVal - minVal;
+	long gridSize = rw*rh;
+	if (diff <= 0)
+		return allocZeroedBuffer(gridSize); // return an empty gray buffer
+	
+	// allocate buffer for gray pixels
+	unsigned char * grayBuffer = allocBuffer(gridSize);
+	unsigned char * table = createStretchedShortToGrayTable(histogram, minVal, maxVal);
+	if (grayBuffer == NULL || table == NULL) {
+		releaseBuffer(grayBuffer);
+		releaseBuffer(table);
+		return NULL;
+	}
+	table[(unsigned short)voidValue] = 255;
+	
+	// convert shorts to stretched and graded gray values
+	long i;
+	for (i = 0; i < gridSize; i++)
+		grayBuffer[i] = table[(unsigned short)grid[i]];
+	
+	releaseBuffer(table);
+	return grayBuffer;
+}
+
 unsigned char * read8BitGrid(FILE *fp,
 							 unsigned long nrows, 
 							 unsigned long ncols, 
@@ -62,37 +130,75 @@ unsigned char * read8BitGrid(FILE *fp,
 							 unsigned long  totalRowBytes, 
 							 unsigned long bandGapBytes,
 							 float noDataValue,
+							 long maxSize,
 							 QLPreviewRequestRef preview,
 							 QLThumbnailRequestRef thumbnail) {
 	
-	long rw = resampledWidth(ncols, nrows);
-	long rh = resampledHeight(ncols, nrows);
-	int sdist = sampleDist(ncols, nrows);
+	long rw = resampledWidth(ncols, nrows, maxSize);
+	long rh = resampledHeight(ncols, nrows, maxSize);
+	int sdist = sampleDist(ncols, nrows, maxSize);
 	
-	unsigned char *grid = malloc(rw * rh);
-	unsigned char *line = malloc(ncols);
 	size_t rowLength = (ncols * nbits) / 8L;
+	unsigned long rowStride = firstBandRowStride(layout, rowLength, bandRowBytes, totalRowBytes);
 	
-	unsigned long col, row;
-	long cell = 0;
+	// read all rows and average them if only short rows would be skipped
+	BoxFilter box = {0};
+	VoidSamples voids;
+	initVoidSamples(&voids);
+	voids.voidValues[0] = noDataValue;
+	bool boxFilter = useBoxFilter(sdist, rowStride);
+	if (boxFilter && !initBoxFilter(&box, fp, skipBytes, rowStride, nrows, ncols,
+									 uint8Sample, FALSE, sdist, &voids))
+		return NULL;
+	
+	unsigned char *grid = allocBuffer(rw * rh);
+	unsigned char *line = allocBuffer(ncols);
+	long *order = boxFilter ? boxFilterRowOrder(&box, rh, FALSE) : rowReadingOrder(rh, rowLength);
+	if (grid == NULL || line == NULL || order == NULL) {
+		releaseBuffer(grid);
+		releaseBuffer(line);
+		free(order);
+		releaseBoxFilter(&box);
+		return NULL;
+	}
+	
+	unsigned long col;
+	long i;
 	unsigned char minVal = 255;
 	unsigned char maxVal = 0;
 	
-	for (row = 0; row < nrows; row += sdist) {
+	for (i = 0; i < rh; i++) {
 		
 		// check whether we should abort
-		if (row % 30 == 0 && isCancelled(preview, thumbnail)) {
-			free(line);
-			free(grid);
+		if (i % 30 == 0 && isCancelled(preview, thumbnail)) {
+			releaseBuffer(line);
+			releaseBuffer(grid);
+			free(order);
+			releaseBoxFilter(&box);
 			return NULL;			
 		}
 		
-		if (fread (line, 1, ncols, fp) != ncols) {
-			free(line);
-			free(grid);
+		// stop when out of time and use the rows read so far
+		if (i > 0 && isPastDeadline())
+			break;
+		
+		// read the row of the first band, or average the rows of a row of boxes
+		unsigned long row = order[i] * sdist;
+		bool read;
+		if (boxFilter)
+			read = readBoxFilteredLine(&box, order[i], line);
+		else
+			read = fseek (fp, skipBytes + row * rowStride, SEEK_SET) == 0
+				&& fread (line, 1, ncols, fp) == ncols;
+		if (!read) {
+			releaseBuffer(line);
+			releaseBuffer(grid);
+			free(order);
+			releaseBoxFilter(&box);
 			return NULL;			
 		}
 		
+		long cell = order[i] * rw;
 		for (col = 0; col < ncols; col += sdist) {
 			short s = line[col];
 			if (s == noDataValue)
@@ -106,39 +212,21 @@ unsigned char * read8BitGrid(FILE *fp,
 			}
 		}
 		
-		int r;
-		for (r = 0; r <= sdist; r++) {
-			// overread empty row ends in bil files
-			if (fseek (fp, bandRowBytes - rowLength, SEEK_CUR) != 0
-				// overread following bands
-				|| fseek (fp, bandRowBytes * (nbands - 1L), SEEK_CUR) != 0
-				// overread empty data at end of bands
-				|| fseek (fp, totalRowBytes - bandRowBytes * nbands, SEEK_CUR) != 0) 
-			{
-				free(line);
-				free(grid);
-				return NULL;
-			}
-			
-			// overread next lines
-			if (r + 1 < sdist)
-				fseek (fp , ncols, SEEK_CUR);
+		// show the rows read so far at the end of a coarse pass
+		if (isCoarseFrameDue(order, rh, i + 1)) {
+			unsigned char *frame = copyGridWithUnreadRows(grid, rw, rh, order, i + 1);
+			if (frame)
+				stretch8BitGrid(frame, rw * rh, minVal, maxVal);
+			drawCoarseFrame(frame, rw, rh, FALSE);
 		}
 	}
-	free (line);
+	releaseBoxFilter(&box);
+	fillUnreadRows(grid, rw, rh, order, i);
+	free(order);
+	releaseBuffer(line);
 	
 	// scale to gray values
-	short diff = maxVal - minVal;
-	long gridSize = rw*rh;
-	if (diff <= 0)
-		return grid; // return an empty gray buffer
-	long i;
-	for (i = 0; i < gridSize; i++) {
-		short v = grid[i];
-		if (v != 255)
-			grid[i] = (unsigned char)((v - minVal) * 255 / diff);
-	}
-	
+	stretch8BitGrid(grid, rw * rh, minVal, maxVal);
 	return grid;
 	
 }
@@ -156,39 +244,82 @@ unsigned char * read16BitGrid(FILE *fp,
 							  unsigned long bandGapBytes,
 							  float noDataValue, 
 							  bool swap,
+							  long maxSize,
 							  QLPreviewRequestRef preview,
 							  QLThumbnailRequestRef thumbnail) {
 	
 	short voidValue = -32768;
 	
-	long rw = resampledWidth(ncols, nrows);
-	long rh = resampledHeight(ncols, nrows);
-	int sdist = sampleDist(ncols, nrows);
+	long rw = resampledWidth(ncols, nrows, maxSize);
+	long rh = resampledHeight(ncols, nrows, maxSize);
+	int sdist = sampleDist(ncols, nrows, maxSize);
 	
-	short *grid = malloc(sizeof(short) * rw * rh);
-	short *line = malloc(sizeof(short) * ncols);
 	size_t rowLength = (ncols * nbits) / 8L;
+	unsigned long rowStride = firstBandRowStride(layout, rowLength, bandRowBytes, totalRowBytes);
+	
+	// read all rows and average them if only short rows would be skipped
+	BoxFilter box = {0};
+	VoidSamples voids;
+	initVoidSamples(&voids);
+	voids.voidValues[0] = noDataValue;
+	bool boxFilter = useBoxFilter(sdist, rowStride);
+	if (boxFilter && !initBoxFilter(&box, fp, skipBytes, rowStride, nrows, ncols,
+									 int16Sample, swap, sdist, &voids))
+		return NULL;
+	
+	short *grid = allocBuffer(sizeof(short) * rw * rh);
+	short *line = allocBuffer(sizeof(short) * ncols);
+	long *order = boxFilter ? boxFilterRowOrder(&box, rh, FALSE) : rowReadingOrder(rh, rowLength);
+	if (grid == NULL || line == NULL || order == NULL) {
+		releaseBuffer(grid);
+		releaseBuffer(line);
+		free(order);
+		releaseBoxFilter(&box);
+		return NULL;
+	}
 	
+	// find min and max values and count values for the stretch
+	bool hillshade = hillshadePreference();
+	Histogram *histogram = hillshade ? NULL : createHistogram(stretchForFormat(CFSTR("BILStretch"), percentileStretch));
 	short minVal = 32767;
 	short maxVal = -32768;
 	
-	unsigned long col, row;
-	long cell = 0;
-	for (row = 0; row < nrows; row += sdist) {
+	unsigned long col;
+	long i;
+	for (i = 0; i < rh; i++) {
 		
 		// check whether we should abort
-		if (row % 30 == 0 && isCancelled(preview, thumbnail)) {
-			free(line);
-			free(grid);
+		if (i % 30 == 0 && isCancelled(preview, thumbnail)) {
+			releaseBuffer(line);
+			releaseBuffer(grid);
+			releaseHistogram(histogram);
+			free(order);
+			releaseBoxFilter(&box);
 			return NULL;			
 		}
 		
-		if (fread (line, 1, 2 * ncols, fp) != 2 * ncols) {
-			free(line);
-			free(grid);
+		// stop when out of time and use the rows read so far
+		if (i > 0 && isPastDeadline())
+			break;
+		
+		// read the row of the first band, or average the rows of a row of boxes
+		unsigned long row = order[i] * sdist;
+		bool read;
+		if (boxFilter)
+			read = readBoxFilteredLine(&box, order[i], line);
+		else
+			read = fseek (fp, skipBytes + row * rowStride, SEEK_SET) == 0
+				&& fread (line, 1, 2 * ncols, fp) == 2 * ncols;
+		if (!read) {
+			releaseBuffer(line);
+			releaseBuffer(grid);
+			releaseHistogram(histogram);
+			free(order);
+			releaseBoxFilter(&box);
 			return NULL;			
 		}
 		
+		long cell = order[i] * rw;
 		for (col = 0; col < ncols; col += sdist) {
 			short s = line[col];
 			if (swap)
@@ -201,72 +332,37 @@ unsigned char * read16BitGrid(FILE *fp,
 					maxVal = s;
 				if (s < minVal)
 					minVal = s;
+				if (histogram)
+					addShortToHistogram(histogram, s);
 				grid[cell++] = s;
 			}
 		}
 		
-		int r;
-		for (r = 0; r <= sdist; r++) {
-			// overread empty row ends in bil files
-			if (fseek (fp, bandRowBytes - rowLength, SEEK_CUR) != 0) {
-				free(line);
-				free(grid);
-				return NULL;
+		// show the rows read so far at the end of a coarse pass
+		if (isCoarseFrameDue(order, rh, i + 1)) {
+			short *frame = copyGridWithUnreadRows(grid, rw * sizeof(short), rh, order, i + 1);
+			if (frame) {
+				drawCoarseFrame(scale16BitGrid(frame, rw, rh, minVal, maxVal, voidValue, histogram, hillshade),
+								rw, rh, TRUE);
+				releaseBuffer(frame);
 			}
-			
-			// overread following bands
-			if (layout != bsq && fseek (fp, bandRowBytes * (nbands - 1L), SEEK_CUR) != 0) {
-				free(line);
-				free(grid);
-				return NULL;
-			}
-			
-			// overread empty data at end of bands
-			if (fseek (fp, totalRowBytes - bandRowBytes * nbands, SEEK_CUR) != 0) {
-				free(line);
-				free(grid);
-				return NULL;
-			}
-			
-			// overread next lines
-			if (r + 1 < sdist)
-				fseek (fp , ncols * 2, SEEK_CUR);
 		}
 	}
-	free (line);
-	
-	// scale to gray values
-	long diff = maxVal - minVal;
-	long gridSize = rw*rh;
-	if (diff <= 0) {
-		free (grid);
-		return calloc(gridSize, 1); // return an empty gray buffer
-	}
-	
-	// allocate buffer for gray pixels
-	unsigned char * grayBuffer = malloc(gridSize);
-	if (grayBuffer == NULL) {
-		free (grid);
-		return NULL;
-	}
-	
-	// scale shorts to unsigned chars
-	long i;
-	for (i = 0; i < gridSize; i++) {
-		long v = grid[i];
-		if (v == voidValue)
-			grayBuffer[i] = 255;
-		else
-			grayBuffer[i] = (unsigned char)((v - minVal) * 255 / diff);
-	}
+	releaseBoxFilter(&box);
+	fillUnreadRows(grid, rw * sizeof(short), rh, order, i);
+	free(order);
+	releaseBuffer(line);
 	
-	free (grid);
+	unsigned char *grayBuffer = scale16BitGrid(grid, rw, rh, minVal, maxVal, voidValue, histogram, hillshade);
+	releaseHistogram(histogram);
+	releaseBuffer(grid);
 	return grayBuffer;
 	
 }
 
 CGImageRef readBILImage(FILE *fp,
 						char *path,
+						long maxSize,
 						QLPreviewRequestRef preview,
 						QLThumbnailRequestRef thumbnail) {
 	
@@ -330,6 +426,7 @@ CGImageRef readBILImage(FILE *fp,
 									  byteOrderMotorola, layout, skipBytes,
 									  bandRowBytes, totalRowBytes, bandGapBytes,
 									  noDataValue,
+									  maxSize,
 									  preview,
 									  thumbnail);
 		}
@@ -340,6 +437,7 @@ CGImageRef readBILImage(FILE *fp,
 									   byteOrderMotorola, layout, skipBytes,
 									   bandRowBytes, totalRowBytes, bandGapBytes,
 									   noDataValue, swap,
+									   maxSize,
 									   preview,
 									   thumbnail);
 		}
@@ -350,9 +448,12 @@ CGImageRef readBILImage(FILE *fp,
 			break;
 	}
 	
-	long rw = resampledWidth(ncols, nrows);
-	long rh = resampledHeight(ncols, nrows);
+	long rw = resampledWidth(ncols, nrows, maxSize);
+	long rh = resampledHeight(ncols, nrows, maxSize);
 	
-	return createGrayScaleImage(grayBuffer, rw, rh);;
+	// 16 bit values are converted to graded gray values with a table
+	if (nbits == 16)
+		return createGradedGrayScaleImage(grayBuffer, rw, rh);
+	return createGrayScaleImage(grayBuffer, rw, rh);
 	
 }
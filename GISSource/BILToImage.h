@@ -18,6 +18,7 @@
 bool readBILSize(char *path, long *width, long *height);
 CGImageRef readBILImage(FILE * fp,
 								   char *path,
+								   long maxSize,
 								   QLPreviewRequestRef preview,
 								   QLThumbnailRequestRef thumbnail);
 
@@ -0,0 +1,331 @@
+/*
+ *  BoxFilter.c
+ *  GISLook
+ *
+ */
+
+/* Decimation by averaging boxes of sdist x sdist samples. Readers that sample 
+ every sdist-th row seek over the rows in between. If the skipped rows are 
+ short, the seeks save little I/O, but they defeat the read-ahead of the 
+ system, which is slow on network volumes, and the sampled grid is aliased. 
+ In this case readers use a box filter instead, which reads all rows 
+ sequentially in large blocks and averages the samples in each box. 
+ 
+ The averages are written to the line buffer of the reader, encoded like the
+ samples in the file, at the position of every sdist-th sample. The reader 
+ then converts the line as if it had read it from the file. Void samples are 
+ not included in the averages. A box without valid samples is void. 
+ 
+ Each row is first decoded to doubles with a loop for its sample type, so 
+ that the type and the byte order are tested once per row and not for every 
+ sample. The doubles are then added to sums per column with a mask for void 
+ samples, and the columns are summed per box once for every row of boxes. 
+ 
+ Rows are read in blocks that contain a whole number of rows of boxes. The 
+ rows of boxes of a block are read from the block in any order, and blocks are
+ read in sequence unless a reader with a deadline needs a coarse version of
+ the grid first, see boxFilterRowOrder(). */
+
+#include "BoxFilter.h"
+#include "BufferPool.h"
+#include "ReadRaster.h"
+#include <math.h>
+#include <string.h>
+
+/* Returns true if rows should be read sequentially and averaged, instead of 
+ seeking to every sdist-th row. rowStride is the distance in bytes between
+ the starts of two rows in the file. */
+bool useBoxFilter(int sdist, size_t rowStride) {
+	return sdist > 1 && (sdist - 1) * rowStride <= BOX_FILTER_MAX_SKIP;
+}
+
+size_t sampleSize(SampleType type) {
+	switch (type) {
+		case uint8Sample:
+			return 1;
+		case int16Sample:
+		case uint16Sample:
+			return 2;
+		case float32Sample:
+			return 4;
+		default:
+			return 8;
+	}
+}
+
+void swapSampleBytes(unsigned char *b, size_t size) {
+	size_t i;
+	for (i = 0; i < size / 2; i++) {
+		unsigned char t = b[i];
+		b[i] = b[size - 1 - i];
+		b[size - 1 - i] = t;
+	}
+}
+
+/* Decodes a row of samples to box->values. Rows in the block are not aligned
+ to the size of the samples, so samples are copied with memcpy of a constant
+ size, which compilers replace with a load. */
+void decodeBoxFilterRow(BoxFilter *box, const unsigned char *samples) {
+	
+	double *values = box->values;
+	long col, cols = box->cols;
+	bool swap = box->swap;
+	switch (box->type) {
+		case uint8Sample:
+			for (col = 0; col < cols; col++)
+				values[col] = samples[col];
+			break;
+		case int16Sample:
+		case uint16Sample: {
+			bool isSigned = box->type == int16Sample;
+			for (col = 0; col < cols; col++) {
+				UInt16 v;
+				memcpy(&v, samples + col * 2, 2);
+				if (swap)
+					v = CFSwapInt16(v);
+				values[col] = isSigned ? (double)(SInt16)v : (double)v;
+			}
+			break;
+		}
+		case float32Sample:
+			for (col = 0; col < cols; col++) {
+				union { UInt32 u; float f; } v;
+				memcpy(&v.u, samples + col * 4, 4);
+				if (swap)
+					v.u = CFSwapInt32(v.u);
+				values[col] = v.f;
+			}
+			break;
+		default:
+			for (col = 0; col < cols; col++) {
+				union { UInt64 u; double d; } v;
+				memcpy(&v.u, samples + col * 8, 8);
+				if (swap)
+					v.u = CFSwapInt64(v.u);
+				values[col] = v.d;
+			}
+			break;
+	}
+	
+}
+
+void encodeSample(const BoxFilter *box, double v, unsigned char *sample) {
+	unsigned char b[8];
+	switch (box->type) {
+		case uint8Sample:
+			b[0] = (unsigned char)floor(v + 0.5);
+			break;
+		case int16Sample:
+			*(short *)b = (short)floor(v + 0.5);
+			break;
+		case uint16Sample:
+			*(unsigned short *)b = (unsigned short)floor(v + 0.5);
+			break;
+		case float32Sample:
+			*(float *)b = v;
+			break;
+		default:
+			*(double *)b = v;
+			break;
+	}
+	if (box->swap)
+		swapSampleBytes(b, box->sampleSize);
+	memcpy(sample, b, box->sampleSize);
+}
+
+/* Initializes voids such that all samples except NaN are valid. */
+void initVoidSamples(VoidSamples *voids) {
+	voids->validMin = -HUGE_VAL;
+	voids->validMax = HUGE_VAL;
+	voids->voidValues[0] = voids->voidValues[1] = NAN;
+}
+
+/* Initializes a box filter for a grid with rows x cols samples of type. The 
+ first row starts at dataStart in the file, and rows are rowStride bytes 
+ apart. swap is true if the bytes of the samples have to be swapped. voids 
+ may be NULL if the grid has no void values. */
+bool initBoxFilter(BoxFilter *box, 
+				   FILE *fp, long dataStart, size_t rowStride, long rows, long cols,
+				   SampleType type, bool swap, int sdist, const VoidSamples *voids) {
+	
+	memset(box, 0, sizeof(BoxFilter));
+	box->type = type;
+	box->sampleSize = sampleSize(type);
+	box->swap = swap;
+	if (voids != NULL)
+		box->voids = *voids;
+	else
+		initVoidSamples(&box->voids);
+	box->cols = cols;
+	box->sdist = sdist;
+	box->fp = fp;
+	box->dataStart = dataStart;
+	box->rowStride = rowStride;
+	box->rowBytes = cols * box->sampleSize;
+	box->rows = rows;
+	box->blockFirstRow = 0;
+	box->blockRows = 0;
+	box->rowsPerBlock = BOX_FILTER_BLOCK_SIZE / rowStride / sdist * sdist;
+	if (box->rowsPerBlock < sdist)
+		box->rowsPerBlock = sdist;
+	
+	box->values = allocBuffer(cols * sizeof(double));
+	box->sums = allocBuffer(cols * sizeof(double));
+	box->counts = allocBuffer(cols * sizeof(double));
+	box->block = allocBuffer(box->rowsPerBlock * rowStride);
+	if (box->values == NULL || box->sums == NULL || box->counts == NULL 
+		|| box->block == NULL) {
+		releaseBoxFilter(box);
+		return FALSE;
+	}
+	return TRUE;
+	
+}
+
+/* Returns the order in which a reader reads the rows of boxes. Blocks of rows
+ are read in the order of rowReadingOrder(), so that a reader that stops at a
+ deadline has a coarse version of a large grid, and the rows of boxes of a 
+ block are read in sequence. bottomUp is true if the rows of the image are 
+ stored from the last to the first row of boxes, as in Surfer grids. The 
+ returned rows are rows of the image; the array must be released with 
+ free(). */
+long *boxFilterRowOrder(const BoxFilter *box, long boxRows, bool bottomUp) {
+	
+	long boxRowsPerBlock = box->rowsPerBlock / box->sdist;
+	long nBlocks = (boxRows + boxRowsPerBlock - 1) / boxRowsPerBlock;
+	long *blockOrder = rowReadingOrder(nBlocks, box->rowsPerBlock * box->rowStride);
+	long *order = malloc(boxRows * sizeof(long));
+	if (blockOrder == NULL || order == NULL) {
+		free(blockOrder);
+		free(order);
+		return NULL;
+	}
+	
+	// the blocks and the rows in a block are ordered from the top of the image
+	long i, n = 0, boxRow;
+	for (i = 0; i < nBlocks; i++) {
+		long block = bottomUp ? nBlocks - 1 - blockOrder[i] : blockOrder[i];
+		long first = block * boxRowsPerBlock;
+		long end = first + boxRowsPerBlock;
+		if (end > boxRows)
+			end = boxRows;
+		if (bottomUp) {
+			for (boxRow = end - 1; boxRow >= first; boxRow--)
+				order[n++] = boxRows - 1 - boxRow;
+		} else {
+			for (boxRow = first; boxRow < end; boxRow++)
+				order[n++] = boxRow;
+		}
+	}
+	free(blockOrder);
+	return order;
+	
+}
+
+/* Makes sure the rows from firstRow to endRow - 1 of a row of boxes are in 
+ the block. The block containing them is read, which starts at a multiple of
+ rowsPerBlock, so that all rows of boxes of a block are read at once whether
+ they are read from the first to the last row or in the reverse order. */
+bool readBoxFilterBlock(BoxFilter *box, long firstRow, long endRow) {
+	
+	if (firstRow >= box->blockFirstRow && endRow <= box->blockFirstRow + box->blockRows)
+		return TRUE;
+	long start = firstRow / box->rowsPerBlock * box->rowsPerBlock;
+	long end = start + box->rowsPerBlock;
+	if (end > box->rows)
+		end = box->rows;
+	
+	// the last row in the block may not be followed by other bands
+	size_t bytes = (end - start - 1) * box->rowStride + box->rowBytes;
+	if (fseek(box->fp, box->dataStart + start * box->rowStride, SEEK_SET) != 0
+		|| fread(box->block, 1, bytes, box->fp) != bytes) {
+		box->blockRows = 0;
+		return FALSE;
+	}
+	box->blockFirstRow = start;
+	box->blockRows = end - start;
+	return TRUE;
+	
+}
+
+/* Adds the decoded samples in box->values to the sums and the numbers of 
+ valid samples of their columns. Void samples are masked with a select 
+ instead of skipped with a branch, so that compilers can vectorize the loop. 
+ NaN samples are void, and would not become zero if multiplied by zero. */
+void addRowToColumns(BoxFilter *box) {
+	
+	const double *values = box->values;
+	double *sums = box->sums;
+	double *counts = box->counts;
+	const double validMin = box->voids.validMin;
+	const double validMax = box->voids.validMax;
+	const double void0 = box->voids.voidValues[0];
+	const double void1 = box->voids.voidValues[1];
+	long col, cols = box->cols;
+	for (col = 0; col < cols; col++) {
+		double v = values[col];
+		// one select per test, as && would add a branch per test
+		double valid = v >= validMin ? 1. : 0.;
+		valid = v <= validMax ? valid : 0.;
+		valid = v != void0 ? valid : 0.;
+		valid = v != void1 ? valid : 0.;
+		sums[col] += valid > 0. ? v : 0.;
+		counts[col] += valid;
+	}
+	
+}
+
+/* Reads the sdist rows of a row of boxes and writes the average of each box to
+ every sdist-th sample of line, which has the size of a row in the file. Rows
+ of boxes can be read in any order, but are read fastest in the order of 
+ boxFilterRowOrder(). A box without valid samples is set to its last sample,
+ which is void. Returns FALSE if the rows cannot be read. */
+bool readBoxFilteredLine(BoxFilter *box, long boxRow, void *line) {
+	
+	memset(box->sums, 0, box->cols * sizeof(double));
+	memset(box->counts, 0, box->cols * sizeof(double));
+	
+	long row, firstRow = boxRow * box->sdist;
+	long endRow = firstRow + box->sdist;
+	if (endRow > box->rows)
+		endRow = box->rows;
+	if (!readBoxFilterBlock(box, firstRow, endRow))
+		return FALSE;
+	const unsigned char *samples = NULL;
+	for (row = firstRow; row < endRow; row++) {
+		samples = box->block + (row - box->blockFirstRow) * box->rowStride;
+		decodeBoxFilterRow(box, samples);
+		addRowToColumns(box);
+	}
+	
+	// sum the columns of each box
+	long col = 0, b, nBoxes = (box->cols + box->sdist - 1) / box->sdist;
+	unsigned char *sample = line;
+	for (b = 0; b < nBoxes; b++, sample += box->sdist * box->sampleSize) {
+		long end = col + box->sdist;
+		if (end > box->cols)
+			end = box->cols;
+		double sum = 0, count = 0;
+		for (; col < end; col++) {
+			sum += box->sums[col];
+			count += box->counts[col];
+		}
+		if (count > 0)
+			encodeSample(box, sum / count, sample);
+		else
+			memcpy(sample, samples + (end - 1) * box->sampleSize, box->sampleSize);
+	}
+	return TRUE;
+	
+}
+
+void releaseBoxFilter(BoxFilter *box) {
+	releaseBuffer(box->values);
+	releaseBuffer(box->sums);
+	releaseBuffer(box->counts);
+	releaseBuffer(box->block);
+	box->values = NULL;
+	box->sums = NULL;
+	box->counts = NULL;
+	box->block = NULL;
+}
@@ -0,0 +1,76 @@
+/*
+ *  BoxFilter.h
+ *  GISLook
+ *
+ */
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <stdio.h>
+
+#ifndef __GISLOOK_BOXFILTER__
+#define __GISLOOK_BOXFILTER__
+
+// rows are read sequentially and averaged if the bytes skipped between two 
+// sampled rows are not more than this
+#define BOX_FILTER_MAX_SKIP (64 * 1024)
+
+// number of bytes read at once when reading rows sequentially
+#define BOX_FILTER_BLOCK_SIZE (256 * 1024)
+
+typedef enum {
+	uint8Sample,
+	int16Sample,
+	uint16Sample,
+	float32Sample,
+	float64Sample
+} SampleType;
+
+// A decoded sample is void if it is not between validMin and validMax, or if 
+// it equals one of the voidValues. Initialized with initVoidSamples() to 
+// values that accept all samples except NaN.
+typedef struct {
+	double validMin, validMax;
+	double voidValues[2];
+} VoidSamples;
+
+typedef struct {
+	
+	// the samples
+	SampleType type;
+	size_t sampleSize;
+	bool swap;
+	VoidSamples voids;
+	long cols;
+	int sdist;
+	
+	// a row of decoded samples
+	double *values;
+	
+	// sums and numbers of valid samples for each column of the current row of 
+	// boxes
+	double *sums;
+	double *counts;
+	
+	// rows are read in blocks
+	FILE *fp;
+	long dataStart;
+	size_t rowStride;
+	size_t rowBytes;
+	long rows;
+	unsigned char *block;
+	long blockFirstRow;
+	long blockRows;
+	long rowsPerBlock;	// a multiple of sdist
+	
+} BoxFilter;
+
+bool useBoxFilter(int sdist, size_t rowStride);
+void initVoidSamples(VoidSamples *voids);
+bool initBoxFilter(BoxFilter *box, 
+				   FILE *fp, long dataStart, size_t rowStride, long rows, long cols,
+				   SampleType type, bool swap, int sdist, const VoidSamples *voids);
+long *boxFilterRowOrder(const BoxFilter *box, long boxRows, bool bottomUp);
+bool readBoxFilteredLine(BoxFilter *box, long boxRow, void *line);
+void releaseBoxFilter(BoxFilter *box);
+
+#endif
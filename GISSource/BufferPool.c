@@ -0,0 +1,101 @@
+/*
+ *  BufferPool.c
+ *  GISLook
+ *
+ */
+
+/* A pool of released buffers for grids, lines and gray pixels. The QuickLook
+ plug-in is loaded by a process that serves many requests, and each request
+ allocates buffers of similar sizes. Instead of returning these buffers to the 
+ system, released buffers are kept for later requests. Buffer sizes are 
+ rounded up to a power of two, so that a released buffer can be reused for 
+ any smaller size of the same class. Buffers allocated with allocBuffer() must
+ be released with releaseBuffer() and never with free(). */
+
+#include "BufferPool.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+// stored in front of each buffer. 16 bytes to keep the buffer aligned for doubles and vectors.
+typedef struct {
+	long sizeClass;		// -1 for buffers that are larger than the largest class
+	long padding;
+} BufferHeader;
+
+static void *freeBuffers[POOL_SIZE_CLASSES][POOL_BUFFERS_PER_CLASS];
+static int freeBufferCount[POOL_SIZE_CLASSES];
+static size_t pooledBytes = 0;
+static pthread_mutex_t poolMutex = PTHREAD_MUTEX_INITIALIZER;
+
+size_t classSize(long sizeClass) {
+	return (size_t)POOL_MIN_BUFFER_SIZE << sizeClass;
+}
+
+/* Returns the smallest size class that can hold size bytes, or -1 if size is 
+ larger than the largest class. */
+long sizeClassForSize(size_t size) {
+	long sizeClass;
+	for (sizeClass = 0; sizeClass < POOL_SIZE_CLASSES; sizeClass++) {
+		if (size <= classSize(sizeClass))
+			return sizeClass;
+	}
+	return -1;
+}
+
+/* Returns a buffer with at least size bytes. The content of the buffer is 
+ undefined. */
+void *allocBuffer(size_t size) {
+	
+	long sizeClass = sizeClassForSize(size);
+	BufferHeader *header = NULL;
+	
+	if (sizeClass >= 0) {
+		pthread_mutex_lock(&poolMutex);
+		if (freeBufferCount[sizeClass] > 0) {
+			header = freeBuffers[sizeClass][--freeBufferCount[sizeClass]];
+			pooledBytes -= classSize(sizeClass);
+		}
+		pthread_mutex_unlock(&poolMutex);
+		if (header == NULL)
+			header = malloc(sizeof(BufferHeader) + classSize(sizeClass));
+	} else {
+		header = malloc(sizeof(BufferHeader) + size);
+	}
+	
+	if (header == NULL)
+		return NULL;
+	header->sizeClass = sizeClass;
+	return header + 1;
+	
+}
+
+/* Returns a buffer with at least size bytes that are all 0. */
+void *allocZeroedBuffer(size_t size) {
+	void *buffer = allocBuffer(size);
+	if (buffer != NULL)
+		memset(buffer, 0, size);
+	return buffer;
+}
+
+/* Returns a buffer to the pool. The buffer is freed if the pool is full. */
+void releaseBuffer(void *buffer) {
+	
+	if (buffer == NULL)
+		return;
+	BufferHeader *header = (BufferHeader *)buffer - 1;
+	long sizeClass = header->sizeClass;
+	
+	if (sizeClass >= 0) {
+		pthread_mutex_lock(&poolMutex);
+		if (freeBufferCount[sizeClass] < POOL_BUFFERS_PER_CLASS
+			&& pooledBytes + classSize(sizeClass) <= POOL_SIZE_LIMIT) {
+			freeBuffers[sizeClass][freeBufferCount[sizeClass]++] = header;
+			pooledBytes += classSize(sizeClass);
+			header = NULL;
+		}
+		pthread_mutex_unlock(&poolMutex);
+	}
+	free(header);
+	
+}
@@ -0,0 +1,26 @@
+/*
+ *  BufferPool.h
+ *  GISLook
+ *
+ */
+
+#include <CoreFoundation/CoreFoundation.h>
+
+#ifndef __GISLOOK_BUFFERPOOL__
+#define __GISLOOK_BUFFERPOOL__
+
+// smallest buffer size class in bytes; each class is twice the size of the previous
+#define POOL_MIN_BUFFER_SIZE 4096
+#define POOL_SIZE_CLASSES 15
+
+// maximum number of released buffers kept per size class
+#define POOL_BUFFERS_PER_CLASS 4
+
+// maximum number of bytes kept in released buffers
+#define POOL_SIZE_LIMIT (64 * 1024 * 1024)
+
+void *allocBuffer(size_t size);
+void *allocZeroedBuffer(size_t size);
+void releaseBuffer(void *buffer);
+
+#endif
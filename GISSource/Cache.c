@@ -0,0 +1,466 @@
+/*
+ *  Cache.c
+ *  GISLook
+ *
+ */
+
+/* A cache on disk for images and other data computed from files. Each entry is
+ stored in its own file in ~/Library/Caches/ch.bernhardjenny.gislook. An entry
+ is identified by a key that contains the path, size, modification date and
+ inode of the file and of its sidecar files, or of the other files of an 
+ ArcInfo grid, so that an entry is not found anymore when any of these files 
+ changes. Entries are mapped into memory when
+ read. Entries are written to a temporary file that is then renamed, so that
+ several QuickLook and Spotlight processes can share the cache. Thumbnails are
+ stored in a sub-folder with its own size limit. When a cache grows larger 
+ than cacheSizeLimit(), its least recently used entries are removed. The size of the cache is only counted when the entries written since
+ the last count may have made it too large, or after CACHE_COUNT_INTERVAL
+ entries, as other processes may have added entries in the meantime. */
+
+#include "Cache.h"
+#include "File.h"
+#include "ReadRaster.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CACHE_MAGIC "GLC2"
+
+// folder inside CACHE_FOLDER with the thumbnail cache
+#define THUMBNAIL_CACHE_FOLDER "thumbnails"
+
+// the data of an entry starts at a multiple of this number of bytes, so that
+// numbers in the mapped data can be read directly
+#define CACHE_DATA_ALIGNMENT 8
+
+// number of entries written between two counts of the cache size
+#define CACHE_COUNT_INTERVAL 64
+
+// temporary files older than this number of seconds were left by a crashed
+// process and are removed
+#define CACHE_TEMP_FILE_AGE 3600
+
+// estimated size of each cache, -1 if unknown, and number of entries written
+// since the cache size was counted
+static off_t estimatedCacheSize[] = {-1, -1};
+static int entriesSinceCount[] = {0, 0};
+static pthread_mutex_t cacheSizeMutex = PTHREAD_MUTEX_INITIALIZER;
+
+// header at the start of each cache file, followed by the key, zeros up to
+// the next multiple of CACHE_DATA_ALIGNMENT, and the data
+typedef struct {
+	char magic[4];
+	UInt32 keyLength;
+	UInt32 dataLength;
+} CacheFileHeader;
+
+// a file in the cache folder, used when removing old entries
+typedef struct {
+	char name[256];
+	time_t lastUse;
+	off_t size;
+} CacheFile;
+
+/* Writes the path to the folder of a cache into folder and creates the folder
+ if it does not exist. */
+bool getCacheFolder(CacheType type, char *folder, size_t folderLength) {
+	char *home = getenv("HOME");
+	if (home == NULL)
+		return FALSE;
+	int n = snprintf(folder, folderLength, "%s/Library/Caches/%s", home, CACHE_FOLDER);
+	if (n < 0 || n >= folderLength)
+		return FALSE;
+	if (mkdir(folder, 0755) != 0 && errno != EEXIST)
+		return FALSE;
+	if (type == thumbnailCache) {
+		int m = snprintf(folder + n, folderLength - n, "/%s", THUMBNAIL_CACHE_FOLDER);
+		if (m < 0 || n + m >= folderLength)
+			return FALSE;
+		if (mkdir(folder, 0755) != 0 && errno != EEXIST)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/* Returns the maximum size of a cache in bytes. The sizes can be changed in 
+ megabytes with the PreviewCacheSize and ThumbnailCacheSize defaults of 
+ GISLook, e.g. 
+ defaults write ch.bernhardjenny.gislook PreviewCacheSize -int 1024 */
+off_t cacheSizeLimit(CacheType type) {
+	Boolean valid;
+	CFIndex megabytes = CFPreferencesGetAppIntegerValue(type == thumbnailCache ? CFSTR("ThumbnailCacheSize") : CFSTR("PreviewCacheSize"),
+														CFSTR("ch.bernhardjenny.gislook"), 
+														&valid);
+	if (!valid || megabytes <= 0)
+		megabytes = type == thumbnailCache ? THUMBNAIL_CACHE_SIZE : PREVIEW_CACHE_SIZE;
+	return (off_t)megabytes * 1024 * 1024;
+}
+
+/* Returns the offset of the data in a cache file with a key of keyLength 
+ bytes. */
+size_t cacheDataOffset(size_t keyLength) {
+	size_t offset = sizeof(CacheFileHeader) + keyLength;
+	return (offset + CACHE_DATA_ALIGNMENT - 1) / CACHE_DATA_ALIGNMENT * CACHE_DATA_ALIGNMENT;
+}
+
+/* Appends the path, size, modification date and inode of a file to key. */
+void appendFileIdentity(char *key, size_t keyLength, char *path) {
+	struct stat st;
+	size_t used = strlen(key);
+	if (path == NULL || used >= keyLength)
+		return;
+	if (stat(path, &st) == 0)
+		snprintf(key + used, keyLength - used, "%s %lld %ld %llu\n", path,
+				 (long long)st.st_size, (long)st.st_mtime, (unsigned long long)st.st_ino);
+	else
+		snprintf(key + used, keyLength - used, "%s -\n", path);
+}
+
+/* Appends the number of .adf files in the folder of an ArcInfo grid, their 
+ total size and the newest modification date to key. The cells of a grid are
+ stored in w001001.adf and further tile files, and the bounding box in
+ dblbnd.adf, so any of these files can change the image read from hdr.adf or
+ another .adf file of the grid. */
+void appendArcInfoGridIdentity(char *key, size_t keyLength, char *path) {
+	size_t used = strlen(key);
+	size_t pathLength = strlen(path);
+	if (used >= keyLength || pathLength < 4 || strcasecmp(path + pathLength - 4, ".adf") != 0)
+		return;
+	const char *slash = strrchr(path, '/');
+	int folderLength = slash == NULL ? 0 : (int)(slash - path + 1);
+	char folder[1024], filePath[1280];
+	if (folderLength >= sizeof(folder))
+		return;
+	if (folderLength > 0)
+		snprintf(folder, sizeof(folder), "%.*s", folderLength, path);
+	else
+		strcpy(folder, "./");
+	DIR *dir = opendir(folder);
+	if (dir == NULL)
+		return;
+	long nFiles = 0;
+	long long totalSize = 0;
+	time_t newest = 0;
+	struct dirent *dirEntry;
+	while ((dirEntry = readdir(dir)) != NULL) {
+		struct stat st;
+		size_t nameLength = strlen(dirEntry->d_name);
+		if (nameLength < 4 || strcasecmp(dirEntry->d_name + nameLength - 4, ".adf") != 0)
+			continue;
+		snprintf(filePath, sizeof(filePath), "%s%s", folder, dirEntry->d_name);
+		if (stat(filePath, &st) != 0)
+			continue;
+		nFiles++;
+		totalSize += st.st_size;
+		if (st.st_mtime > newest)
+			newest = st.st_mtime;
+	}
+	closedir(dir);
+	snprintf(key + used, keyLength - used, "grid %ld %lld %ld\n", nFiles, totalSize, (long)newest);
+}
+
+/* Returns the key of the data identified by tag that is computed from the file
+ at path. The key includes the sidecar files that can change what is read from
+ the file, and the other files of an ArcInfo grid. The returned string must be
+ released with free(). */
+char *createCacheKey(char *path, char *tag) {
+	static char *sidecars[] = {"hdr", "prj", "shx", "dbf"};
+	size_t keyLength = strlen(tag) + 6 * (strlen(path) + 64);
+	char *key = malloc(keyLength);
+	if (key == NULL)
+		return NULL;
+	snprintf(key, keyLength, "%s\n", tag);
+	appendFileIdentity(key, keyLength, path);
+	int i;
+	for (i = 0; i < sizeof(sidecars) / sizeof(sidecars[0]); i++) {
+		char *sidecarPath = changeExtension(path, sidecars[i]);
+		if (sidecarPath != NULL && strcmp(sidecarPath, path) != 0)
+			appendFileIdentity(key, keyLength, sidecarPath);
+		free(sidecarPath);
+	}
+	appendArcInfoGridIdentity(key, keyLength, path);
+	return key;
+}
+
+/* Writes the path of the cache file for key into entryPath. The file name is
+ a 64 bit FNV-1a hash of the key. The key is also stored in the file, so that
+ hash collisions are detected. */
+bool getCacheFilePath(CacheType type, char *key, char *entryPath, size_t entryPathLength) {
+	char folder[1024];
+	if (!getCacheFolder(type, folder, sizeof(folder)))
+		return FALSE;
+	unsigned long long hash = 14695981039346656037ULL;
+	const unsigned char *c;
+	for (c = (const unsigned char *)key; *c; c++) {
+		hash ^= *c;
+		hash *= 1099511628211ULL;
+	}
+	int n = snprintf(entryPath, entryPathLength, "%s/%016llx", folder, hash);
+	return n > 0 && n < entryPathLength;
+}
+
+/* Maps the data identified by tag that was computed from the file at path into
+ memory. Returns FALSE if the cache does not contain the data. The entry must be
+ released with releaseCacheEntry(). */
+bool readCacheEntry(CacheType type, char *path, char *tag, CacheEntry *entry) {
+
+	char entryPath[1024];
+	char *key = createCacheKey(path, tag);
+	if (key == NULL)
+		return FALSE;
+	if (!getCacheFilePath(type, key, entryPath, sizeof(entryPath))) {
+		free(key);
+		return FALSE;
+	}
+
+	int fd = open(entryPath, O_RDONLY);
+	if (fd < 0) {
+		free(key);
+		return FALSE;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size < sizeof(CacheFileHeader)) {
+		close(fd);
+		free(key);
+		return FALSE;
+	}
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_FILE | MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		free(key);
+		return FALSE;
+	}
+
+	// make sure the entry is complete and belongs to this key
+	const CacheFileHeader *header = map;
+	size_t keyLength = strlen(key);
+	if (memcmp(header->magic, CACHE_MAGIC, 4) != 0
+		|| header->keyLength != keyLength
+		|| cacheDataOffset(keyLength) + header->dataLength != st.st_size
+		|| memcmp((const char *)map + sizeof(CacheFileHeader), key, keyLength) != 0) {
+		munmap(map, st.st_size);
+		free(key);
+		return FALSE;
+	}
+	free(key);
+
+	entry->map = map;
+	entry->mapLength = st.st_size;
+	entry->data = (const char *)map + cacheDataOffset(keyLength);
+	entry->length = header->dataLength;
+
+	// the modification date of the cache file is the date of the last use
+	utimes(entryPath, NULL);
+	return TRUE;
+}
+
+void releaseCacheEntry(CacheEntry *entry) {
+	if (entry->map != NULL)
+		munmap(entry->map, entry->mapLength);
+	entry->map = NULL;
+	entry->data = NULL;
+}
+
+int compareCacheFiles(const void *a, const void *b) {
+	time_t t1 = ((const CacheFile *)a)->lastUse;
+	time_t t2 = ((const CacheFile *)b)->lastUse;
+	return t1 < t2 ? -1 : (t1 > t2 ? 1 : 0);
+}
+
+/* Removes the least recently used entries if a cache is larger than its 
+ limit. Removes entries until the cache is a quarter smaller than the limit, 
+ so that the cache is not counted again for a while. Returns the size of the
+ cache, or -1 if the cache folder cannot be read. */
+off_t removeOldCacheEntries(CacheType type, off_t limit) {
+
+	char folder[1024], filePath[1280];
+	if (!getCacheFolder(type, folder, sizeof(folder)))
+		return -1;
+	DIR *dir = opendir(folder);
+	if (dir == NULL)
+		return -1;
+	time_t now = time(NULL);
+
+	CacheFile *files = NULL;
+	long nFiles = 0, capacity = 0;
+	off_t totalSize = 0;
+	struct dirent *dirEntry;
+	while ((dirEntry = readdir(dir)) != NULL) {
+		struct stat st;
+		if (dirEntry->d_name[0] == '.')
+			continue;
+		snprintf(filePath, sizeof(filePath), "%s/%s", folder, dirEntry->d_name);
+		if (stat(filePath, &st) != 0 || !S_ISREG(st.st_mode))
+			continue;
+		// temporary files are being written by another thread or process
+		if (strchr(dirEntry->d_name, '.') != NULL) {
+			if (now - st.st_mtime > CACHE_TEMP_FILE_AGE)
+				unlink(filePath);
+			continue;
+		}
+		if (nFiles == capacity) {
+			capacity = capacity == 0 ? 256 : capacity * 2;
+			CacheFile *newFiles = realloc(files, capacity * sizeof(CacheFile));
+			if (newFiles == NULL)
+				break;
+			files = newFiles;
+		}
+		strncpy(files[nFiles].name, dirEntry->d_name, sizeof(files[nFiles].name) - 1);
+		files[nFiles].name[sizeof(files[nFiles].name) - 1] = '\0';
+		files[nFiles].lastUse = st.st_mtime;
+		files[nFiles].size = st.st_size;
+		totalSize += st.st_size;
+		nFiles++;
+	}
+	closedir(dir);
+
+	if (totalSize > limit) {
+		qsort(files, nFiles, sizeof(CacheFile), compareCacheFiles);
+		long i;
+		for (i = 0; i < nFiles && totalSize > limit / 4 * 3; i++) {
+			snprintf(filePath, sizeof(filePath), "%s/%s", folder, files[i].name);
+			if (unlink(filePath) == 0)
+				totalSize -= files[i].size;
+		}
+	}
+	free(files);
+	return totalSize;
+}
+
+/* Counts the size of a cache and removes old entries when the entries
+ written since the last count may have made the cache too large. */
+void updateCacheSize(CacheType type, size_t entryLength) {
+	off_t limit = cacheSizeLimit(type);
+	pthread_mutex_lock(&cacheSizeMutex);
+	bool count = estimatedCacheSize[type] < 0
+		|| ++entriesSinceCount[type] >= CACHE_COUNT_INTERVAL
+		|| estimatedCacheSize[type] + entryLength > limit;
+	if (count) {
+		estimatedCacheSize[type] = removeOldCacheEntries(type, limit);
+		entriesSinceCount[type] = 0;
+	} else
+		estimatedCacheSize[type] += entryLength;
+	pthread_mutex_unlock(&cacheSizeMutex);
+}
+
+/* Stores length bytes of data identified by tag that were computed from the
+ file at path. */
+bool writeCacheEntry(CacheType type, char *path, char *tag, const void *data, size_t length) {
+
+	char entryPath[1024], tempPath[1100];
+	char *key = createCacheKey(path, tag);
+	if (key == NULL)
+		return FALSE;
+	if (!getCacheFilePath(type, key, entryPath, sizeof(entryPath))) {
+		free(key);
+		return FALSE;
+	}
+	// each thread writes to its own temporary file
+	snprintf(tempPath, sizeof(tempPath), "%s.XXXXXX", entryPath);
+	int fd = mkstemp(tempPath);
+	if (fd < 0) {
+		free(key);
+		return FALSE;
+	}
+	fchmod(fd, 0644);
+	FILE *fp = fdopen(fd, "wb");
+	if (fp == NULL) {
+		close(fd);
+		unlink(tempPath);
+		free(key);
+		return FALSE;
+	}
+	CacheFileHeader header;
+	memcpy(header.magic, CACHE_MAGIC, 4);
+	header.keyLength = strlen(key);
+	header.dataLength = length;
+	static const char padding[CACHE_DATA_ALIGNMENT] = {0};
+	size_t paddingLength = cacheDataOffset(header.keyLength) - sizeof(header) - header.keyLength;
+	bool written = fwrite(&header, sizeof(header), 1, fp) == 1
+		&& fwrite(key, 1, header.keyLength, fp) == header.keyLength
+		&& fwrite(padding, 1, paddingLength, fp) == paddingLength
+		&& fwrite(data, 1, length, fp) == length;
+	free(key);
+	if (fclose(fp) != 0 || !written || rename(tempPath, entryPath) != 0) {
+		unlink(tempPath);
+		return FALSE;
+	}
+
+	updateCacheSize(type, cacheDataOffset(header.keyLength) + length);
+	return TRUE;
+}
+
+void releaseCachedImageData(void *info, const void *data, size_t size) {
+	releaseCacheEntry(info);
+	free(info);
+}
+
+/* Returns a gray scale image stored with cacheImage() for the file at path and
+ tag, or NULL if there is none. The tag identifies the size of the image and
+ other settings the image depends on. The pixels are not copied, but remain
+ mapped into memory until the image is released. */
+CGImageRef readCachedImage(CacheType type, char *path, char *tag) {
+
+	CacheEntry *entry = malloc(sizeof(CacheEntry));
+	if (entry == NULL)
+		return NULL;
+	if (!readCacheEntry(type, path, tag, entry)) {
+		free(entry);
+		return NULL;
+	}
+
+	// the pixels follow the width and the height, which are aligned
+	const UInt32 *size = entry->data;
+	if (entry->length < 2 * sizeof(UInt32)
+		|| (size_t)size[0] * size[1] != entry->length - 2 * sizeof(UInt32)) {
+		releaseCacheEntry(entry);
+		free(entry);
+		return NULL;
+	}
+	size_t width = size[0];
+	size_t height = size[1];
+	CGDataProviderRef prov = CGDataProviderCreateWithData (entry, size + 2,
+														   width * height,
+														   releaseCachedImageData);
+	if (prov == NULL) {
+		releaseCacheEntry(entry);
+		free(entry);
+		return NULL;
+	}
+	return createImageWithGrayScaleProvider(prov, width, height);
+}
+
+/* Stores a gray scale image created by createGrayScaleImage() for the file at
+ path and tag. */
+void cacheImage(CacheType type, char *path, char *tag, CGImageRef image) {
+
+	size_t width = CGImageGetWidth(image);
+	size_t height = CGImageGetHeight(image);
+	if (CGImageGetBitsPerPixel(image) != 8 || CGImageGetBytesPerRow(image) != width)
+		return;
+	CFDataRef pixels = CGDataProviderCopyData(CGImageGetDataProvider(image));
+	if (pixels == NULL)
+		return;
+	if (CFDataGetLength(pixels) != width * height) {
+		CFRelease(pixels);
+		return;
+	}
+	size_t length = 2 * sizeof(UInt32) + width * height;
+	UInt32 *data = malloc(length);
+	if (data != NULL) {
+		data[0] = width;
+		data[1] = height;
+		memcpy(data + 2, CFDataGetBytePtr(pixels), width * height);
+		writeCacheEntry(type, path, tag, data, length);
+		free(data);
+	}
+	CFRelease(pixels);
+}
@@ -0,0 +1,45 @@
+/*
+ *  Cache.h
+ *  GISLook
+ *
+ */
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <ApplicationServices/ApplicationServices.h>
+
+#ifndef __GISLOOK_CACHE__
+#define __GISLOOK_CACHE__
+
+// folder in ~/Library/Caches shared by GISLook and GISMeta
+#define CACHE_FOLDER "ch.bernhardjenny.gislook"
+
+// default maximum sizes of the preview and thumbnail caches in megabytes, 
+// see cacheSizeLimit()
+#define PREVIEW_CACHE_SIZE 512
+#define THUMBNAIL_CACHE_SIZE 128
+
+// Previews and thumbnails are stored in separate caches, so that browsing a
+// folder with many thumbnails does not remove the previews. Vector headers 
+// are small and stored in the preview cache.
+typedef enum {
+	previewCache,
+	thumbnailCache
+} CacheType;
+
+// A cache entry mapped into memory. data points to length bytes of the
+// stored data inside the mapped file.
+typedef struct {
+	void *map;
+	size_t mapLength;
+	const void *data;
+	size_t length;
+} CacheEntry;
+
+bool readCacheEntry(CacheType type, char *path, char *tag, CacheEntry *entry);
+void releaseCacheEntry(CacheEntry *entry);
+bool writeCacheEntry(CacheType type, char *path, char *tag, const void *data, size_t length);
+
+CGImageRef readCachedImage(CacheType type, char *path, char *tag);
+void cacheImage(CacheType type, char *path, char *tag, CGImageRef image);
+
+#endif
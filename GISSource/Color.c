@@ -8,6 +8,7 @@
  */
 
 #include "Color.h"
+#include <CoreFoundation/CoreFoundation.h>
 
 long RGBToLong (long red, long green, long blue)
 {
@@ -28,3 +29,60 @@ long RGBToLong (long red, long green, long blue)
 	return color;
 }
 
+
+/* Returns the color ramp for grids. The ramp can be changed with the ColorRamp
+ default of GISLook, e.g. 
+ defaults write ch.bernhardjenny.gislook ColorRamp hypsometric */
+ColorRampType colorRampPreference(void) {
+	ColorRampType type = grayRamp;
+	CFPropertyListRef value = CFPreferencesCopyAppValue(CFSTR("ColorRamp"), CFSTR("ch.bernhardjenny.gislook"));
+	if (value == NULL)
+		return type;
+	if (CFGetTypeID(value) == CFStringGetTypeID()
+		&& CFStringCompare(value, CFSTR("hypsometric"), kCFCompareCaseInsensitive) == kCFCompareEqualTo)
+		type = hypsometricRamp;
+	CFRelease(value);
+	return type;
+}
+
+/* Fills the ramp with colors that are linearly interpolated between stops. 
+ Each stop has a gray value followed by red, green and blue. */
+void interpolateColorRamp(ColorRamp *ramp, const unsigned char stops[][4], int nStops) {
+	int i, stop = 0;
+	for (i = 0; i < 256; i++) {
+		while (stop < nStops - 2 && i > stops[stop + 1][0])
+			stop++;
+		const unsigned char *c1 = stops[stop];
+		const unsigned char *c2 = stops[stop + 1];
+		int d = c2[0] - c1[0];
+		int w = d > 0 ? i - c1[0] : 0;
+		int b;
+		for (b = 0; b < 3; b++)
+			ramp->rgb[i * 3 + b] = d > 0 ? c1[b + 1] + (c2[b + 1] - c1[b + 1]) * w / d : c1[b + 1];
+	}
+}
+
+void initColorRamp(ColorRamp *ramp, ColorRampType type) {
+	
+	// gray, from black to white
+	static const unsigned char grayStops[][4] = {
+		{0, 0, 0, 0}, 
+		{255, 255, 255, 255}
+	};
+	
+	// lowlands in green, then yellow and brown, and white for the highest 
+	// values and for void values, which are 255.
+	static const unsigned char hypsometricStops[][4] = {
+		{0, 76, 140, 74},
+		{64, 156, 196, 110},
+		{128, 232, 216, 138},
+		{192, 176, 128, 80},
+		{240, 224, 208, 200},
+		{255, 255, 255, 255}
+	};
+	
+	if (type == hypsometricRamp)
+		interpolateColorRamp(ramp, hypsometricStops, sizeof(hypsometricStops) / sizeof(hypsometricStops[0]));
+	else
+		interpolateColorRamp(ramp, grayStops, sizeof(grayStops) / sizeof(grayStops[0]));
+}
@@ -12,5 +12,20 @@
 
 long RGBToLong (long red, long green, long blue);
 
+// color ramps for gray scale grids
+typedef enum {
+	grayRamp,
+	hypsometricRamp
+} ColorRampType;
+
+// the colors of the 256 gray values of a grid, with 3 bytes (red, green and 
+// blue) per entry. Used as a color table for indexed images.
+typedef struct {
+	unsigned char rgb[256 * 3];
+} ColorRamp;
+
+ColorRampType colorRampPreference(void);
+void initColorRamp(ColorRamp *ramp, ColorRampType type);
+
 #endif
 
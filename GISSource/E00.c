@@ -14,6 +14,9 @@
 #include "File.h"
 #include "ReadVector.h"
 
+// maximum compression ratio of gzip
+#define GZIP_MAX_RATIO 1032
+
 const char *nextLine(E00ReadPtr e00Ptr, AVCE00ReadPtr avcPtr) {
 	if (e00Ptr)
 		return E00ReadNextLine(e00Ptr);
@@ -28,6 +31,83 @@ bool isDoublePrecision (const char * lineString)
 	return (i == 3);
 }
 
+// returns true if lineString is the header of a section with the passed 
+// three-letter name, e.g. "ARC  2" for a single precision ARC section.
+bool isSectionHeader (const char * lineString, const char *name)
+{
+	int precision;
+	if (strncmp(lineString, name, 3) != 0)
+		return FALSE;
+	if (sscanf (lineString + 3, "%d", &precision) != 1)
+		return FALSE;
+	return precision == 2 || precision == 3;
+}
+
+/* Geometry of the current coverage that is retained while streaming through
+ the sections of an E00 file. Arcs are needed to fill the polygons of the PAL
+ section, label points and centroids are redrawn over the filled polygons.
+ */
+typedef struct {
+	PointBuffer arcVertices;	// vertices of all arcs
+	long *arcStart;				// index of first vertex of each arc, indexed by arc ID
+	long *arcEnd;				// index after the last vertex of each arc
+	long arcCapacity;			// number of elements in arcStart and arcEnd
+	long maxArcID;				// larger arc IDs are invalid, see maxE00ArcID()
+	PointBuffer points;			// label points and centroids
+} E00Coverage;
+
+void initCoverage(E00Coverage *coverage) {
+	initPointBuffer(&coverage->arcVertices);
+	initPointBuffer(&coverage->points);
+	coverage->arcStart = NULL;
+	coverage->arcEnd = NULL;
+	coverage->arcCapacity = 0;
+}
+
+void freeCoverage(E00Coverage *coverage) {
+	freePointBuffer(&coverage->arcVertices);
+	freePointBuffer(&coverage->points);
+	free(coverage->arcStart);
+	free(coverage->arcEnd);
+	initCoverage(coverage);
+}
+
+void clearArcs(E00Coverage *coverage) {
+	coverage->arcVertices.count = 0;
+	long i;
+	for (i = 0; i < coverage->arcCapacity; i++)
+		coverage->arcStart[i] = coverage->arcEnd[i] = 0;
+}
+
+// remembers the range of vertices of an arc. Returns false if the arc ID is
+// invalid or if not enough memory is available.
+bool setArcRange(E00Coverage *coverage, int arcID, long start, long end) {
+	if (arcID < 0 || arcID > coverage->maxArcID)
+		return FALSE;
+	if (arcID >= coverage->arcCapacity) {
+		long capacity = coverage->arcCapacity < 256 ? 256 : coverage->arcCapacity;
+		while (capacity <= arcID)
+			capacity *= 2;
+		long *arcStart = realloc(coverage->arcStart, sizeof(long) * capacity);
+		if (arcStart == NULL)
+			return FALSE;
+		coverage->arcStart = arcStart;
+		long *arcEnd = realloc(coverage->arcEnd, sizeof(long) * capacity);
+		if (arcEnd == NULL)
+			return FALSE;
+		coverage->arcEnd = arcEnd;
+		
+		// arcs that are not defined are empty
+		long i;
+		for (i = coverage->arcCapacity; i < capacity; i++)
+			arcStart[i] = arcEnd[i] = 0;
+		coverage->arcCapacity = capacity;
+	}
+	coverage->arcStart[arcID] = start;
+	coverage->arcEnd[arcID] = end;
+	return TRUE;
+}
+
 int readE00Coords (E00ReadPtr e00Ptr, AVCE00ReadPtr avcPtr, double *x1, double *y1, double *x2, double *y2)
 {
 	const char * lineString = nextLine(e00Ptr, avcPtr);
@@ -40,6 +120,7 @@ void readARC(E00ReadPtr e00Ptr,
 			 AVCE00ReadPtr avcPtr, 
 			 bool doublePrecision, 
 			 CGContextRef cgContext,
+			 E00Coverage *coverage,
 			 QLPreviewRequestRef preview,
 			 QLThumbnailRequestRef thumbnail) {
 	
@@ -47,12 +128,19 @@ void readARC(E00ReadPtr e00Ptr,
 	int	coverageNbr, coverageID, fromNode, toNode;
 	int	leftPolygon, rightPolygon, nbrCoordinates;
 	int arcCounter = 0;
+	
+	// the arcs of a previous ARC section are not needed anymore
+	clearArcs(coverage);
+	
+	// all arcs have the same color and are stroked in batches
+	PathBatch batch;
+	beginPathBatch(&batch, cgContext, kCGPathStroke);
 	while (TRUE)
 	{
 		// read the first line of the next arc
 		lineString = nextLine(e00Ptr, avcPtr);
 		if (!lineString)
-			return;
+			break;
 		
 		// extract information about the next arc
 		if (sscanf (lineString, "%d%d%d%d%d%d%d", 	
@@ -63,7 +151,7 @@ void readARC(E00ReadPtr e00Ptr,
 					&leftPolygon,
 					&rightPolygon,
 					&nbrCoordinates) != 7)
-			return;
+			break;
 		
 		if (coverageNbr == -1)
 			break;
@@ -71,23 +159,32 @@ void readARC(E00ReadPtr e00Ptr,
 		int i;
 		double x1, y1, x2, y2;
 		bool moveto = true;
-		CGContextBeginPath(cgContext);
+		long arcStart = coverage->arcVertices.count;
 		for (i = 0; i < nbrCoordinates; i += 1 + !doublePrecision) {
 			int npoints = readE00Coords(e00Ptr, avcPtr, &x1, &y1, &x2, &y2);
-			if (npoints >= 1 && isValidQuartzCoord(x1) && isValidQuartzCoord(y1))
+			if (npoints >= 1 && isValidQuartzCoord(x1) && isValidQuartzCoord(y1)) {
 				if (moveto) {
 					CGContextMoveToPoint(cgContext, x1, y1);
 					moveto = false;
 				} else
 					CGContextAddLineToPoint(cgContext, x1, y1);
-			if (npoints == 2 && isValidQuartzCoord(x2) && isValidQuartzCoord(y2))
+				appendPoint(&coverage->arcVertices, x1, y1);
+			}
+			if (npoints == 2 && isValidQuartzCoord(x2) && isValidQuartzCoord(y2)) {
 				CGContextAddLineToPoint(cgContext, x2, y2);
+				appendPoint(&coverage->arcVertices, x2, y2);
+			}
 		}
-		CGContextStrokePath(cgContext);
+		// stop at an invalid arc, the following lines are likely invalid too
+		if (!setArcRange(coverage, coverageNbr, arcStart, coverage->arcVertices.count))
+			break;
 		
+		if (addToPathBatch(&batch, nbrCoordinates) && isCancelled(preview, thumbnail))
+			return;
 		if (arcCounter++ % 20 == 0 && isCancelled(preview, thumbnail))
 			break;
-	}			
+	}
+	flushPathBatch(&batch);
 }
 
 bool readARCExtension(E00ReadPtr e00Ptr, 
@@ -164,12 +261,13 @@ void readLAB(E00ReadPtr e00Ptr,
 			 bool doublePrecision, 
 			 CGContextRef cgContext, 
 			 double scale,
+			 E00Coverage *coverage,
 			 QLPreviewRequestRef preview,
 			 QLThumbnailRequestRef thumbnail) {
 	
-	// read the points
-	int npoints = 0;
-	float *pts = NULL;
+	// read the points into the point buffer of the coverage
+	long firstPoint = coverage->points.count;
+	long npoints = 0;
 	while (TRUE)
 	{
 		const char *lineString;
@@ -178,10 +276,10 @@ void readLAB(E00ReadPtr e00Ptr,
 		
 		lineString = nextLine(e00Ptr, avcPtr);
 		if (!lineString)
-			return;
+			break;
 		
 		if (sscanf (lineString, "%d%*d%lf%lf", &coverageID, &x, &y) != 3)
-			return;
+			break;
 		if (coverageID < 0)
 			break;
 		
@@ -191,25 +289,202 @@ void readLAB(E00ReadPtr e00Ptr,
 		if (doublePrecision)
 			readE00Coords(e00Ptr, avcPtr, &x1, &y1, &x2, &y2);
 		
-		++npoints;
-		pts = realloc(pts, sizeof(float) * npoints * 2);
-		if (pts == NULL)
-			return;
-		pts[npoints * 2 - 2] = x;
-		pts[npoints * 2 - 1] = y;
+		if (!appendPoint(&coverage->points, x, y))
+			break;
 		
-		if (npoints % 20 == 0 && isCancelled(preview, thumbnail))
+		if (++npoints % 20 == 0 && isCancelled(preview, thumbnail))
 			break;
 	}	
 	
 	// draw the points
 	double r = circleRadius(npoints, scale);
-	int i;
-	for (i = 0; i < npoints; i++) {
-		drawCircle(cgContext, pts[i * 2], pts[i * 2 + 1], r);
+	fillCircles(cgContext, coverage->points.xy + firstPoint * 2, npoints, r);
+	
+}
+
+void readCNT(E00ReadPtr e00Ptr, 
+			 AVCE00ReadPtr avcPtr, 
+			 CGContextRef cgContext, 
+			 double scale,
+			 E00Coverage *coverage,
+			 QLPreviewRequestRef preview,
+			 QLThumbnailRequestRef thumbnail) {
+	
+	long firstPoint = coverage->points.count;
+	int centroidCounter = 0;
+	while (TRUE)
+	{
+		const char *lineString;
+		int nLabels;
+		double x, y;
+		
+		lineString = nextLine(e00Ptr, avcPtr);
+		if (!lineString)
+			return;
+		
+		// number of labels, centroid position
+		if (sscanf (lineString, "%d%lf%lf", &nLabels, &x, &y) != 3)
+			return;
+		if (nLabels == -1) // -1 indicates end of CNT section
+			break;
+		
+		// overread IDs of labels, 8 IDs per line
+		int i;
+		for (i = 0; i < nLabels; i += 8) {
+			if (nextLine(e00Ptr, avcPtr) == NULL)
+				return;
+		}
+		
+		// the first centroid belongs to the universe polygon
+		if (centroidCounter++ > 0)
+			appendPoint(&coverage->points, x, y);
+		
+		if (centroidCounter % 20 == 0 && isCancelled(preview, thumbnail))
+			break;
 	}
-	free(pts);
 	
+	// draw the centroids
+	long nCentroids = coverage->points.count - firstPoint;
+	double r = circleRadius(nCentroids, scale);
+	fillCircles(cgContext, coverage->points.xy + firstPoint * 2, nCentroids, r);
+}
+
+// Adds the vertices of an arc to the current path. A negative arc ID indicates
+// that the arc is traversed in reverse direction. The arc continues the current
+// subpath if it starts at the last point, otherwise a new subpath is started.
+// Returns the number of vertices added to the path.
+long addArcToPath(CGContextRef cgContext, 
+				  E00Coverage *coverage, 
+				  int arcID, 
+				  bool *hasLastPoint, 
+				  double *lastX, 
+				  double *lastY) {
+	
+	int id = arcID < 0 ? -arcID : arcID;
+	if (id == 0 || id >= coverage->arcCapacity)
+		return 0;
+	long start = coverage->arcStart[id];
+	long end = coverage->arcEnd[id];
+	if (end <= start)
+		return 0;
+	
+	const double *xy = coverage->arcVertices.xy;
+	long step = arcID < 0 ? -1 : 1;
+	long first = arcID < 0 ? end - 1 : start;
+	long n = end - start;
+	long i, v;
+	for (i = 0, v = first; i < n; i++, v += step) {
+		double x = xy[v * 2];
+		double y = xy[v * 2 + 1];
+		if (i > 0)
+			CGContextAddLineToPoint(cgContext, x, y);
+		else if (!*hasLastPoint || x != *lastX || y != *lastY)
+			CGContextMoveToPoint(cgContext, x, y);
+	}
+	*lastX = xy[(first + (n - 1) * step) * 2];
+	*lastY = xy[(first + (n - 1) * step) * 2 + 1];
+	*hasLastPoint = TRUE;
+	return n;
+}
+
+// strokes all arcs of the coverage
+void strokeArcs(CGContextRef cgContext, E00Coverage *coverage) {
+	
+	PathBatch batch;
+	beginPathBatch(&batch, cgContext, kCGPathStroke);
+	long id;
+	for (id = 0; id < coverage->arcCapacity; id++) {
+		long start = coverage->arcStart[id];
+		long end = coverage->arcEnd[id];
+		if (end - start < 2)
+			continue;
+		const double *xy = coverage->arcVertices.xy;
+		CGContextMoveToPoint(cgContext, xy[start * 2], xy[start * 2 + 1]);
+		long v;
+		for (v = start + 1; v < end; v++)
+			CGContextAddLineToPoint(cgContext, xy[v * 2], xy[v * 2 + 1]);
+		addToPathBatch(&batch, end - start);
+	}
+	flushPathBatch(&batch);
+}
+
+void readPAL(E00ReadPtr e00Ptr, 
+			 AVCE00ReadPtr avcPtr, 
+			 bool doublePrecision, 
+			 CGContextRef cgContext, 
+			 double scale,
+			 E00Coverage *coverage,
+			 QLPreviewRequestRef preview,
+			 QLThumbnailRequestRef thumbnail) {
+	
+	setColorForPolygons(cgContext, scale);
+	
+	// Fill polygons with the even-odd rule. Polygons do not overlap, so 
+	// multiple polygons can be accumulated in a single path. Islands are 
+	// stored as separate polygons inside holes and are therefore filled as well.
+	PathBatch batch;
+	beginPathBatch(&batch, cgContext, kCGPathEOFill);
+	int polygonCounter = 0;
+	bool endOfSection = FALSE;
+	while (!endOfSection)
+	{
+		const char *lineString;
+		int nArcs;
+		
+		// number of arcs, bounding box
+		lineString = nextLine(e00Ptr, avcPtr);
+		if (!lineString || sscanf (lineString, "%d", &nArcs) != 1)
+			break;
+		if (nArcs == -1) // -1 indicates end of PAL section
+			break;
+		
+		// the maximum corner of the bounding box is on a separate line
+		if (doublePrecision && nextLine(e00Ptr, avcPtr) == NULL)
+			break;
+		
+		// a polygon without arcs has a single "0 0 0" triplet
+		if (nArcs == 0)
+			nArcs = 1;
+		
+		// the first polygon is the universe polygon, which is not filled
+		bool isUniverse = (polygonCounter++ == 0);
+		
+		// two triplets of arc ID, node ID and adjacent polygon per line
+		bool hasLastPoint = FALSE;
+		double lastX = 0, lastY = 0;
+		long polygonVertices = 0;
+		int i;
+		for (i = 0; i < nArcs; i += 2) {
+			int arcIDs[2];
+			lineString = nextLine(e00Ptr, avcPtr);
+			if (!lineString) {
+				endOfSection = TRUE;
+				break;
+			}
+			int n = sscanf (lineString, "%d%*d%*d%d", arcIDs, arcIDs + 1);
+			int j;
+			for (j = 0; j < n && i + j < nArcs && !isUniverse; j++) {
+				// arc ID 0 separates rings
+				if (arcIDs[j] == 0)
+					hasLastPoint = FALSE;
+				else
+					polygonVertices += addArcToPath(cgContext, coverage, arcIDs[j], 
+												 &hasLastPoint, &lastX, &lastY);
+			}
+		}
+		
+		if (addToPathBatch(&batch, polygonVertices) && isCancelled(preview, thumbnail))
+			return;
+		if (polygonCounter % 20 == 0 && isCancelled(preview, thumbnail))
+			break;
+	}
+	flushPathBatch(&batch);
+	
+	// draw arcs, labels and centroids over the filled polygons
+	strokeArcs(cgContext, coverage);
+	CGContextSetFillColorWithColor(cgContext, CGColorGetConstantColor(kCGColorWhite));
+	double r = circleRadius(coverage->points.count, scale);
+	fillCircles(cgContext, coverage->points.xy, coverage->points.count, r);
 }
 
 void readLABExtension(E00ReadPtr e00Ptr, 
@@ -268,6 +543,15 @@ void readLABExtension(E00ReadPtr e00Ptr,
 void e00ErrorHandler(CPLErr eErrClass, int err_no, const char *msg) {
 }
 
+/* Returns true if the path ends with e00, or with e00.gz for gzip compressed 
+ files. Other paths are files of binary coverages. */
+bool isE00Path(const char *path) {
+	size_t length = strlen(path);
+	if (length > 3 && strcmp(path + length - 3, ".gz") == 0)
+		length -= 3;
+	return length >= 2 && path[length - 2] == '0';
+}
+
 void closeE00(E00ReadPtr e00Ptr, 
 			  AVCE00ReadPtr avcPtr) {
 	if (e00Ptr)
@@ -276,6 +560,26 @@ void closeE00(E00ReadPtr e00Ptr,
 		AVCE00ReadClose(avcPtr);
 }
 
+/* Returns the largest valid arc ID. Each arc takes at least one byte of the 
+ file, or of the arc file in the folder of a binary coverage, even when the 
+ E00 file is compressed. Gzip compresses by at most GZIP_MAX_RATIO. A larger ID is 
+ invalid, and would allocate huge tables for the ranges of the arcs. */
+long maxE00ArcID(char *path) {
+	if (isE00Path(path)) {
+		long length = getFileLength(path);
+		return isGzipPath(path) ? length * GZIP_MAX_RATIO : length;
+	}
+	// older coverages name the file without extension
+	char arcPath[10240];
+	snprintf(arcPath, sizeof(arcPath), "%s/arc.adf", path);
+	long length = getFileLength(arcPath);
+	if (length == 0) {
+		snprintf(arcPath, sizeof(arcPath), "%s/arc", path);
+		length = getFileLength(arcPath);
+	}
+	return length;
+}
+
 bool readE00(char *path,
 			 double scale,
 			 CGContextRef cgContext, 
@@ -285,35 +589,52 @@ bool readE00(char *path,
 	CPLSetErrorHandler( e00ErrorHandler );
 	E00ReadPtr e00Ptr = NULL;
 	AVCE00ReadPtr avcPtr = NULL;
-	if (path[strlen(path) - 2] == '0') {
+	if (isE00Path(path)) {
 		if ((e00Ptr = E00ReadOpen(path)) == NULL)
 			return FALSE;
 	} else {
 		if ((avcPtr = AVCE00ReadOpen(path)) == NULL)
 			return FALSE;
 	}	
-	// draw shapes
+	// Render all sections in a single pass in the order they appear in the 
+	// file. E00 files may contain multiple coverages, each starting with an 
+	// EXP line.
+	E00Coverage coverage;
+	initCoverage(&coverage);
+	coverage.maxArcID = maxE00ArcID(path);
 	setColorForLines(cgContext, scale);
 	
 	const char *pszLine;
 	int lineCounter = 0;
 	while((pszLine = nextLine(e00Ptr, avcPtr)) != NULL)
 	{
-		if (strncmp(pszLine, "ARC", 3) == 0) {
-			bool doublePrecision = isDoublePrecision(pszLine);
-			readARC(e00Ptr, avcPtr, doublePrecision, cgContext, preview, thumbnail);
-			break;
-		}
-		if (strncmp(pszLine, "LAB", 3) == 0) {
-			bool doublePrecision = isDoublePrecision(pszLine);
-			readLAB(e00Ptr, avcPtr, doublePrecision, cgContext, scale, preview, thumbnail);
-			break;
+		bool section = TRUE;
+		if (strncmp(pszLine, "EXP", 3) == 0) {
+			freeCoverage(&coverage);
+			section = FALSE;
+		} else if (isSectionHeader(pszLine, "ARC")) {
+			setColorForLines(cgContext, scale);
+			readARC(e00Ptr, avcPtr, isDoublePrecision(pszLine), 
+					cgContext, &coverage, preview, thumbnail);
+		} else if (isSectionHeader(pszLine, "LAB")) {
+			setColorForLines(cgContext, scale);
+			readLAB(e00Ptr, avcPtr, isDoublePrecision(pszLine), 
+					cgContext, scale, &coverage, preview, thumbnail);
+		} else if (isSectionHeader(pszLine, "CNT")) {
+			setColorForLines(cgContext, scale);
+			readCNT(e00Ptr, avcPtr, cgContext, scale, &coverage, preview, thumbnail);
+		} else if (isSectionHeader(pszLine, "PAL")) {
+			readPAL(e00Ptr, avcPtr, isDoublePrecision(pszLine), 
+					cgContext, scale, &coverage, preview, thumbnail);
+		} else {
+			section = FALSE;
 		}
 		
-		if (lineCounter++ % 20 == 0 && isCancelled(preview, thumbnail))
+		if ((section || lineCounter++ % 20 == 0) && isCancelled(preview, thumbnail))
 			break;
 	}
 	
+	freeCoverage(&coverage);
 	closeE00(e00Ptr, avcPtr);
 	return TRUE;
 }
@@ -389,7 +710,7 @@ bool readE00Size(char *path,
 	CPLSetErrorHandler( e00ErrorHandler );
 	E00ReadPtr e00Ptr = NULL;
 	AVCE00ReadPtr avcPtr = NULL;
-	if (path[strlen(path) - 2] == '0') {
+	if (isE00Path(path)) {
 		if ((e00Ptr = E00ReadOpen(path)) == NULL)
 			return FALSE;
 	} else {
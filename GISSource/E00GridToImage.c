@@ -10,28 +10,39 @@
 #include "E00GridToImage.h"
 #include "e00compr.h"
 #include "ReadRaster.h"
+#include "BufferPool.h"
+#include "Stretch.h"
+#include "Hillshade.h"
 
 unsigned char *scaleE00FloatToByte(float *floatBuffer, 
 								float minVal, float maxVal,
+								Histogram *histogram,
 								long width, long height,
-								float voidValue) {
+								float voidValue,
+								bool hillshade) {
 	
-	const float diff = maxVal - minVal;
+	if (hillshade)
+		return hillshadeFloatGrid(floatBuffer, width, height, minVal, maxVal, voidValue);
+	
+	FloatStretch stretch;
 	unsigned char * grayBuffer;
-	if (diff > 0.f) {
+	if (initFloatStretch(&stretch, histogram, minVal, maxVal)) {
 		long i, gridSize = width * height;
-		grayBuffer = malloc(gridSize);
-		if (grayBuffer == NULL)
+		grayBuffer = allocBuffer(gridSize);
+		if (grayBuffer == NULL) {
+			releaseFloatStretch(&stretch);
 			return NULL;
+		}
 		for (i = 0; i < gridSize; i++) {
 			float f = floatBuffer[i];
 			if (f == voidValue)
 				grayBuffer[i] = 255;
 			else
-				grayBuffer[i] = (unsigned char)((f - minVal) * 255 / diff);
+				grayBuffer[i] = stretchFloat(f, &stretch);
 		}
+		releaseFloatStretch(&stretch);
 	} else {
-		grayBuffer = calloc(width * height, 1);
+		grayBuffer = allocZeroedBuffer(width * height);
 	}
 	
 	return grayBuffer;
@@ -78,6 +89,7 @@ bool isValidE00GridValue(float v, float limit) {
 
 CGImageRef readE00GridToImage(FILE *fp,
 							char *path,
+							long maxSize,
 							QLPreviewRequestRef preview,
 							QLThumbnailRequestRef thumbnail) {
 	
@@ -105,16 +117,18 @@ CGImageRef readE00GridToImage(FILE *fp,
 		return NULL;
 	}
 	
-	long rw = resampledWidth(width, height);
-	long rh = resampledHeight(width, height);
-	int sdist = sampleDist(width, height);
-	float *floatBuffer = malloc(sizeof(float) * rw * rh);
+	long rw = resampledWidth(width, height, maxSize);
+	long rh = resampledHeight(width, height, maxSize);
+	int sdist = sampleDist(width, height, maxSize);
+	float *floatBuffer = allocBuffer(sizeof(float) * rw * rh);
 	if (floatBuffer == NULL) {
 		E00ReadClose(hReadPtr);
 		return NULL;
 	}
 	
 	unsigned long r, c;
+	bool hillshade = hillshadePreference();
+	Histogram *histogram = hillshade ? NULL : createHistogram(stretchForFormat(CFSTR("E00GridStretch"), percentileStretch));
 	float minVal = 2147483647L;
 	float maxVal = -2147483648.f;
 	long pixelCounter = 0;
@@ -123,7 +137,8 @@ CGImageRef readE00GridToImage(FILE *fp,
 		
 		// check whether we should cancel
 		if (r % 10 == 0 && isCancelled(preview, thumbnail)) {
-			free(floatBuffer);
+			releaseBuffer(floatBuffer);
+			releaseHistogram(histogram);
 			return NULL;
 		}
 		
@@ -140,13 +155,16 @@ CGImageRef readE00GridToImage(FILE *fp,
 							minVal = v[i];
 						if (v[i] > maxVal)
 							maxVal = v[i];
+						if (histogram)
+							addFloatToHistogram(histogram, v[i]);
 					} else
 						floatBuffer[pixelCounter++] = voidValue;
 				}
 #ifdef CHECK_GRID_WRITE
 				if (pixelCounter < 1 || pixelCounter > rw * rh) {
 					printf("E00 Grid %ld \n", pixelCounter);
-					free(floatBuffer);
+					releaseBuffer(floatBuffer);
+					releaseHistogram(histogram);
 					return NULL;
 				}
 #endif
@@ -156,8 +174,13 @@ CGImageRef readE00GridToImage(FILE *fp,
 	
 	// scale values to 0..255
 	unsigned char *grayBuffer = scaleE00FloatToByte(floatBuffer, minVal, maxVal, 
-												 rw, rh, voidValue);	
+												 histogram, rw, rh, voidValue, hillshade);	
 	E00ReadClose(hReadPtr);
-	free(floatBuffer);
+	releaseBuffer(floatBuffer);
+	releaseHistogram(histogram);
+	
+	// the gradation curve is only applied to stretched values
+	if (hillshade)
+		return createGradedGrayScaleImage(grayBuffer, rw, rh);
 	return createGrayScaleImage(grayBuffer, rw, rh);
 }
@@ -19,6 +19,7 @@ bool readE00GridSize(char *path, long *width, long *height);
 
 CGImageRef readE00GridToImage(FILE * fp,
 								   char *path,
+								   long maxSize,
 								   QLPreviewRequestRef preview,
 								   QLThumbnailRequestRef thumbnail);
 
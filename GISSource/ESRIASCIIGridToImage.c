@@ -17,6 +17,9 @@
 
 #include "ESRIASCIIGridToImage.h"
 #include "ReadRaster.h"
+#include "BufferPool.h"
+#include "Stretch.h"
+#include "Hillshade.h"
 #include "File.h"
 
 #define MAX(X,Y) ((X) > (Y) ? (X) : (Y))
@@ -58,25 +61,33 @@ bool readESRIASCIIGridSize(FILE *fp, long *width, long *height) {
 
 unsigned char *scaleFloatToByte(float *floatBuffer, 
 								float minVal, float maxVal,
+								Histogram *histogram,
 								long width, long height,
-								float voidValue) {
+								float voidValue,
+								bool hillshade) {
 	
-	const float diff = maxVal - minVal;
+	if (hillshade)
+		return hillshadeFloatGrid(floatBuffer, width, height, minVal, maxVal, voidValue);
+	
+	FloatStretch stretch;
 	unsigned char * grayBuffer;
-	if (diff > 0.f) {
+	if (initFloatStretch(&stretch, histogram, minVal, maxVal)) {
 		long i, gridSize = width * height;
-		grayBuffer = malloc(gridSize);
-		if (grayBuffer == NULL)
+		grayBuffer = allocBuffer(gridSize);
+		if (grayBuffer == NULL) {
+			releaseFloatStretch(&stretch);
 			return NULL;
+		}
 		for (i = 0; i < gridSize; i++) {
 			float f = floatBuffer[i];
 			if (f == voidValue)
 				grayBuffer[i] = 255;
 			else
-				grayBuffer[i] = (unsigned char)((f - minVal) * 255 / diff);
+				grayBuffer[i] = stretchFloat(f, &stretch);
 		}
+		releaseFloatStretch(&stretch);
 	} else {
-		grayBuffer = calloc(width * height, 1);
+		grayBuffer = allocZeroedBuffer(width * height);
 	}
 	
 	return grayBuffer;
@@ -85,14 +96,16 @@ unsigned char *scaleFloatToByte(float *floatBuffer,
 
 unsigned char *readESRIASCIIGrid(FILE * fp, 
 								 long width, long height,
+								 long maxSize,
 								 QLPreviewRequestRef preview,
 								 QLThumbnailRequestRef thumbnail, 
-								 float voidValue) {
+								 float voidValue,
+								 bool hillshade) {
 	
-	long rw = resampledWidth(width, height);
-	long rh = resampledHeight(width, height);
-	int sdist = sampleDist(width, height);
-	float *floatBuffer = malloc(sizeof(float) * rw * rh);
+	long rw = resampledWidth(width, height, maxSize);
+	long rh = resampledHeight(width, height, maxSize);
+	int sdist = sampleDist(width, height, maxSize);
+	float *floatBuffer = allocBuffer(sizeof(float) * rw * rh);
 	if (floatBuffer == NULL)
 		return NULL;
 	
@@ -100,7 +113,7 @@ unsigned char *readESRIASCIIGrid(FILE * fp,
 	// e.g. "%f %*f %*f %*f %*f %*f"
 	char *format = malloc(2 + 4 * (sdist - 1) + 1);
 	if (format == NULL) {
-		free(floatBuffer);
+		releaseBuffer(floatBuffer);
 		return NULL;
 	}
 	strcpy(format, "%f");
@@ -114,7 +127,7 @@ unsigned char *readESRIASCIIGrid(FILE * fp,
 	if (width % sdist > 0) {
 		lastFormat = malloc(2 + MAX(0, 4 * (width % sdist - 1)) + 1);
 		if (lastFormat == NULL) {
-			free(floatBuffer);
+			releaseBuffer(floatBuffer);
 			free(format);
 			return NULL;
 		}
@@ -126,6 +139,7 @@ unsigned char *readESRIASCIIGrid(FILE * fp,
 	
 	unsigned long r, c;
 	float f;
+	Histogram *histogram = hillshade ? NULL : createHistogram(stretchForFormat(CFSTR("ESRIASCIIGridStretch"), percentileStretch));
 	float minVal = 2147483647L;
 	float maxVal = -2147483648.f;
 	long pixelCounter = 0;
@@ -133,18 +147,20 @@ unsigned char *readESRIASCIIGrid(FILE * fp,
 		
 		// check whether we should cancel
 		if (r % 10 == 0 && isCancelled(preview, thumbnail)) {
-			free(floatBuffer);
+			releaseBuffer(floatBuffer);
 			free(format);
 			free(lastFormat);
+			releaseHistogram(histogram);
 			return NULL;
 		}
 		if (r % sdist == 0) {
 			for (c = 0; c < rw; c++) {
 				int success = fscanf(fp, c == rw - 1 && lastFormat ? lastFormat : format, &f);
 				if (success == EOF) {
-					free(floatBuffer);
+					releaseBuffer(floatBuffer);
 					free(format);
 					free(lastFormat);
+					releaseHistogram(histogram);
 					return NULL;
 				}
 				if (f != voidValue) {
@@ -152,14 +168,17 @@ unsigned char *readESRIASCIIGrid(FILE * fp,
 						minVal = f;
 					if (f > maxVal)
 						maxVal = f;
+					if (histogram)
+						addFloatToHistogram(histogram, f);
 				}
 
 #ifdef CHECK_GRID_WRITE
 				if (pixelCounter < 0 || pixelCounter >= rw * rh) {
 					printf("ASCII Grid %ld \n", pixelCounter);
-					free(floatBuffer);
+					releaseBuffer(floatBuffer);
 					free(format);
 					free(lastFormat);
+					releaseHistogram(histogram);
 					return NULL;
 				}
 #endif
@@ -169,9 +188,10 @@ unsigned char *readESRIASCIIGrid(FILE * fp,
 		} else {
 			for (c = 0; c < width; c++) {
 				if (EOF == fscanf(fp, "%*f")) {
-					free(floatBuffer);
+					releaseBuffer(floatBuffer);
 					free(format);
 					free(lastFormat);
+					releaseHistogram(histogram);
 					return NULL;
 				}
 			}
@@ -180,13 +200,15 @@ unsigned char *readESRIASCIIGrid(FILE * fp,
 	
 	// scale values to 0..255
 	unsigned char *grayBuffer = scaleFloatToByte(floatBuffer, minVal, maxVal, 
-												 rw, rh, voidValue);	
-	free(floatBuffer);
+												 histogram, rw, rh, voidValue, hillshade);	
+	releaseBuffer(floatBuffer);
+	releaseHistogram(histogram);
 	return grayBuffer;
 	
 }
 
 CGImageRef readESRIASCIIGridImage(FILE * fp, 
+								  long maxSize,
 								  QLPreviewRequestRef preview,
 								  QLThumbnailRequestRef thumbnail) {
 	
@@ -207,10 +229,15 @@ CGImageRef readESRIASCIIGridImage(FILE * fp,
 	} else {
 		ungetc(c, fp);
 	}
-	unsigned char *grayBuffer = readESRIASCIIGrid(fp, width, height, preview, 
-												  thumbnail, voidValue);
-	long rw = resampledWidth(width, height);
-	long rh = resampledHeight(width, height);
+	bool hillshade = hillshadePreference();
+	unsigned char *grayBuffer = readESRIASCIIGrid(fp, width, height, maxSize, preview, 
+												  thumbnail, voidValue, hillshade);
+	long rw = resampledWidth(width, height, maxSize);
+	long rh = resampledHeight(width, height, maxSize);
+	
+	// the gradation curve is only applied to stretched values
+	if (hillshade)
+		return createGradedGrayScaleImage(grayBuffer, rw, rh);
 	return createGrayScaleImage(grayBuffer, rw, rh);
 	
 }
\ No newline at end of file
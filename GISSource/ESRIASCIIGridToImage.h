@@ -17,6 +17,7 @@
 
 bool readESRIASCIIGridSize(FILE *fp, long *width, long *height);
 CGImageRef readESRIASCIIGridImage(FILE * fp,
+						long maxSize,
 						QLPreviewRequestRef preview,
 						QLThumbnailRequestRef thumbnail);
 
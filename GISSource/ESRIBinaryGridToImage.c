@@ -9,6 +9,9 @@
 
 #include "ESRIBinaryGridToImage.h"
 #include "ReadRaster.h"
+#include "BufferPool.h"
+#include "Stretch.h"
+#include "Hillshade.h"
 #include "File.h"
 #include "strlwr.h"
 
@@ -23,12 +26,15 @@ unsigned char *scaleESRIBinaryToByte(float *fgrid,
 									 float voidValue,
 									 bool bigEndian,
 									 long gridSize, 
+									 long cols,
+									 bool hillshade,
 									 QLPreviewRequestRef preview,
 									 QLThumbnailRequestRef thumbnail) {
 	
 	long i;
 	
-	// find min and max values
+	// find min and max values and count values for the stretch
+	Histogram *histogram = hillshade ? NULL : createHistogram(stretchForFormat(CFSTR("ESRIBinaryGridStretch"), percentileStretch));
 	float minVal = MAXFLOAT;
 	float maxVal = -MAXFLOAT;
 	float f;
@@ -49,30 +55,42 @@ unsigned char *scaleESRIBinaryToByte(float *fgrid,
 				maxVal = f;
 			if (f < minVal)
 				minVal = f;
+			if (histogram)
+				addFloatToHistogram(histogram, f);
 		}
 	}
 	
 	// check whether we should abort
-	if (isCancelled(preview, thumbnail))
+	if (isCancelled(preview, thumbnail)) {
+		releaseHistogram(histogram);
 		return NULL;
+	}
+	
+	if (hillshade)
+		return hillshadeFloatGrid(fgrid, cols, gridSize / cols, minVal, maxVal, voidValue);
 	
-	float diff = maxVal - minVal;
-	if (diff <= 0.f)
-		return calloc(gridSize, 1); // return an empty gray buffer
+	FloatStretch stretch;
+	bool stretched = initFloatStretch(&stretch, histogram, minVal, maxVal);
+	releaseHistogram(histogram);
+	if (!stretched)
+		return allocZeroedBuffer(gridSize); // return an empty gray buffer
 	
 	// allocate buffer for gray pixels
-	unsigned char * grayBuffer = malloc(gridSize);
-	if (grayBuffer == NULL)
+	unsigned char * grayBuffer = allocBuffer(gridSize);
+	if (grayBuffer == NULL) {
+		releaseFloatStretch(&stretch);
 		return NULL;
+	}
 	
 	// scale floats to unsigned chars
 	for (i = 0; i < gridSize; i++) {
 		if (fgrid[i] == voidValue)
 			grayBuffer[i] = 255;
 		else
-			grayBuffer[i] = (unsigned char)((fgrid[i] - minVal) * 255.f / diff);
+			grayBuffer[i] = stretchFloat(fgrid[i], &stretch);
 	}
 	
+	releaseFloatStretch(&stretch);
 	return grayBuffer;
 }
 
@@ -132,8 +150,10 @@ bool readESRIBinaryGridSize(char *path, long *width, long *height) {
 	char * hdrPath = changeExtension(path, "hdr");
 	if (hdrPath == NULL)
 		return NULL;
-	FILE *hdrfp = fopen(hdrPath, "r");
+	FILE *hdrfp = openFileWithBudget(hdrPath, METADATA_READ_BUDGET);
 	free(hdrPath);
+	if (hdrfp == NULL)
+		return FALSE;
 	bool headerRead = readHeader(hdrfp, width, height, &voidValue, &bigEndian);
 	fclose(hdrfp);
 	return headerRead;
@@ -142,12 +162,14 @@ bool readESRIBinaryGridSize(char *path, long *width, long *height) {
 
 CGImageRef readESRIBinaryGridImage(FILE *fp,
 								   char *path,
+								   long maxSize,
 								   QLPreviewRequestRef preview,
 								   QLThumbnailRequestRef thumbnail) {
 	
 	long width, height;
 	float voidValue;
 	bool bigEndian;
+	bool hillshade = hillshadePreference();
 	
 	// construct path with "hdr" extension
 	char * hdrPath = changeExtension(path, "hdr");
@@ -160,69 +182,89 @@ CGImageRef readESRIBinaryGridImage(FILE *fp,
 	if (!headerRead)
 		return NULL;
 	
-	long rw = resampledWidth(width, height);
-	long rh = resampledHeight(width, height);
-	int sdist = sampleDist(width, height);
+	long rw = resampledWidth(width, height, maxSize);
+	long rh = resampledHeight(width, height, maxSize);
+	int sdist = sampleDist(width, height, maxSize);
 	
-	float *fgrid = (float *)malloc(sizeof(float) * rw * rh);
+	float *fgrid = (float *)allocBuffer(sizeof(float) * rw * rh);
 	if (fgrid == NULL)
 		return NULL;
-	float *frow = (float *)malloc(sizeof(float) * width);
+	float *frow = (float *)allocBuffer(sizeof(float) * width);
 	if (frow == NULL) {
-		free(fgrid);
+		releaseBuffer(fgrid);
 		return NULL;
 	}
-	int c, r;
-	long cell = 0;
-	for (r = 0; r < height; r += sdist) {
-
-#ifdef CHECK_GRID_WRITE
-		if (cell < 0 || cell >= rw * rh) {
-			printf("ESRI Binary %ld \n", cell);
-			free(fgrid);
-			free(frow);
-			return NULL;
-		}
-#endif
+	long *order = rowReadingOrder(rh, sizeof(float) * width);
+	if (order == NULL) {
+		releaseBuffer(fgrid);
+		releaseBuffer(frow);
+		return NULL;
+	}
+	long c, i;
+	long dataStart = ftell(fp);
+	for (i = 0; i < rh; i++) {
 		
 		// test for abort
-		if ((r % 20) == 0 && isCancelled(preview, thumbnail)) {
-			free(fgrid);
-			free(frow);
+		if ((i % 20) == 0 && isCancelled(preview, thumbnail)) {
+			releaseBuffer(fgrid);
+			releaseBuffer(frow);
+			free(order);
 			return NULL;
 		}
 		
+		// stop when out of time and use the rows read so far
+		if (i > 0 && isPastDeadline())
+			break;
+		
 		// read one row
+		long r = order[i] * sdist;
+		fseek (fp, dataStart + r * width * sizeof(float), SEEK_SET);
 		size_t read = fread (frow, sizeof(float), width, fp);
 		if (read != width) {
-			free(fgrid);
-			free(frow);
+			releaseBuffer(fgrid);
+			releaseBuffer(frow);
+			free(order);
 			return NULL;
 		}
 		
 		// copy samples
+		long cell = order[i] * rw;
 		for (c = 0; c < width; c += sdist) {
 			fgrid[cell++] = frow[c];
 		}
 		
-		// overread lines
-		if (r + sdist < height)
-			fseek ( fp , width * (sdist - 1) * sizeof(float) , SEEK_CUR );
+		// show the rows read so far at the end of a coarse pass
+		if (isCoarseFrameDue(order, rh, i + 1)) {
+			float *frame = copyGridWithUnreadRows(fgrid, rw * sizeof(float), rh, order, i + 1);
+			if (frame) {
+				unsigned char *gray = scaleESRIBinaryToByte(frame, voidValue, bigEndian, rw * rh, rw,
+															hillshade, preview, thumbnail);
+				releaseBuffer(frame);
+				drawCoarseFrame(gray, rw, rh, hillshade);
+			}
+		}
 	}
+	fillUnreadRows(fgrid, rw * sizeof(float), rh, order, i);
+	free(order);
 	
 	// convert to grayscale image
 	unsigned char *grayBuffer = scaleESRIBinaryToByte(fgrid,
 													  voidValue, 
 													  bigEndian,
 													  rw * rh, 
+													  rw,
+													  hillshade,
 													  preview, thumbnail);
-	free (fgrid);
-	free(frow);
+	releaseBuffer(fgrid);
+	releaseBuffer(frow);
 	if (grayBuffer == NULL || isCancelled(preview, thumbnail)) {
-		free (grayBuffer);
+		releaseBuffer(grayBuffer);
 		return NULL;
 	}
 	
+	// the gradation curve is only applied to stretched values
+	if (hillshade)
+		return createGradedGrayScaleImage(grayBuffer, rw, rh);
 	return createGrayScaleImage(grayBuffer, rw, rh);
 	
 }
\ No newline at end of file
@@ -18,6 +18,7 @@
 bool readESRIBinaryGridSize(char *path, long *width, long *height);
 CGImageRef readESRIBinaryGridImage(FILE * fp,
 								   char *path,
+								   long maxSize,
 								   QLPreviewRequestRef preview,
 								   QLThumbnailRequestRef thumbnail);
 
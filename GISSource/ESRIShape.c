@@ -10,97 +10,339 @@
 #include "ESRIShape.h"
 #include "shapefil.h"
 #include "ReadVector.h"
+#include "Parallel.h"
 
 
 #define MAX_COORD 1.e20
 
-void readPoint (SHPObject * psShape, CGContextRef cgContext, double r)
-{
-	if (psShape->nVertices > 0)
-		drawCircle(cgContext, psShape->padfX[0], psShape->padfY[0], r);
+// records are decoded in batches of about this many bytes of the .shp file
+#define SHAPE_BATCH_BYTES (256 * 1024)
+
+// maximum number of records in a batch, keeps the batches of point files small
+#define SHAPE_BATCH_MAX_RECORDS 4096
+
+// maximum number of decoded batches waiting to be drawn
+#define MAX_BATCHES_IN_FLIGHT (2 * MAX_WORKER_THREADS)
+
+/* A decoded shape. The vertices are stored in the vertex buffer of the batch, 
+ the parts in the part array of the batch. */
+typedef struct {
+	int shapeType;
+	long firstPart;
+	long nParts;
+} DecodedShape;
+
+/* The shapes of a range of consecutive records. */
+typedef struct {
+	PointBuffer vertices;
+	long *partStart;		// index of the first vertex of each part, followed by the end index
+	long nParts;
+	long partCapacity;
+	DecodedShape *shapes;
+	long nShapes;
+	bool decoded;
+} ShapeBatch;
+
+/* Shared by the decoding worker threads and the drawing thread. Workers take 
+ the next batch, decode it and mark it as decoded. The drawing thread draws 
+ the batches in record order, so the result is identical to a serial read. */
+typedef struct {
+	char *path;
+	SHPHandle sharedHandle;	// handle of the drawing thread, for workers that cannot open the file
+	pthread_mutex_t sharedHandleMutex;
+	int *batchStart;		// first record of each batch, followed by the number of records
+	ShapeBatch *batches;
+	int nBatches;
+	int nextBatch;			// next batch to decode
+	int drawnBatches;		// number of batches drawn so far
+	bool cancelled;
+	pthread_mutex_t mutex;
+	pthread_cond_t batchDecoded;
+	pthread_cond_t batchDrawn;
+} ShapeDecoder;
+
+/* Splits the records into batches of similar size in the .shp file. Returns 
+ the number of batches. batchStart can be NULL to only count the batches. */
+int splitIntoBatches(SHPHandle hSHP, int nEntities, int *batchStart) {
+	int i, nBatches = 0, records = 0;
+	long bytes = 0;
+	for (i = 0; i < nEntities; i++) {
+		if (records == 0 && batchStart)
+			batchStart[nBatches] = i;
+		// 8 bytes for the record header
+		bytes += hSHP->panRecSize[i] + 8;
+		records++;
+		if (bytes >= SHAPE_BATCH_BYTES || records >= SHAPE_BATCH_MAX_RECORDS || i == nEntities - 1) {
+			nBatches++;
+			bytes = 0;
+			records = 0;
+		}
+	}
+	if (batchStart)
+		batchStart[nBatches] = nEntities;
+	return nBatches;
 }
 
-void readMultiPoint (SHPObject * psShape, CGContextRef cgContext, double r)
-{
-	int n;
-	for (n = 0; n < psShape->nVertices; n++) {
-		drawCircle(cgContext, psShape->padfX[n], psShape->padfY[n], r);
+/* Starts a new part at the current end of the vertex buffer. Room for the 
+ end index after the last part is always kept. */
+bool addPart(ShapeBatch *batch) {
+	if (batch->nParts + 1 >= batch->partCapacity) {
+		long newCapacity = batch->partCapacity < 64 ? 64 : batch->partCapacity * 2;
+		long *newPartStart = realloc(batch->partStart, newCapacity * sizeof(long));
+		if (!newPartStart)
+			return FALSE;
+		batch->partStart = newPartStart;
+		batch->partCapacity = newCapacity;
 	}
+	batch->partStart[batch->nParts++] = batch->vertices.count;
+	return TRUE;
 }
 
-void readPolyline (SHPObject * psShape, CGContextRef cgContext)
-{
-	// Polylines may consist of several parts.
-	// A part is a connected sequence of two or more points. Parts may or may not 
-	// be connected to one another. Parts may or may not intersect each other.*/
+/* Converts a shape to a list of parts in the batch. Invalid points are 
+ ignored individually. Polylines and polygons with an invalid coordinate are
+ ignored entirely. */
+void decodeShape(ShapeBatch *batch, SHPObject *psShape) {
 	
 	int	j, iPart;
-	bool moveto = true;
-	CGContextBeginPath(cgContext);
-	for( j = 0, iPart = 1; j < psShape->nVertices; j++ )
+	bool ok = TRUE;
+	DecodedShape *shape = &batch->shapes[batch->nShapes];
+	shape->shapeType = psShape->nSHPType;
+	shape->firstPart = batch->nParts;
+	long firstVertex = batch->vertices.count;
+	
+	switch (psShape->nSHPType)
 	{
-		// test for end of subline.
-		if( iPart < psShape->nParts && psShape->panPartStart[iPart] == j )
-		{
-			moveto = true;
-			iPart++;
-		}
-		double x = psShape->padfX[j];
-		double y = psShape->padfY[j];
-		if (!isValidQuartzCoord(x) || !isValidQuartzCoord(y))
+		case SHPT_POINT:			// point
+		case SHPT_POINTM:			// point with measure information (?)
+		case SHPT_POINTZ:			// 3D point
+		case SHPT_MULTIPOINT:		// multipoint
+		case SHPT_MULTIPOINTM:		// multipoint with measure information (?)
+		case SHPT_MULTIPOINTZ:		// 3D multipoint
+			ok = addPart(batch);
+			for (j = 0; ok && j < psShape->nVertices; j++) {
+				double x = psShape->padfX[j];
+				double y = psShape->padfY[j];
+				if (isValidQuartzCoord(x) && isValidQuartzCoord(y))
+					ok = appendPoint(&batch->vertices, x, y);
+			}
+			break;
+			
+		case SHPT_ARC:				// polyline, possible in parts
+		case SHPT_ARCM:				// polyline with measure information (?)
+		case SHPT_ARCZ:				// 3D polyline
+		case SHPT_POLYGON:			// polygon, possible in rings
+		case SHPT_POLYGONM:			// with measure information (?)
+		case SHPT_POLYGONZ:			// 3D polygon
+			for (j = 0; j < psShape->nVertices; j++) {
+				if (!isValidQuartzCoord(psShape->padfX[j]) || !isValidQuartzCoord(psShape->padfY[j]))
+					return;
+			}
+			for (j = 0, iPart = 1; ok && j < psShape->nVertices; j++) {
+				// test for start of a new part
+				if (j == 0) {
+					ok = addPart(batch);
+				} else if (iPart < psShape->nParts && psShape->panPartStart[iPart] == j) {
+					ok = addPart(batch);
+					iPart++;
+				}
+				ok = ok && appendPoint(&batch->vertices, psShape->padfX[j], psShape->padfY[j]);
+			}
+			break;
+			
+		default:					// null shapes and multipatches are not drawn
 			return;
-		
-		if (moveto) {
-			CGContextMoveToPoint(cgContext, x, y);
-			moveto = false;
-		} else {
-			CGContextAddLineToPoint(cgContext, x, y);
-		}
 	}
 	
-	CGContextStrokePath(cgContext);
+	if (!ok) {
+		// out of memory: drop the shape
+		batch->vertices.count = firstVertex;
+		batch->nParts = shape->firstPart;
+		return;
+	}
+	shape->nParts = batch->nParts - shape->firstPart;
+	if (shape->nParts > 0)
+		batch->nShapes++;
 }
 
-void readPolygon (SHPObject * psShape, CGContextRef cgContext)
-{
-	/* A polygon consists of one or more rings. A ring is a connected sequence of four or more
-	 points that form a closed, non-self-intersecting loop. A polygon may contain multiple
-	 outer rings. The order of vertices or orientation for a ring indicates which side of the ring
-	 is the interior of the polygon. The neighborhood to the right of an observer walking along
-	 the ring in vertex order is the neighborhood inside the polygon. Vertices of rings defining
-	 holes in polygons are in a counterclockwise direction. Vertices for a single, ringed
-	 polygon are, therefore, always in clockwise order. The rings of a polygon are referred to
-	 as its parts. 
-	 */
-	
-	int	j, iPart;
-	bool moveto = true;
-	CGContextBeginPath(cgContext);
-	for( j = 0, iPart = 1; j < psShape->nVertices; j++ )
-	{
-		// test for end of subline.
-		if( iPart < psShape->nParts && psShape->panPartStart[iPart] == j )
-		{
+void decodeShapeBatch(SHPHandle hSHP, ShapeBatch *batch, int firstRecord, int endRecord) {
+	int i;
+	batch->shapes = malloc((endRecord - firstRecord) * sizeof(DecodedShape));
+	if (batch->shapes == NULL)
+		return;
+	for (i = firstRecord; i < endRecord; i++) {
+		SHPObject *psShape = SHPReadObject (hSHP, i);
+		if (!psShape)
+			continue;
+		decodeShape(batch, psShape);
+		SHPDestroyObject (psShape);
+	}
+	if (batch->partStart)
+		batch->partStart[batch->nParts] = batch->vertices.count;
+}
+
+void freeShapeBatch(ShapeBatch *batch) {
+	freePointBuffer(&batch->vertices);
+	free(batch->partStart);
+	batch->partStart = NULL;
+	batch->nParts = batch->partCapacity = 0;
+	free(batch->shapes);
+	batch->shapes = NULL;
+	batch->nShapes = 0;
+}
+
+// adds the parts of a polyline or polygon to the current path
+void addShapeToPath(CGContextRef cgContext, ShapeBatch *batch, DecodedShape *shape, bool closeParts) {
+	long p, v;
+	for (p = shape->firstPart; p < shape->firstPart + shape->nParts; p++) {
+		const double *xy = batch->vertices.xy;
+		v = batch->partStart[p];
+		CGContextMoveToPoint(cgContext, xy[v * 2], xy[v * 2 + 1]);
+		for (v++; v < batch->partStart[p + 1]; v++)
+			CGContextAddLineToPoint(cgContext, xy[v * 2], xy[v * 2 + 1]);
+		if (closeParts)
 			CGContextClosePath(cgContext);
-			moveto = true;
-			iPart++;
+	}
+}
+
+bool isPointShape(int shapeType) {
+	switch (shapeType)
+	{
+		case SHPT_POINT:
+		case SHPT_POINTM:
+		case SHPT_POINTZ:
+		case SHPT_MULTIPOINT:
+		case SHPT_MULTIPOINTM:
+		case SHPT_MULTIPOINTZ:
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/* Draws the shapes of a batch. Polylines are added to lineBatch, which is 
+ stroked by the caller. The vertices of consecutive point shapes follow each
+ other in the vertex buffer, and are filled with a single call of 
+ fillCircles() instead of one call per record. */
+void drawShapeBatch(ShapeBatch *batch, CGContextRef cgContext, double r, PathBatch *lineBatch) {
+	long i, firstPoint = 0, nPoints = 0;
+	for (i = 0; i < batch->nShapes; i++) {
+		DecodedShape *shape = &batch->shapes[i];
+		long firstVertex = batch->partStart[shape->firstPart];
+		long nVertices = batch->partStart[shape->firstPart + shape->nParts] - firstVertex;
+		
+		// fill the points collected so far before any other shape is drawn
+		if (nPoints > 0 && (!isPointShape(shape->shapeType) || firstVertex != firstPoint + nPoints)) {
+			fillCircles(cgContext, batch->vertices.xy + firstPoint * 2, nPoints, r);
+			nPoints = 0;
 		}
 		
-		// add point
-		double x = psShape->padfX[j];
-		double y = psShape->padfY[j];
-		if (!isValidQuartzCoord(x) || !isValidQuartzCoord(y))
-			return;
+		switch (shape->shapeType)
+		{
+			case SHPT_POINT:
+			case SHPT_POINTM:
+			case SHPT_POINTZ:
+			case SHPT_MULTIPOINT:
+			case SHPT_MULTIPOINTM:
+			case SHPT_MULTIPOINTZ:
+				if (nPoints == 0) {
+					flushPathBatch(lineBatch);
+					firstPoint = firstVertex;
+				}
+				nPoints += nVertices;
+				break;
+				
+			case SHPT_ARC:
+			case SHPT_ARCM:
+			case SHPT_ARCZ:
+				addShapeToPath(cgContext, batch, shape, FALSE);
+				addToPathBatch(lineBatch, nVertices);
+				break;
+				
+			case SHPT_POLYGON:
+			case SHPT_POLYGONM:
+			case SHPT_POLYGONZ:
+				/* A polygon consists of one or more rings. Holes are rings in counterclockwise
+				 order. Each polygon is filled and stroked separately. */
+				flushPathBatch(lineBatch);
+				addShapeToPath(cgContext, batch, shape, TRUE);
+				CGContextDrawPath(cgContext, kCGPathFillStroke);
+				break;
+		}
+	}
+	if (nPoints > 0)
+		fillCircles(cgContext, batch->vertices.xy + firstPoint * 2, nPoints, r);
+}
+
+/* Worker thread: decodes batches until all are decoded or drawing has been
+ cancelled. Shapelib handles cannot be shared between threads, so each worker
+ reads with its own handle. A worker that cannot open the file, e.g. because
+ the process is out of file descriptors, uses the handle of the drawing 
+ thread, one worker at a time. */
+void *decodeShapeBatches(void *arg) {
+	ShapeDecoder *decoder = (ShapeDecoder *)arg;
+	SHPHandle hSHP = SHPOpen (decoder->path, "rb");
+	
+	pthread_mutex_lock(&decoder->mutex);
+	while (TRUE) {
+		// don't get too far ahead of the drawing thread
+		while (!decoder->cancelled 
+			   && decoder->nextBatch < decoder->nBatches
+			   && decoder->nextBatch >= decoder->drawnBatches + MAX_BATCHES_IN_FLIGHT)
+			pthread_cond_wait(&decoder->batchDrawn, &decoder->mutex);
+		if (decoder->cancelled || decoder->nextBatch >= decoder->nBatches)
+			break;
+		int b = decoder->nextBatch++;
+		pthread_mutex_unlock(&decoder->mutex);
 		
-		if (moveto) {
-			CGContextMoveToPoint(cgContext, x, y);
-			moveto = false;
-		} else {
-			CGContextAddLineToPoint(cgContext, x, y);
+		ShapeBatch *batch = &decoder->batches[b];
+		if (hSHP)
+			decodeShapeBatch(hSHP, batch, decoder->batchStart[b], decoder->batchStart[b + 1]);
+		else {
+			pthread_mutex_lock(&decoder->sharedHandleMutex);
+			decodeShapeBatch(decoder->sharedHandle, batch, decoder->batchStart[b], decoder->batchStart[b + 1]);
+			pthread_mutex_unlock(&decoder->sharedHandleMutex);
 		}
+		
+		pthread_mutex_lock(&decoder->mutex);
+		batch->decoded = TRUE;
+		pthread_cond_broadcast(&decoder->batchDecoded);
 	}
+	pthread_mutex_unlock(&decoder->mutex);
 	
-	CGContextDrawPath(cgContext, kCGPathFillStroke);
+	if (hSHP)
+		SHPClose (hSHP);
+	return NULL;
+}
+
+bool initShapeDecoder(ShapeDecoder *decoder, char *path, SHPHandle hSHP, int nEntities) {
+	memset(decoder, 0, sizeof(ShapeDecoder));
+	decoder->path = path;
+	decoder->sharedHandle = hSHP;
+	decoder->nBatches = splitIntoBatches(hSHP, nEntities, NULL);
+	decoder->batchStart = malloc((decoder->nBatches + 1) * sizeof(int));
+	decoder->batches = calloc(decoder->nBatches + 1, sizeof(ShapeBatch));
+	if (decoder->batchStart == NULL || decoder->batches == NULL) {
+		free(decoder->batchStart);
+		free(decoder->batches);
+		return FALSE;
+	}
+	splitIntoBatches(hSHP, nEntities, decoder->batchStart);
+	pthread_mutex_init(&decoder->mutex, NULL);
+	pthread_mutex_init(&decoder->sharedHandleMutex, NULL);
+	pthread_cond_init(&decoder->batchDecoded, NULL);
+	pthread_cond_init(&decoder->batchDrawn, NULL);
+	return TRUE;
+}
+
+void destroyShapeDecoder(ShapeDecoder *decoder) {
+	int b;
+	for (b = 0; b < decoder->nBatches; b++)
+		freeShapeBatch(&decoder->batches[b]);
+	free(decoder->batches);
+	free(decoder->batchStart);
+	pthread_mutex_destroy(&decoder->mutex);
+	pthread_mutex_destroy(&decoder->sharedHandleMutex);
+	pthread_cond_destroy(&decoder->batchDecoded);
+	pthread_cond_destroy(&decoder->batchDrawn);
 }
 
 bool readESRIShape(char *path,
@@ -109,7 +351,7 @@ bool readESRIShape(char *path,
 				   QLPreviewRequestRef preview,
 				   QLThumbnailRequestRef thumbnail) {
 	
-	int	nEntities, i;
+	int	nEntities, b;
 	
 	// Open the passed shapefile
 	SHPHandle hSHP = SHPOpen (path, "rb" );
@@ -142,56 +384,57 @@ bool readESRIShape(char *path,
 	}
 	CGContextSetStrokeColorWithColor(cgContext, strokeColor);
 	CGContextSetLineWidth(cgContext, strokeWidth);
-	 */	
-	for (i = 0; i < nEntities; i++)
-	{
-		if (i % 20 == 0 && isCancelled(preview, thumbnail))
-			break;
-		
-		// read one shape
-		SHPObject *psShape = SHPReadObject (hSHP, i);
-		if (!psShape)
-			continue;
-		
-		/* Decide for each shape how to convert it. This should also work fo
-		 possible future shape files with mixed shape types. */ 
-		switch (psShape->nSHPType)
-		{
-			case SHPT_NULL:				// SHPT_NULL indicates a null shape, without any geometric data.
-				break;
-				
-			case SHPT_POINT:			// point
-			case SHPT_POINTM:			// point with measure information (?)
-			case SHPT_POINTZ:			// 3D point
-				readPoint (psShape, cgContext, r);
-				break;
-				
-			case SHPT_MULTIPOINT:		// multipoint
-			case SHPT_MULTIPOINTM:		// multipoint with measure information (?)
-			case SHPT_MULTIPOINTZ:		// 3D multipoint
-				readMultiPoint (psShape, cgContext, r);
-				break;
-				
-			case SHPT_ARC:				// polyline, possible in parts
-			case SHPT_ARCM:				// polyline with measure information (?)
-			case SHPT_ARCZ:				// 3D polyline
-				readPolyline (psShape, cgContext);
-			  	break;	
-				
-			case SHPT_POLYGON:			// polygon, possible in rings
-			case SHPT_POLYGONM:			// with measure information (?)
-			case SHPT_POLYGONZ:			// 3D polygon
-				readPolygon (psShape, cgContext);
-				break;
-				
-			case SHPT_MULTIPATCH:		// a kind of TIN. Not handled.
-				break;
+	 */
+	
+	ShapeDecoder decoder;
+	if (!initShapeDecoder(&decoder, path, hSHP, nEntities)) {
+		SHPClose (hSHP);
+		return FALSE;
+	}
+	
+	/* Decode the records in worker threads. A small file with a single batch 
+	 is decoded by this thread, which is also done when no thread can be started. */
+	pthread_t threads[MAX_WORKER_THREADS];
+	int nThreads = 0;
+	if (decoder.nBatches > 1) {
+		int maxThreads = workerThreadCount();
+		while (nThreads < maxThreads && nThreads < decoder.nBatches
+			   && pthread_create(&threads[nThreads], NULL, decodeShapeBatches, &decoder) == 0)
+			nThreads++;
+	}
+	
+	// draw the batches in record order; polylines are stroked in batches
+	PathBatch lineBatch;
+	beginPathBatch(&lineBatch, cgContext, kCGPathStroke);
+	for (b = 0; b < decoder.nBatches; b++) {
+		ShapeBatch *batch = &decoder.batches[b];
+		if (nThreads == 0) {
+			decodeShapeBatch(hSHP, batch, decoder.batchStart[b], decoder.batchStart[b + 1]);
+		} else {
+			pthread_mutex_lock(&decoder.mutex);
+			while (!batch->decoded)
+				pthread_cond_wait(&decoder.batchDecoded, &decoder.mutex);
+			pthread_mutex_unlock(&decoder.mutex);
 		}
 		
-		// kill the shape
-		SHPDestroyObject (psShape);
-		psShape = NULL;
+		drawShapeBatch(batch, cgContext, r, &lineBatch);
+		freeShapeBatch(batch);
+		
+		bool cancelled = isCancelled(preview, thumbnail);
+		pthread_mutex_lock(&decoder.mutex);
+		decoder.drawnBatches = b + 1;
+		decoder.cancelled = cancelled;
+		pthread_cond_broadcast(&decoder.batchDrawn);
+		pthread_mutex_unlock(&decoder.mutex);
+		if (cancelled)
+			break;
 	}
+	flushPathBatch(&lineBatch);
+	
+	// wait for the workers, they finish their current batch when cancelled
+	for (b = 0; b < nThreads; b++)
+		pthread_join(threads[b], NULL);
+	destroyShapeDecoder(&decoder);
 	
 	// close the file
 	SHPClose (hSHP);
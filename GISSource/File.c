@@ -8,7 +8,11 @@
  */
 
 #include "File.h"
+#include "GzipFile.h"
 #include <sys/stat.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
 
 /* Sets the default path for access with standard C file accessors.
  * Return false on failure.
@@ -45,12 +49,138 @@ char *getParentDirectory(char *path) {
 	return parentPath;	
 }
 
+/* Opens a file for reading. Gzip compressed files are decompressed while 
+ they are read. The returned file must be closed with fclose(). Also used by
+ VSIFOpen() of the E00 libraries. */
+FILE * openFileForReading(const char *path) {
+	
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	FILE *fp = isGzipFile(fd) ? openGzipFile(fd, LONG_MAX) : fdopen(fd, "r");
+	if (fp == NULL)
+		close(fd);
+	return fp;
+	
+}
+
 FILE * openFile(CFURLRef url) {
 	
 	unsigned char pathChar[10240];
 	if (!CFURLGetFileSystemRepresentation(url, true, pathChar, 10240))
         return NULL;
-	return fopen((char*)pathChar, "r");
+	return openFileForReading((char*)pathChar);
+	
+}
+
+/* Returns true if files of a type are read while they are decompressed. */
+bool isCompressibleType(CFStringRef type) {
+	CFStringRef types[] = {
+		CFSTR("com.esri.asciigrid"),
+		CFSTR("com.esri.e00"),
+		CFSTR("gov.usgs.dem"),
+		CFSTR("net.sourceforge.netpbm.pgm")
+	};
+	int i;
+	for (i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+		if (UTTypeConformsTo(type, types[i]))
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/* Returns the type of the data in a gzip compressed file, which is derived
+ from the extension before .gz, e.g. com.esri.asciigrid for grid.asc.gz. 
+ Returns NULL for gzip files that do not contain a GIS file that can be read
+ while decompressing, e.g. archive.tar.gz, so that the caller can return 
+ without reading the file. Returns contentTypeUTI for other files. The 
+ returned type must be released with CFRelease(). */
+CFStringRef copyUncompressedContentType(CFURLRef url, CFStringRef contentTypeUTI) {
+	
+	if (!UTTypeConformsTo(contentTypeUTI, CFSTR("org.gnu.gnu-zip-archive")))
+		return CFRetain(contentTypeUTI);
+	
+	CFStringRef type = NULL;
+	CFURLRef uncompressedURL = CFURLCreateCopyDeletingPathExtension(NULL, url);
+	CFStringRef extension = uncompressedURL ? CFURLCopyPathExtension(uncompressedURL) : NULL;
+	if (extension) {
+		type = UTTypeCreatePreferredIdentifierForTag(kUTTagClassFilenameExtension, extension, NULL);
+		CFRelease(extension);
+	}
+	if (uncompressedURL)
+		CFRelease(uncompressedURL);
+	if (type && !isCompressibleType(type)) {
+		CFRelease(type);
+		type = NULL;
+	}
+	return type;
+	
+}
+
+// a file that cannot read more than a fixed number of bytes
+typedef struct {
+	int fd;
+	long remainingBytes;
+} BudgetedFile;
+
+int readBudgetedFile(void *cookie, char *buf, int nbytes) {
+	BudgetedFile *file = (BudgetedFile *)cookie;
+	if (nbytes > file->remainingBytes)
+		nbytes = (int)file->remainingBytes;
+	if (nbytes <= 0)
+		return 0;
+	int res = read(file->fd, buf, nbytes);
+	if (res > 0)
+		file->remainingBytes -= res;
+	return res;
+}
+
+fpos_t seekBudgetedFile(void *cookie, fpos_t offset, int whence) {
+	return lseek(((BudgetedFile *)cookie)->fd, offset, whence);
+}
+
+int closeBudgetedFile(void *cookie) {
+	BudgetedFile *file = (BudgetedFile *)cookie;
+	int res = close(file->fd);
+	free(file);
+	return res;
+}
+
+/* Opens a file for reading that returns end-of-file after budget bytes have 
+ been read from disk. Seeking does not count against the budget, so readers 
+ can skip over data they don't need. Used by the metadata importer, which 
+ must not read entire files. Gzip compressed files are decompressed, and the
+ budget limits the compressed bytes. The returned file must be closed with 
+ fclose().
+ */
+FILE * openFileWithBudget(char *path, long budget) {
+	
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	if (isGzipFile(fd)) {
+		FILE *fp = openGzipFile(fd, budget);
+		if (fp == NULL)
+			close(fd);
+		return fp;
+	}
+	
+	BudgetedFile *file = malloc(sizeof(BudgetedFile));
+	if (file == NULL) {
+		close(fd);
+		return NULL;
+	}
+	file->remainingBytes = budget;
+	file->fd = fd;
+	FILE *fp = funopen(file, readBudgetedFile, NULL, seekBudgetedFile, closeBudgetedFile);
+	if (fp == NULL) {
+		close(file->fd);
+		free(file);
+		return NULL;
+	}
+	// a small buffer, so that read-ahead does not use up the budget
+	setvbuf(fp, NULL, _IOFBF, 4096);
+	return fp;
 	
 }
 
@@ -62,6 +192,16 @@ unsigned long getFileLength(char *path) {
 
 }
 
+/* Returns true if the file is gzip compressed. */
+bool isGzipPath(char *path) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return FALSE;
+	bool gzip = isGzipFile(fd);
+	close(fd);
+	return gzip;
+}
+
 // reads over white chars. Returns false if an error occurs.
 bool overreadWhiteChars(FILE *fp)
 {
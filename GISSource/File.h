@@ -13,11 +13,18 @@
 #ifndef __GISLOOK_FILE__
 #define __GISLOOK_FILE__
 
+// maximum number of bytes the metadata importer reads from a single file
+#define METADATA_READ_BUDGET (64 * 1024)
+
 bool setDefaultPathToParentDirectory(char *path);
 char *getParentDirectory(char *path);
 bool urlToPath(CFURLRef url, char *pathBuffer, int bufferLength);
+FILE * openFileForReading(const char *path);
 FILE * openFile(CFURLRef url);
+CFStringRef copyUncompressedContentType(CFURLRef url, CFStringRef contentTypeUTI);
+FILE * openFileWithBudget(char *path, long budget);
 unsigned long getFileLength(char *path);
+bool isGzipPath(char *path);
 bool overreadWhiteChars(FILE *fp);
 char *changeExtension(char*path, char *extension);
 
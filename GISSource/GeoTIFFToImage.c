@@ -0,0 +1,890 @@
+/*
+ *  GeoTIFFToImage.c
+ *  GISLook
+ *
+
+ Importer for single band GeoTIFF grids
+
+ Reads classic TIFF and BigTIFF files with GeoTIFF tags that are either tiled
+ or stored in strips, uncompressed or compressed with deflate, with or without
+ a horizontal or floating point predictor. Cloud optimized GeoTIFFs contain
+ reduced resolution images (overviews). The smallest image that is at least
+ as large as the requested preview is read, and only the tiles that contain
+ sampled cells are read and decompressed. Rows of tiles are decoded in
+ parallel.
+
+ TIFF files without GeoTIFF tags, color images and other compressions are not
+ read, so that QuickLook can show them as images.
+
+ */
+
+#include "GeoTIFFToImage.h"
+#include "ReadRaster.h"
+#include "BufferPool.h"
+#include "Stretch.h"
+#include "Hillshade.h"
+#include "Parallel.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+// tags
+#define TIFF_NEW_SUBFILE_TYPE		254
+#define TIFF_IMAGE_WIDTH			256
+#define TIFF_IMAGE_LENGTH			257
+#define TIFF_BITS_PER_SAMPLE		258
+#define TIFF_COMPRESSION			259
+#define TIFF_PHOTOMETRIC			262
+#define TIFF_STRIP_OFFSETS			273
+#define TIFF_SAMPLES_PER_PIXEL		277
+#define TIFF_ROWS_PER_STRIP			278
+#define TIFF_STRIP_BYTE_COUNTS		279
+#define TIFF_PLANAR_CONFIGURATION	284
+#define TIFF_PREDICTOR				317
+#define TIFF_TILE_WIDTH				322
+#define TIFF_TILE_LENGTH			323
+#define TIFF_TILE_OFFSETS			324
+#define TIFF_TILE_BYTE_COUNTS		325
+#define TIFF_SAMPLE_FORMAT			339
+#define GEOTIFF_MODEL_PIXEL_SCALE	33550
+#define GEOTIFF_MODEL_TIEPOINT		33922
+#define GEOTIFF_MODEL_TRANSFORMATION	34264
+#define GEOTIFF_KEY_DIRECTORY		34735
+#define GDAL_NODATA					42113
+
+#define TIFF_NO_COMPRESSION			1
+#define TIFF_DEFLATE				8
+#define TIFF_ADOBE_DEFLATE			32946
+
+#define TIFF_HORIZONTAL_PREDICTOR	2
+#define TIFF_FLOAT_PREDICTOR		3
+
+#define TIFF_UNSIGNED_SAMPLES		1
+#define TIFF_SIGNED_SAMPLES			2
+#define TIFF_FLOAT_SAMPLES			3
+
+// the number of images (IFDs) that are searched for overviews
+#define TIFF_MAX_IMAGES				64
+
+// an entry of an IFD
+typedef struct {
+	int type;
+	UInt64 count;
+	UInt64 offset;			// position of the values if they are not inline
+	unsigned char value[8];	// values that fit into the entry
+	bool inlineValue;
+} TIFFEntry;
+
+// one image of a TIFF file: the full resolution image or an overview
+typedef struct {
+	long width, height;
+	long blockWidth, blockHeight;	// tiles, or strips as wide as the image
+	long blocksAcross, blocksDown;
+	int bitsPerSample, sampleFormat;
+	int samplesPerPixel, planar;
+	int compression, predictor;
+	int photometric;
+	long subfileType;
+	bool geo;
+	bool readable;		// a single band grid that can be read
+	bool hasNoData;
+	double noData;
+	TIFFEntry offsets, byteCounts;
+} TIFFImage;
+
+typedef struct {
+	FILE *fp;
+	int fd;
+	bool bigEndian;
+	bool bigTIFF;
+} TIFFFile;
+
+/* Reads bytes at offset. Worker threads use pread on the shared file
+ descriptor. Files opened with funopen() have no file descriptor and are
+ decoded by a single thread with fseek and fread. */
+bool readTIFFBytes(TIFFFile *tiff, UInt64 offset, size_t length, void *buffer) {
+	if (tiff->fd < 0)
+		return fseeko (tiff->fp, offset, SEEK_SET) == 0
+			&& fread (buffer, 1, length, tiff->fp) == length;
+	return pread(tiff->fd, buffer, length, offset) == (ssize_t)length;
+}
+
+UInt16 tiffShort(const TIFFFile *tiff, const unsigned char *b) {
+	return tiff->bigEndian ? (b[0] << 8) | b[1] : (b[1] << 8) | b[0];
+}
+
+UInt32 tiffLong(const TIFFFile *tiff, const unsigned char *b) {
+	UInt32 v;
+	memcpy(&v, b, 4);
+	return tiff->bigEndian ? CFSwapInt32BigToHost(v) : CFSwapInt32LittleToHost(v);
+}
+
+UInt64 tiffLong8(const TIFFFile *tiff, const unsigned char *b) {
+	UInt64 v;
+	memcpy(&v, b, 8);
+	return tiff->bigEndian ? CFSwapInt64BigToHost(v) : CFSwapInt64LittleToHost(v);
+}
+
+/* Returns the size of a value of a TIFF type, or 0 for unknown types. */
+int tiffTypeSize(int type) {
+	switch (type) {
+		case 1: case 2: case 6: case 7:		// byte, ascii, signed byte, undefined
+			return 1;
+		case 3: case 8:						// short, signed short
+			return 2;
+		case 4: case 9: case 11: case 13:	// long, signed long, float, ifd
+			return 4;
+		case 5: case 10: case 12:			// rational, signed rational, double
+		case 16: case 17: case 18:			// long8, signed long8, ifd8
+			return 8;
+	}
+	return 0;
+}
+
+/* Converts an integer value of an entry to host byte order. */
+UInt64 tiffInteger(const TIFFFile *tiff, int type, const unsigned char *b) {
+	switch (type) {
+		case 1: case 7:
+			return b[0];
+		case 6:
+			return (SInt64)(signed char)b[0];
+		case 3:
+			return tiffShort(tiff, b);
+		case 8:
+			return (SInt64)(SInt16)tiffShort(tiff, b);
+		case 4: case 13:
+			return tiffLong(tiff, b);
+		case 9:
+			return (SInt64)(SInt32)tiffLong(tiff, b);
+	}
+	return tiffLong8(tiff, b);
+}
+
+/* Reads n integer values of an entry, starting with value first. */
+bool readTIFFValues(TIFFFile *tiff, const TIFFEntry *entry, UInt64 first, long n,
+					UInt64 *values, unsigned char *buffer) {
+	int size = tiffTypeSize(entry->type);
+	if (size == 0 || entry->type == 2 || entry->type == 5 || entry->type == 10
+		|| entry->type == 11 || entry->type == 12 || first + n > entry->count)
+		return FALSE;
+	if (entry->inlineValue)
+		memcpy(buffer, entry->value + first * size, n * size);
+	else if (!readTIFFBytes(tiff, entry->offset + first * size, n * size, buffer))
+		return FALSE;
+	long i;
+	for (i = 0; i < n; i++)
+		values[i] = tiffInteger(tiff, entry->type, buffer + i * size);
+	return TRUE;
+}
+
+/* Returns the first value of an entry, or defaultValue if it cannot be read. */
+UInt64 tiffEntryValue(TIFFFile *tiff, const TIFFEntry *entry, UInt64 defaultValue) {
+	UInt64 value;
+	unsigned char buffer[8];
+	if (entry->count == 0 || !readTIFFValues(tiff, entry, 0, 1, &value, buffer))
+		return defaultValue;
+	return value;
+}
+
+/* Reads the GDAL_NODATA tag, which stores the void value as a string. */
+void readTIFFNoData(TIFFFile *tiff, const TIFFEntry *entry, TIFFImage *image) {
+	char s[64];
+	if (entry->type != 2 || entry->count < 2 || entry->count > sizeof(s))
+		return;
+	if (entry->inlineValue)
+		memcpy(s, entry->value, entry->count);
+	else if (!readTIFFBytes(tiff, entry->offset, entry->count, s))
+		return;
+	s[entry->count - 1] = '\0';
+	char *end;
+	image->noData = strtod(s, &end);
+	image->hasNoData = end != s;
+}
+
+/* Reads the IFD at offset into image. Returns the offset of the next IFD, 0
+ if this is the last one, or -1 if the IFD cannot be read. image->readable
+ is false if the image is not a grid that can be read. */
+SInt64 readTIFFImage(TIFFFile *tiff, UInt64 offset, TIFFImage *image) {
+
+	int countSize = tiff->bigTIFF ? 8 : 2;
+	int entrySize = tiff->bigTIFF ? 20 : 12;
+	int valueSize = tiff->bigTIFF ? 8 : 4;
+	unsigned char b[8];
+	if (!readTIFFBytes(tiff, offset, countSize, b))
+		return -1;
+	UInt64 nEntries = tiff->bigTIFF ? tiffLong8(tiff, b) : tiffShort(tiff, b);
+	if (nEntries == 0 || nEntries > 4096)
+		return -1;
+	size_t length = nEntries * entrySize + valueSize;
+	unsigned char *entries = malloc(length);
+	if (entries == NULL || !readTIFFBytes(tiff, offset + countSize, length, entries)) {
+		free(entries);
+		return -1;
+	}
+
+	TIFFEntry width = {0}, height = {0}, bits = {0}, compression = {0}, photometric = {0},
+		samples = {0}, rowsPerStrip = {0}, planar = {0}, predictor = {0},
+		tileWidth = {0}, tileHeight = {0}, sampleFormat = {0}, subfileType = {0}, noData = {0};
+	TIFFEntry stripOffsets = {0}, stripByteCounts = {0}, tileOffsets = {0}, tileByteCounts = {0};
+	memset(image, 0, sizeof(TIFFImage));
+	long i;
+	for (i = 0; i < nEntries; i++) {
+		const unsigned char *e = entries + i * entrySize;
+		TIFFEntry entry;
+		entry.type = tiffShort(tiff, e + 2);
+		entry.count = tiff->bigTIFF ? tiffLong8(tiff, e + 4) : tiffLong(tiff, e + 4);
+		const unsigned char *v = e + (tiff->bigTIFF ? 12 : 8);
+		memcpy(entry.value, v, valueSize);
+		entry.inlineValue = entry.count * tiffTypeSize(entry.type) <= valueSize;
+		entry.offset = tiff->bigTIFF ? tiffLong8(tiff, v) : tiffLong(tiff, v);
+		switch (tiffShort(tiff, e)) {
+			case TIFF_NEW_SUBFILE_TYPE: subfileType = entry; break;
+			case TIFF_IMAGE_WIDTH: width = entry; break;
+			case TIFF_IMAGE_LENGTH: height = entry; break;
+			case TIFF_BITS_PER_SAMPLE: bits = entry; break;
+			case TIFF_COMPRESSION: compression = entry; break;
+			case TIFF_PHOTOMETRIC: photometric = entry; break;
+			case TIFF_STRIP_OFFSETS: stripOffsets = entry; break;
+			case TIFF_SAMPLES_PER_PIXEL: samples = entry; break;
+			case TIFF_ROWS_PER_STRIP: rowsPerStrip = entry; break;
+			case TIFF_STRIP_BYTE_COUNTS: stripByteCounts = entry; break;
+			case TIFF_PLANAR_CONFIGURATION: planar = entry; break;
+			case TIFF_PREDICTOR: predictor = entry; break;
+			case TIFF_TILE_WIDTH: tileWidth = entry; break;
+			case TIFF_TILE_LENGTH: tileHeight = entry; break;
+			case TIFF_TILE_OFFSETS: tileOffsets = entry; break;
+			case TIFF_TILE_BYTE_COUNTS: tileByteCounts = entry; break;
+			case TIFF_SAMPLE_FORMAT: sampleFormat = entry; break;
+			case GDAL_NODATA: noData = entry; break;
+			case GEOTIFF_MODEL_PIXEL_SCALE:
+			case GEOTIFF_MODEL_TIEPOINT:
+			case GEOTIFF_MODEL_TRANSFORMATION:
+			case GEOTIFF_KEY_DIRECTORY:
+				image->geo = TRUE;
+				break;
+		}
+	}
+	SInt64 next = tiff->bigTIFF ? tiffLong8(tiff, entries + nEntries * entrySize)
+		: tiffLong(tiff, entries + nEntries * entrySize);
+	free(entries);
+
+	image->width = tiffEntryValue(tiff, &width, 0);
+	image->height = tiffEntryValue(tiff, &height, 0);
+	image->bitsPerSample = tiffEntryValue(tiff, &bits, 1);
+	image->sampleFormat = tiffEntryValue(tiff, &sampleFormat, TIFF_UNSIGNED_SAMPLES);
+	image->samplesPerPixel = tiffEntryValue(tiff, &samples, 1);
+	image->planar = tiffEntryValue(tiff, &planar, 1);
+	image->compression = tiffEntryValue(tiff, &compression, TIFF_NO_COMPRESSION);
+	image->predictor = tiffEntryValue(tiff, &predictor, 1);
+	image->photometric = tiffEntryValue(tiff, &photometric, 1);
+	image->subfileType = tiffEntryValue(tiff, &subfileType, 0);
+	readTIFFNoData(tiff, &noData, image);
+	if (tileWidth.count > 0) {
+		image->blockWidth = tiffEntryValue(tiff, &tileWidth, 0);
+		image->blockHeight = tiffEntryValue(tiff, &tileHeight, 0);
+		image->offsets = tileOffsets;
+		image->byteCounts = tileByteCounts;
+	} else {
+		image->blockWidth = image->width;
+		image->blockHeight = tiffEntryValue(tiff, &rowsPerStrip, image->height);
+		if (image->blockHeight > image->height)
+			image->blockHeight = image->height;
+		image->offsets = stripOffsets;
+		image->byteCounts = stripByteCounts;
+	}
+
+	// only single band grids with 8 to 64 bit samples are read
+	int bps = image->bitsPerSample;
+	bool validFormat = (image->sampleFormat == TIFF_FLOAT_SAMPLES && (bps == 32 || bps == 64))
+		|| ((image->sampleFormat == TIFF_UNSIGNED_SAMPLES || image->sampleFormat == TIFF_SIGNED_SAMPLES)
+			&& (bps == 8 || bps == 16 || bps == 32));
+	bool validPredictor = image->predictor == 1
+		|| (image->predictor == TIFF_HORIZONTAL_PREDICTOR && image->sampleFormat != TIFF_FLOAT_SAMPLES)
+		|| (image->predictor == TIFF_FLOAT_PREDICTOR && image->sampleFormat == TIFF_FLOAT_SAMPLES);
+	if (image->width <= 0 || image->height <= 0 || image->width > 10000000 || image->height > 10000000
+		|| image->blockWidth <= 0 || image->blockHeight <= 0
+		|| image->blockWidth * image->blockHeight > 64 * 1024 * 1024
+		|| !validFormat || !validPredictor
+		|| image->samplesPerPixel < 1 || image->samplesPerPixel > 64
+		|| (image->photometric != 0 && image->photometric != 1)
+		|| (image->compression != TIFF_NO_COMPRESSION && image->compression != TIFF_DEFLATE
+			&& image->compression != TIFF_ADOBE_DEFLATE))
+		return next;
+	image->blocksAcross = (image->width + image->blockWidth - 1) / image->blockWidth;
+	image->blocksDown = (image->height + image->blockHeight - 1) / image->blockHeight;
+	image->readable = image->offsets.count >= image->blocksAcross * image->blocksDown
+		&& image->byteCounts.count >= image->blocksAcross * image->blocksDown;
+	return next;
+}
+
+/* Returns the bytes of the first sample of a pixel in a block. With planar
+ configuration 2, the first sample of all pixels is stored in the first
+ blocks. */
+long tiffPixelBytes(const TIFFImage *image) {
+	long sampleBytes = image->bitsPerSample / 8;
+	return image->planar == 2 ? sampleBytes : sampleBytes * image->samplesPerPixel;
+}
+
+/* Shared by the worker threads that decode the rows of blocks with sampled
+ rows. Rows are taken in the order of rowReadingOrder(), so that the rows
+ decoded before the deadline are spread over the grid. */
+typedef struct {
+	TIFFFile *tiff;
+	const TIFFImage *image;
+	long *blockRows;
+	long nBlockRows;
+	long nextBlockRow;
+	pthread_mutex_t mutex;
+
+	int sdist;
+	long rw, rh;
+	float *grid;		// void cells are NAN
+
+	bool failed;
+	CFAbsoluteTime *deadline;
+	QLPreviewRequestRef preview;
+	QLThumbnailRequestRef thumbnail;
+} GeoTIFFDecoder;
+
+// each worker finds the range and the histogram of the cells it decodes
+typedef struct {
+	GeoTIFFDecoder *decoder;
+	float minVal, maxVal;
+	Histogram *histogram;
+
+	UInt64 *offsets, *byteCounts;	// of a row of blocks
+	unsigned char *entries;
+	unsigned char *data;			// a compressed block
+	size_t dataLength;
+	unsigned char *block;			// a decompressed block
+	unsigned char *row;				// used to undo the floating point predictor
+	z_stream stream;
+	bool streamInitialized;
+} GeoTIFFWorker;
+
+/* Returns the first sampled row or column at or after the cell pos, and the
+ number of sampled rows or columns in the following n cells. */
+long geoTIFFSamples(long pos, long n, int sdist, long resampledSize, long *first) {
+	*first = (pos + sdist - 1) / sdist;
+	long last = (pos + n - 1) / sdist;
+	if (last >= resampledSize)
+		last = resampledSize - 1;
+	return last >= *first ? last - *first + 1 : 0;
+}
+
+/* Decompresses the first length bytes of a block with deflate. */
+bool inflateTIFFBlock(GeoTIFFWorker *worker, const unsigned char *data, size_t dataLength, size_t length) {
+	z_stream *stream = &worker->stream;
+	if (!worker->streamInitialized) {
+		memset(stream, 0, sizeof(z_stream));
+		if (inflateInit(stream) != Z_OK)
+			return FALSE;
+		worker->streamInitialized = TRUE;
+	} else if (inflateReset(stream) != Z_OK)
+		return FALSE;
+	stream->next_in = (Bytef *)data;
+	stream->avail_in = dataLength;
+	stream->next_out = worker->block;
+	stream->avail_out = length;
+	int res;
+	do {
+		res = inflate(stream, Z_SYNC_FLUSH);
+	} while (res == Z_OK && stream->avail_out > 0);
+	return stream->avail_out == 0;
+}
+
+/* Converts the samples of a row to host byte order and undoes the horizontal
+ predictor, which stores the difference to the sample of the previous pixel. */
+void undoTIFFHorizontalPredictor(const GeoTIFFWorker *worker, unsigned char *row, long n) {
+	const TIFFImage *image = worker->decoder->image;
+	const TIFFFile *tiff = worker->decoder->tiff;
+	long stride = image->planar == 2 ? 1 : image->samplesPerPixel;
+	long i;
+	switch (image->bitsPerSample) {
+		case 8:
+			for (i = stride; i < n; i++)
+				row[i] += row[i - stride];
+			break;
+		case 16: {
+			UInt16 *s = (UInt16 *)row;
+			for (i = 0; i < n; i++)
+				s[i] = tiffShort(tiff, row + 2 * i);
+			for (i = stride; i < n; i++)
+				s[i] += s[i - stride];
+			break;
+		}
+		case 32: {
+			UInt32 *s = (UInt32 *)row;
+			for (i = 0; i < n; i++)
+				s[i] = tiffLong(tiff, row + 4 * i);
+			for (i = stride; i < n; i++)
+				s[i] += s[i - stride];
+			break;
+		}
+	}
+}
+
+/* Undoes the floating point predictor of a row. The bytes of the samples are
+ stored in planes, starting with the most significant bytes, and each byte
+ is stored as the difference to the previous byte. The samples are in host
+ byte order afterwards. */
+void undoTIFFFloatPredictor(GeoTIFFWorker *worker, unsigned char *row, long n) {
+	const TIFFImage *image = worker->decoder->image;
+	long stride = image->planar == 2 ? 1 : image->samplesPerPixel;
+	int bytes = image->bitsPerSample / 8;
+	long i, length = n * bytes;
+	int b;
+	for (i = stride; i < length; i++)
+		row[i] += row[i - stride];
+	memcpy(worker->row, row, length);
+	for (i = 0; i < n; i++) {
+		for (b = 0; b < bytes; b++) {
+#ifdef __LITTLE_ENDIAN__
+			row[i * bytes + bytes - 1 - b] = worker->row[b * n + i];
+#else
+			row[i * bytes + b] = worker->row[b * n + i];
+#endif
+		}
+	}
+}
+
+/* Returns a sample as a float. hostOrder is true if the predictor has
+ converted the sample to host byte order. */
+float tiffSample(const TIFFFile *tiff, const TIFFImage *image, const unsigned char *b, bool hostOrder) {
+	UInt32 v32;
+	UInt64 v64;
+	union { float f; UInt32 u; } f;
+	union { double d; UInt64 u; } d;
+	switch (image->bitsPerSample) {
+		case 8:
+			return image->sampleFormat == TIFF_SIGNED_SAMPLES ? (float)(signed char)b[0] : (float)b[0];
+		case 16:
+			if (hostOrder)
+				v32 = *(const UInt16 *)b;
+			else
+				v32 = tiffShort(tiff, b);
+			return image->sampleFormat == TIFF_SIGNED_SAMPLES ? (float)(SInt16)v32 : (float)(UInt16)v32;
+		case 32:
+			if (hostOrder)
+				memcpy(&v32, b, 4);
+			else
+				v32 = tiffLong(tiff, b);
+			if (image->sampleFormat == TIFF_FLOAT_SAMPLES) {
+				f.u = v32;
+				return f.f;
+			}
+			return image->sampleFormat == TIFF_SIGNED_SAMPLES ? (float)(SInt32)v32 : (float)v32;
+	}
+	if (hostOrder)
+		memcpy(&v64, b, 8);
+	else
+		v64 = tiffLong8(tiff, b);
+	d.u = v64;
+	return d.d;
+}
+
+/* Copies the sampled cells of a block to the grid. Only the rows up to the
+ last sampled row are decompressed. Blocks that cannot be decompressed are
+ void. */
+void decodeTIFFBlock(GeoTIFFWorker *worker, long blockRow, long blockCol,
+					 const unsigned char *data, size_t dataLength) {
+
+	GeoTIFFDecoder *decoder = worker->decoder;
+	const TIFFImage *image = decoder->image;
+	long row0 = blockRow * image->blockHeight, col0 = blockCol * image->blockWidth;
+	long blockRows = image->blockHeight;
+	if (row0 + blockRows > image->height && image->blockWidth == image->width)
+		blockRows = image->height - row0;	// the last strip can be shorter
+	long r0, c0, r, c;
+	long nr = geoTIFFSamples(row0, blockRows, decoder->sdist, decoder->rh, &r0);
+	long nc = geoTIFFSamples(col0, image->blockWidth, decoder->sdist, decoder->rw, &c0);
+	if (nr == 0 || nc == 0)
+		return;
+
+	long pixelBytes = tiffPixelBytes(image);
+	size_t rowBytes = image->blockWidth * pixelBytes;
+	size_t length = ((r0 + nr - 1) * decoder->sdist - row0 + 1) * rowBytes;
+	const unsigned char *block = data;
+	if (image->compression == TIFF_NO_COMPRESSION) {
+		if (dataLength < length)
+			return;
+		if (image->predictor != 1) {
+			memcpy(worker->block, data, length);
+			block = worker->block;
+		}
+	} else {
+		if (!inflateTIFFBlock(worker, data, dataLength, length))
+			return;
+		block = worker->block;
+	}
+
+	long samplesPerRow = rowBytes / (image->bitsPerSample / 8);
+	float noData = image->noData;
+	for (r = r0; r < r0 + nr; r++) {
+		unsigned char *row = (unsigned char *)block + (r * decoder->sdist - row0) * rowBytes;
+		if (image->predictor == TIFF_HORIZONTAL_PREDICTOR)
+			undoTIFFHorizontalPredictor(worker, row, samplesPerRow);
+		else if (image->predictor == TIFF_FLOAT_PREDICTOR)
+			undoTIFFFloatPredictor(worker, row, samplesPerRow);
+		float *gridRow = decoder->grid + r * decoder->rw;
+		for (c = c0; c < c0 + nc; c++) {
+			float f = tiffSample(decoder->tiff, image, row + (c * decoder->sdist - col0) * pixelBytes,
+								 image->predictor != 1);
+			if (!finite(f) || (image->hasNoData && f == noData))
+				continue;
+			gridRow[c] = f;
+			if (f < worker->minVal)
+				worker->minVal = f;
+			if (f > worker->maxVal)
+				worker->maxVal = f;
+			if (worker->histogram)
+				addFloatToHistogram(worker->histogram, f);
+		}
+	}
+}
+
+/* Reads and decodes the blocks with sampled columns in a row of blocks.
+ Blocks without data are void. Returns false if the file cannot be read. */
+bool decodeTIFFBlockRow(GeoTIFFWorker *worker, long blockRow) {
+
+	GeoTIFFDecoder *decoder = worker->decoder;
+	const TIFFImage *image = decoder->image;
+	long n = image->blocksAcross, b, first;
+	UInt64 firstBlock = blockRow * n;
+	if (!readTIFFValues(decoder->tiff, &image->offsets, firstBlock, n, worker->offsets, worker->entries)
+		|| !readTIFFValues(decoder->tiff, &image->byteCounts, firstBlock, n, worker->byteCounts, worker->entries))
+		return FALSE;
+	for (b = 0; b < n; b++) {
+		size_t length = worker->byteCounts[b];
+		if (length == 0 || worker->offsets[b] == 0
+			|| geoTIFFSamples(b * image->blockWidth, image->blockWidth,
+							  decoder->sdist, decoder->rw, &first) == 0)
+			continue;
+		if (length > worker->dataLength) {
+			releaseBuffer(worker->data);
+			worker->data = allocBuffer(length);
+			worker->dataLength = worker->data ? length : 0;
+			if (worker->data == NULL)
+				return FALSE;
+		}
+		if (!readTIFFBytes(decoder->tiff, worker->offsets[b], length, worker->data))
+			return FALSE;
+		decodeTIFFBlock(worker, blockRow, b, worker->data, length);
+	}
+	return TRUE;
+}
+
+/* Worker thread: decodes rows of blocks until all are decoded, the time is
+ up or reading failed. */
+void *decodeTIFFBlockRows(void *info) {
+	GeoTIFFWorker *worker = info;
+	GeoTIFFDecoder *decoder = worker->decoder;
+	setDeadline(decoder->deadline);
+	for (;;) {
+		pthread_mutex_lock(&decoder->mutex);
+		long i = decoder->nBlockRows;
+		if (!decoder->failed && (decoder->nextBlockRow == 0 || !isPastDeadline()))
+			i = decoder->nextBlockRow++;
+		pthread_mutex_unlock(&decoder->mutex);
+		if (i >= decoder->nBlockRows)
+			break;
+		if (isCancelled(decoder->preview, decoder->thumbnail)
+			|| !decodeTIFFBlockRow(worker, decoder->blockRows[i])) {
+			decoder->failed = TRUE;
+			break;
+		}
+	}
+	setDeadline(NULL);
+	return NULL;
+}
+
+bool initGeoTIFFWorker(GeoTIFFWorker *worker, GeoTIFFDecoder *decoder, Histogram *histogram) {
+	const TIFFImage *image = decoder->image;
+	memset(worker, 0, sizeof(GeoTIFFWorker));
+	worker->decoder = decoder;
+	worker->minVal = MAXFLOAT;
+	worker->maxVal = -MAXFLOAT;
+	worker->offsets = malloc(image->blocksAcross * sizeof(UInt64));
+	worker->byteCounts = malloc(image->blocksAcross * sizeof(UInt64));
+	worker->entries = malloc(image->blocksAcross * 8);
+	worker->block = allocBuffer(image->blockWidth * image->blockHeight * tiffPixelBytes(image));
+	worker->row = allocBuffer(image->blockWidth * tiffPixelBytes(image));
+	worker->histogram = histogram ? createHistogram(histogram->stretch) : NULL;
+	return worker->offsets && worker->byteCounts && worker->entries && worker->block
+		&& worker->row && (histogram == NULL || worker->histogram);
+}
+
+void releaseGeoTIFFWorker(GeoTIFFWorker *worker) {
+	free(worker->offsets);
+	free(worker->byteCounts);
+	free(worker->entries);
+	releaseBuffer(worker->data);
+	releaseBuffer(worker->block);
+	releaseBuffer(worker->row);
+	releaseHistogram(worker->histogram);
+	if (worker->streamInitialized)
+		inflateEnd(&worker->stream);
+}
+
+/* Returns the rows of blocks that contain sampled rows in the order of
+ rowReadingOrder(). */
+long *tiffBlockRows(const GeoTIFFDecoder *decoder, long *nBlockRows) {
+
+	const TIFFImage *image = decoder->image;
+	long *sampled = malloc(image->blocksDown * sizeof(long));
+	if (sampled == NULL)
+		return NULL;
+	long b, i, first;
+	*nBlockRows = 0;
+	for (b = 0; b < image->blocksDown; b++) {
+		if (geoTIFFSamples(b * image->blockHeight, image->blockHeight,
+						   decoder->sdist, decoder->rh, &first) > 0)
+			sampled[(*nBlockRows)++] = b;
+	}
+	long *order = rowReadingOrder(*nBlockRows, image->width * tiffPixelBytes(image) * image->blockHeight);
+	if (order == NULL) {
+		free(sampled);
+		return NULL;
+	}
+	for (i = 0; i < *nBlockRows; i++)
+		order[i] = sampled[order[i]];
+	free(sampled);
+	return order;
+}
+
+/* Replaces the sampled rows in the rows of blocks that were not decoded before
+ the deadline. */
+void fillUndecodedTIFFRows(const GeoTIFFDecoder *decoder) {
+
+	long nDecoded = decoder->nextBlockRow < decoder->nBlockRows ? decoder->nextBlockRow : decoder->nBlockRows;
+	long *order = malloc(decoder->rh * sizeof(long));
+	if (order == NULL)
+		return;
+	long i, r, first, nRead = 0;
+	for (i = 0; i < nDecoded; i++) {
+		long row0 = decoder->blockRows[i] * decoder->image->blockHeight;
+		long n = geoTIFFSamples(row0, decoder->image->blockHeight, decoder->sdist, decoder->rh, &first);
+		for (r = first; r < first + n; r++)
+			order[nRead++] = r;
+	}
+	fillUnreadRows(decoder->grid, decoder->rw * sizeof(float), decoder->rh, order, nRead);
+	free(order);
+}
+
+/* Reads the byte order and the version of a classic TIFF or BigTIFF file, 
+ and the offset of the first IFD. Returns false if the file is not a TIFF 
+ file. */
+bool readTIFFHeader(TIFFFile *tiff, UInt64 *offset) {
+	unsigned char header[16];
+	if (!readTIFFBytes(tiff, 0, 8, header))
+		return FALSE;
+	if (memcmp(header, "MM", 2) == 0)
+		tiff->bigEndian = TRUE;
+	else if (memcmp(header, "II", 2) != 0)
+		return FALSE;
+	UInt16 version = tiffShort(tiff, header + 2);
+	if (version == 42)
+		*offset = tiffLong(tiff, header + 4);
+	else if (version == 43 && tiffShort(tiff, header + 4) == 8
+			 && readTIFFBytes(tiff, 8, 8, header + 8)) {
+		tiff->bigTIFF = TRUE;
+		*offset = tiffLong8(tiff, header + 8);
+	} else
+		return FALSE;
+	return TRUE;
+}
+
+/* Returns true if the first image of a TIFF file is a single band grid with
+ GeoTIFF tags that can be read. */
+bool isGeoTIFFGridImage(const TIFFImage *image) {
+	return image->readable && image->geo && !(image->subfileType & 1);
+}
+
+/* Returns true if a TIFF file is a GeoTIFF grid that readGeoTIFFImage() can
+ read. Only the header and the first IFD are read, so that photos, scans and
+ other TIFF images are rejected quickly and left to the system preview. */
+bool isGeoTIFFGrid(FILE *fp) {
+	TIFFFile tiff;
+	TIFFImage image;
+	memset(&tiff, 0, sizeof(tiff));
+	tiff.fp = fp;
+	tiff.fd = fileno(fp);
+	UInt64 offset;
+	return readTIFFHeader(&tiff, &offset)
+		&& readTIFFImage(&tiff, offset, &image) >= 0
+		&& isGeoTIFFGridImage(&image);
+}
+
+/* Reads the images of a TIFF file and returns the smallest one that is at
+ least maxSize large, or the largest image. Reduced resolution images are
+ only used if they have the same format as the full resolution image.
+ Returns false if the file is not a GeoTIFF that can be read. */
+bool findGeoTIFFImage(TIFFFile *tiff, long maxSize, TIFFImage *image) {
+
+	UInt64 offset;
+	if (!readTIFFHeader(tiff, &offset))
+		return FALSE;
+
+	if (maxSize < 1)
+		maxSize = MAX_GRID_SIZE;
+	TIFFImage candidate;
+	SInt64 next = readTIFFImage(tiff, offset, image);
+	if (next < 0 || !isGeoTIFFGridImage(image))
+		return FALSE;
+	int i;
+	for (i = 1; i < TIFF_MAX_IMAGES && next > 0; i++) {
+
+		// masks and images with another format are skipped
+		UInt64 candidateOffset = next;
+		next = readTIFFImage(tiff, candidateOffset, &candidate);
+		if (next < 0 || next == candidateOffset)
+			break;
+		if (!candidate.readable || !(candidate.subfileType & 1) || (candidate.subfileType & 4)
+			|| candidate.bitsPerSample != image->bitsPerSample
+			|| candidate.sampleFormat != image->sampleFormat)
+			continue;
+
+		long size = candidate.width > candidate.height ? candidate.width : candidate.height;
+		long currentSize = image->width > image->height ? image->width : image->height;
+		if (size >= maxSize && size < currentSize) {
+			candidate.hasNoData = image->hasNoData;
+			candidate.noData = image->noData;
+			*image = candidate;
+		}
+	}
+	return TRUE;
+}
+
+unsigned char *scaleGeoTIFFToByte(float *floatBuffer, long gridSize, long cols,
+								  float minVal, float maxVal,
+								  Histogram *histogram,
+								  bool hillshade) {
+
+	if (hillshade)
+		return hillshadeFloatGrid(floatBuffer, cols, gridSize / cols, minVal, maxVal, NAN);
+
+	long i;
+	FloatStretch stretch;
+	if (!initFloatStretch(&stretch, histogram, minVal, maxVal))
+		return allocZeroedBuffer(gridSize); // return an empty gray buffer
+
+	unsigned char * grayBuffer = allocBuffer(gridSize);
+	if (grayBuffer == NULL) {
+		releaseFloatStretch(&stretch);
+		return NULL;
+	}
+	for (i = 0; i < gridSize; i++) {
+		if (!finite(floatBuffer[i]))
+			grayBuffer[i] = 255;
+		else
+			grayBuffer[i] = stretchFloat(floatBuffer[i], &stretch);
+	}
+
+	releaseFloatStretch(&stretch);
+	return grayBuffer;
+}
+
+CGImageRef readGeoTIFFImage(FILE * fp,
+							long maxSize,
+							QLPreviewRequestRef preview,
+							QLThumbnailRequestRef thumbnail) {
+
+	TIFFFile tiff;
+	TIFFImage image;
+	memset(&tiff, 0, sizeof(tiff));
+	tiff.fp = fp;
+	tiff.fd = fileno(fp);
+	if (!findGeoTIFFImage(&tiff, maxSize, &image))
+		return NULL;
+
+	GeoTIFFDecoder decoder;
+	memset(&decoder, 0, sizeof(decoder));
+	decoder.tiff = &tiff;
+	decoder.image = &image;
+	decoder.rw = resampledWidth(image.width, image.height, maxSize);
+	decoder.rh = resampledHeight(image.width, image.height, maxSize);
+	decoder.sdist = sampleDist(image.width, image.height, maxSize);
+	long i, gridSize = decoder.rw * decoder.rh;
+	decoder.grid = allocBuffer(gridSize * sizeof(float));
+	decoder.blockRows = tiffBlockRows(&decoder, &decoder.nBlockRows);
+	if (decoder.grid == NULL || decoder.blockRows == NULL) {
+		releaseBuffer(decoder.grid);
+		free(decoder.blockRows);
+		return NULL;
+	}
+
+	// blocks without data are void
+	for (i = 0; i < gridSize; i++)
+		decoder.grid[i] = NAN;
+
+	bool hillshade = hillshadePreference();
+	Histogram *histogram = hillshade ? NULL : createHistogram(stretchForFormat(CFSTR("GeoTIFFStretch"), percentileStretch));
+	decoder.deadline = getDeadline();
+	decoder.preview = preview;
+	decoder.thumbnail = thumbnail;
+	pthread_mutex_init(&decoder.mutex, NULL);
+
+	// each worker has its own buffers, range and histogram
+	GeoTIFFWorker workers[MAX_WORKER_THREADS];
+	pthread_t threads[MAX_WORKER_THREADS];
+	int maxThreads = tiff.fd < 0 ? 1 : workerThreadCount();
+	if (maxThreads > decoder.nBlockRows)
+		maxThreads = decoder.nBlockRows > 0 ? decoder.nBlockRows : 1;
+	int w, nWorkers, nThreads = 0;
+	for (nWorkers = 0; nWorkers < maxThreads; nWorkers++) {
+		if (!initGeoTIFFWorker(&workers[nWorkers], &decoder, histogram)) {
+			releaseGeoTIFFWorker(&workers[nWorkers]);
+			break;
+		}
+	}
+	if (nWorkers == 0)
+		decoder.failed = TRUE;
+	else if (tiff.fd >= 0) {
+		while (nThreads < nWorkers
+			   && pthread_create(&threads[nThreads], NULL, decodeTIFFBlockRows, &workers[nThreads]) == 0)
+			nThreads++;
+	}
+	if (nWorkers > 0 && nThreads == 0)
+		decodeTIFFBlockRows(&workers[0]);
+	for (w = 0; w < nThreads; w++)
+		pthread_join(threads[w], NULL);
+	pthread_mutex_destroy(&decoder.mutex);
+	if (nThreads == 0)
+		setDeadline(decoder.deadline);
+
+	// merge the ranges and histograms of the workers
+	float minVal = MAXFLOAT, maxVal = -MAXFLOAT;
+	for (w = 0; w < nWorkers; w++) {
+		if (workers[w].minVal < minVal)
+			minVal = workers[w].minVal;
+		if (workers[w].maxVal > maxVal)
+			maxVal = workers[w].maxVal;
+		if (workers[w].histogram)
+			mergeHistogram(histogram, workers[w].histogram);
+		releaseGeoTIFFWorker(&workers[w]);
+	}
+
+	if (decoder.failed || isCancelled(preview, thumbnail)) {
+		releaseHistogram(histogram);
+		releaseBuffer(decoder.grid);
+		free(decoder.blockRows);
+		return NULL;
+	}
+	fillUndecodedTIFFRows(&decoder);
+	free(decoder.blockRows);
+
+	unsigned char *grayBuffer = scaleGeoTIFFToByte(decoder.grid, gridSize, decoder.rw,
+												   minVal, maxVal, histogram, hillshade);
+	releaseHistogram(histogram);
+	releaseBuffer(decoder.grid);
+	if (grayBuffer == NULL)
+		return NULL;
+
+	// the gradation curve is only applied to stretched values
+	if (hillshade)
+		return createGradedGrayScaleImage(grayBuffer, decoder.rw, decoder.rh);
+	return createGrayScaleImage(grayBuffer, decoder.rw, decoder.rh);
+
+}
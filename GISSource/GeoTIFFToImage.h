@@ -0,0 +1,21 @@
+/*
+ *  GeoTIFFToImage.h
+ *  GISLook
+ *
+ */
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <CoreFoundation/CFPlugInCOM.h>
+#include <CoreServices/CoreServices.h>
+#include <QuickLook/QuickLook.h>
+
+#ifndef __GEOTIFF2IMAGE__
+#define __GEOTIFF2IMAGE__
+
+bool isGeoTIFFGrid(FILE *fp);
+CGImageRef readGeoTIFFImage(FILE * fp,
+							long maxSize,
+							QLPreviewRequestRef preview,
+							QLThumbnailRequestRef thumbnail);
+
+#endif
@@ -0,0 +1,386 @@
+/*
+ *  GzipFile.c
+ *  GISLook
+ *
+ */
+
+/* Decompresses gzip files while they are read, so that readers of ASCII grids
+ and E00 files can read compressed files through a standard FILE. Only the
+ compressed bytes are read from disk, which is considerably less for text
+ formats on network volumes.
+
+ Files compressed with bgzip consist of independent blocks of at most 64 KB,
+ and the size of each block is stored in its header. Batches of these blocks
+ are decompressed in parallel. Other gzip files, including files with
+ multiple members, are decompressed sequentially.
+
+ Seeking forward decompresses and discards data, seeking backward restarts
+ at the beginning of the file. The decompressed length is not known, so
+ seeking relative to the end of the file is not supported. */
+
+#include "GzipFile.h"
+#include "Parallel.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+// compressed bytes read at once from a sequential gzip stream
+#define GZIP_CHUNK_SIZE (16 * 1024)
+
+// maximum size of a compressed or decompressed bgzip block
+#define BGZF_MAX_BLOCK_SIZE (64 * 1024)
+
+// number of bgzip blocks decompressed in a batch
+#define BGZF_BATCH_BLOCKS (4 * MAX_WORKER_THREADS)
+
+// a bgzip block of a batch
+typedef struct {
+	unsigned char *data;		// raw deflate data
+	size_t dataLength;
+	unsigned char *out;			// decompressed block in the batch buffer
+	size_t outLength;
+	bool failed;
+} BGZFBlock;
+
+typedef struct {
+	int fd;
+	off_t budget;				// compressed bytes that may be read from the start of the file
+	off_t compressedPosition;	// of fd
+	off_t position;				// in the decompressed stream
+	bool end;
+
+	// sequential gzip stream
+	z_stream stream;
+	unsigned char *in;
+
+	// batch of bgzip blocks
+	bool blocked;
+	unsigned char *compressed;
+	unsigned char *out;
+	size_t outLength, outPosition;
+	BGZFBlock blocks[BGZF_BATCH_BLOCKS];
+	long nBlocks, nextBlock;
+	pthread_mutex_t mutex;
+} GzipFile;
+
+/* Returns true if a file starts with the gzip signature. Does not move the
+ file position. */
+bool isGzipFile(int fd) {
+	unsigned char magic[3];
+	return pread(fd, magic, 3, 0) == 3 && magic[0] == 0x1f && magic[1] == 0x8b && magic[2] == 8;
+}
+
+/* Reads at most n compressed bytes, but not beyond the budget. */
+ssize_t readCompressed(GzipFile *file, unsigned char *buf, size_t n) {
+	if (file->compressedPosition + (off_t)n > file->budget)
+		n = file->budget - file->compressedPosition;
+	if (n <= 0)
+		return 0;
+	ssize_t res = read(file->fd, buf, n);
+	if (res > 0)
+		file->compressedPosition += res;
+	return res;
+}
+
+/* Reads exactly n compressed bytes. */
+bool readAllCompressed(GzipFile *file, unsigned char *buf, size_t n) {
+	while (n > 0) {
+		ssize_t res = readCompressed(file, buf, n);
+		if (res <= 0)
+			return FALSE;
+		buf += res;
+		n -= res;
+	}
+	return TRUE;
+}
+
+/* Returns the total size of a bgzip block from the extra field of its gzip
+ header, or 0 if the header is not a bgzip header. */
+size_t bgzfBlockSize(const unsigned char *header, const unsigned char *extra, size_t extraLength) {
+	if (header[0] != 0x1f || header[1] != 0x8b || header[2] != 8 || !(header[3] & 4))
+		return 0;
+	size_t i = 0;
+	while (i + 4 <= extraLength) {
+		size_t fieldLength = extra[i + 2] | (extra[i + 3] << 8);
+		if (extra[i] == 'B' && extra[i + 1] == 'C' && fieldLength == 2 && i + 6 <= extraLength)
+			return (extra[i + 4] | (extra[i + 5] << 8)) + 1;
+		i += 4 + fieldLength;
+	}
+	return 0;
+}
+
+/* Returns true if the first member of a file is a bgzip block. */
+bool isBGZFFile(int fd) {
+	unsigned char header[18];
+	if (pread(fd, header, 18, 0) != 18)
+		return FALSE;
+	size_t extraLength = header[10] | (header[11] << 8);
+	return extraLength >= 6 && bgzfBlockSize(header, header + 12, 6) > 0;
+}
+
+/* Reads the next bgzip block into data. Returns false at the end of the file
+ or if the block is not a valid bgzip block. */
+bool readBGZFBlock(GzipFile *file, unsigned char *data, BGZFBlock *block) {
+
+	if (!readAllCompressed(file, data, 12))
+		return FALSE;
+	size_t extraLength = data[10] | (data[11] << 8);
+	if (extraLength > 256 || !readAllCompressed(file, data + 12, extraLength))
+		return FALSE;
+	size_t blockSize = bgzfBlockSize(data, data + 12, extraLength);
+	size_t headerSize = 12 + extraLength;
+	if (blockSize < headerSize + 8 || blockSize > BGZF_MAX_BLOCK_SIZE
+		|| !readAllCompressed(file, data + headerSize, blockSize - headerSize))
+		return FALSE;
+
+	// the block ends with the CRC and the decompressed size
+	const unsigned char *size = data + blockSize - 4;
+	block->outLength = size[0] | (size[1] << 8) | (size[2] << 16) | ((size_t)size[3] << 24);
+	block->data = data + headerSize;
+	block->dataLength = blockSize - headerSize - 8;
+	block->failed = FALSE;
+	return block->outLength <= BGZF_MAX_BLOCK_SIZE;
+}
+
+/* Worker thread: decompresses the blocks of a batch until all are done. */
+void *inflateBGZFBlocks(void *info) {
+
+	GzipFile *file = info;
+	z_stream stream;
+	memset(&stream, 0, sizeof(z_stream));
+	bool initialized = inflateInit2(&stream, -MAX_WBITS) == Z_OK;
+	for (;;) {
+		pthread_mutex_lock(&file->mutex);
+		long i = file->nextBlock++;
+		pthread_mutex_unlock(&file->mutex);
+		if (i >= file->nBlocks)
+			break;
+		BGZFBlock *block = &file->blocks[i];
+		if (!initialized || inflateReset(&stream) != Z_OK) {
+			block->failed = TRUE;
+			continue;
+		}
+		stream.next_in = block->data;
+		stream.avail_in = block->dataLength;
+		stream.next_out = block->out;
+		stream.avail_out = block->outLength;
+		block->failed = inflate(&stream, Z_FINISH) != Z_STREAM_END || stream.avail_out != 0;
+	}
+	if (initialized)
+		inflateEnd(&stream);
+	return NULL;
+
+}
+
+/* Reads the next batch of bgzip blocks and decompresses them in parallel.
+ Returns false at the end of the file. */
+bool readBGZFBatch(GzipFile *file) {
+
+	file->outLength = file->outPosition = 0;
+	file->nBlocks = file->nextBlock = 0;
+	size_t outLength = 0;
+	while (file->nBlocks < BGZF_BATCH_BLOCKS) {
+		BGZFBlock *block = &file->blocks[file->nBlocks];
+		if (!readBGZFBlock(file, file->compressed + file->nBlocks * BGZF_MAX_BLOCK_SIZE, block)) {
+			file->end = TRUE;
+			break;
+		}
+		// the empty block at the end of the file has no data
+		if (block->outLength == 0)
+			continue;
+		block->out = file->out + outLength;
+		outLength += block->outLength;
+		file->nBlocks++;
+	}
+	if (file->nBlocks == 0)
+		return FALSE;
+
+	pthread_t threads[MAX_WORKER_THREADS];
+	int t, nThreads = 0, maxThreads = workerThreadCount();
+	if (maxThreads > file->nBlocks)
+		maxThreads = file->nBlocks;
+	while (maxThreads > 1 && nThreads < maxThreads
+		   && pthread_create(&threads[nThreads], NULL, inflateBGZFBlocks, file) == 0)
+		nThreads++;
+	if (nThreads == 0)
+		inflateBGZFBlocks(file);
+	for (t = 0; t < nThreads; t++)
+		pthread_join(threads[t], NULL);
+
+	// decompressed data ends before the first damaged block
+	long i;
+	for (i = 0; i < file->nBlocks; i++) {
+		if (file->blocks[i].failed) {
+			file->end = TRUE;
+			break;
+		}
+		file->outLength += file->blocks[i].outLength;
+	}
+	return file->outLength > 0;
+
+}
+
+int readBGZFFile(GzipFile *file, char *buf, int nbytes) {
+	int n = 0;
+	while (n < nbytes) {
+		if (file->outPosition == file->outLength && (file->end || !readBGZFBatch(file)))
+			break;
+		size_t length = file->outLength - file->outPosition;
+		if (length > (size_t)(nbytes - n))
+			length = nbytes - n;
+		memcpy(buf + n, file->out + file->outPosition, length);
+		file->outPosition += length;
+		n += length;
+	}
+	return n;
+}
+
+/* Decompresses a sequential gzip stream. Concatenated gzip members are read
+ as a single stream. */
+int readGzipStream(GzipFile *file, char *buf, int nbytes) {
+
+	z_stream *stream = &file->stream;
+	stream->next_out = (Bytef *)buf;
+	stream->avail_out = nbytes;
+	while (stream->avail_out > 0 && !file->end) {
+		if (stream->avail_in == 0) {
+			ssize_t n = readCompressed(file, file->in, GZIP_CHUNK_SIZE);
+			if (n <= 0) {
+				file->end = TRUE;
+				break;
+			}
+			stream->next_in = file->in;
+			stream->avail_in = n;
+		}
+		int res = inflate(stream, Z_NO_FLUSH);
+		if (res == Z_STREAM_END) {
+			if (stream->avail_in == 0) {
+				ssize_t n = readCompressed(file, file->in, GZIP_CHUNK_SIZE);
+				stream->next_in = file->in;
+				stream->avail_in = n > 0 ? n : 0;
+			}
+			// another member follows, or the end of the file or padding
+			if (stream->avail_in == 0 || stream->next_in[0] != 0x1f || inflateReset(stream) != Z_OK)
+				file->end = TRUE;
+		} else if (res != Z_OK && res != Z_BUF_ERROR)
+			file->end = TRUE;
+	}
+	return nbytes - stream->avail_out;
+
+}
+
+int readGzipFile(void *cookie, char *buf, int nbytes) {
+	GzipFile *file = (GzipFile *)cookie;
+	int n = file->blocked ? readBGZFFile(file, buf, nbytes) : readGzipStream(file, buf, nbytes);
+	file->position += n;
+	return n;
+}
+
+/* Moves to the start of the file. */
+bool restartGzipFile(GzipFile *file) {
+	if (lseek(file->fd, 0, SEEK_SET) != 0)
+		return FALSE;
+	file->compressedPosition = 0;
+	file->position = 0;
+	file->end = FALSE;
+	file->outLength = file->outPosition = 0;
+	file->stream.avail_in = 0;
+	return file->blocked || inflateReset(&file->stream) == Z_OK;
+}
+
+fpos_t seekGzipFile(void *cookie, fpos_t offset, int whence) {
+
+	GzipFile *file = (GzipFile *)cookie;
+	off_t target;
+	if (whence == SEEK_SET)
+		target = offset;
+	else if (whence == SEEK_CUR)
+		target = file->position + offset;
+	else {
+		errno = ESPIPE;
+		return -1;
+	}
+	if (target < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (target < file->position && !restartGzipFile(file))
+		return -1;
+	char skip[4096];
+	while (file->position < target) {
+		off_t n = target - file->position;
+		if (readGzipFile(file, skip, n < (off_t)sizeof(skip) ? (int)n : (int)sizeof(skip)) <= 0) {
+			errno = EINVAL;
+			return -1;
+		}
+	}
+	return file->position;
+
+}
+
+void releaseGzipFile(GzipFile *file) {
+	if (file->blocked)
+		pthread_mutex_destroy(&file->mutex);
+	else if (file->in)
+		inflateEnd(&file->stream);
+	free(file->in);
+	free(file->compressed);
+	free(file->out);
+	free(file);
+}
+
+int closeGzipFile(void *cookie) {
+	GzipFile *file = (GzipFile *)cookie;
+	int res = close(file->fd);
+	releaseGzipFile(file);
+	return res;
+}
+
+/* Opens a gzip compressed file for reading decompressed data. At most budget
+ compressed bytes are read from the start of the file. Reading again after
+ seeking backward does not count against the budget. Takes ownership of fd,
+ which is closed when the returned file is closed with fclose(). */
+FILE * openGzipFile(int fd, long budget) {
+
+	GzipFile *file = calloc(1, sizeof(GzipFile));
+	if (file == NULL)
+		return NULL;
+	file->fd = fd;
+	file->budget = budget;
+	file->blocked = isBGZFFile(fd);
+	if (lseek(fd, 0, SEEK_SET) != 0) {
+		free(file);
+		return NULL;
+	}
+	bool initialized;
+	if (file->blocked) {
+		file->compressed = malloc(BGZF_BATCH_BLOCKS * BGZF_MAX_BLOCK_SIZE);
+		file->out = malloc(BGZF_BATCH_BLOCKS * BGZF_MAX_BLOCK_SIZE);
+		initialized = file->compressed && file->out && pthread_mutex_init(&file->mutex, NULL) == 0;
+	} else {
+		// 16 is added to the window size to decode the gzip header
+		file->in = malloc(GZIP_CHUNK_SIZE);
+		initialized = file->in && inflateInit2(&file->stream, MAX_WBITS + 16) == Z_OK;
+	}
+	if (!initialized) {
+		free(file->in);
+		free(file->compressed);
+		free(file->out);
+		free(file);
+		return NULL;
+	}
+
+	FILE *fp = funopen(file, readGzipFile, NULL, seekGzipFile, closeGzipFile);
+	if (fp == NULL) {
+		releaseGzipFile(file);
+		return NULL;
+	}
+	setvbuf(fp, NULL, _IOFBF, GZIP_BUFFER_SIZE);
+	return fp;
+
+}
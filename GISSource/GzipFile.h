@@ -0,0 +1,19 @@
+/*
+ *  GzipFile.h
+ *  GISLook
+ *
+ */
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <stdio.h>
+
+#ifndef __GISLOOK_GZIPFILE__
+#define __GISLOOK_GZIPFILE__
+
+// size of the stdio buffer of a decompressed stream
+#define GZIP_BUFFER_SIZE (64 * 1024)
+
+bool isGzipFile(int fd);
+FILE * openGzipFile(int fd, long budget);
+
+#endif
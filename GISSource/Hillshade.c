@@ -0,0 +1,156 @@
+/*
+ *  Hillshade.c
+ *  GISLook
+ *
+ */
+
+/* Analytical hillshading of elevation grids. The shading is computed with the
+ 3x3 stencil of Horn (1981) while the sampled grid is converted to gray 
+ values, instead of the linear stretch. Only three rows of the grid are kept as
+ floats in a rolling window; each row is converted once and the window is 
+ padded at the left and right, so that the inner loop has no branches for 
+ borders and can be vectorized by the compiler. Void cells are white, and 
+ void neighbors are replaced by the center cell. */
+
+#include "Hillshade.h"
+#include "BufferPool.h"
+#include <math.h>
+
+/* Returns true if grids should be hillshaded instead of stretched. Hillshading
+ is turned on with the Hillshade default of GISLook: 
+ defaults write ch.bernhardjenny.gislook Hillshade -bool YES */
+bool hillshadePreference(void) {
+	Boolean valid;
+	Boolean hillshade = CFPreferencesGetAppBooleanValue(CFSTR("Hillshade"), 
+														CFSTR("ch.bernhardjenny.gislook"), 
+														&valid);
+	return valid && hillshade;
+}
+
+// the grid that is shaded, either floats or shorts
+typedef struct {
+	const float *floatGrid;
+	const short *shortGrid;
+	float voidValue;
+	const short *voidValues;
+	int nVoidValues;
+	long cols;
+	float zScale;
+	float *window;
+} ShadedGrid;
+
+/* Returns the padded row of the window that contains a row of the grid. */
+float *windowRow(ShadedGrid *g, long row) {
+	return g->window + (row % 3) * (g->cols + 2) + 1;
+}
+
+/* Converts a row of the grid to scaled elevations in the window. Void cells 
+ are NAN. */
+void loadWindowRow(ShadedGrid *g, long row) {
+	float *w = windowRow(g, row);
+	long c;
+	if (g->floatGrid) {
+		const float *src = g->floatGrid + row * g->cols;
+		for (c = 0; c < g->cols; c++) {
+			float v = src[c];
+			w[c] = (v == g->voidValue || !finite(v)) ? NAN : v * g->zScale;
+		}
+	} else {
+		const short *src = g->shortGrid + row * g->cols;
+		for (c = 0; c < g->cols; c++) {
+			short v = src[c];
+			int i;
+			w[c] = v * g->zScale;
+			for (i = 0; i < g->nVoidValues; i++)
+				if (v == g->voidValues[i])
+					w[c] = NAN;
+		}
+	}
+	w[-1] = w[0];
+	w[g->cols] = w[g->cols - 1];
+}
+
+unsigned char *hillshade(ShadedGrid *g, long rows, float range) {
+	
+	long cols = g->cols;
+	unsigned char *grayBuffer = allocBuffer(cols * rows);
+	g->window = allocBuffer(3 * (cols + 2) * sizeof(float));
+	if (grayBuffer == NULL || g->window == NULL) {
+		releaseBuffer(grayBuffer);
+		releaseBuffer(g->window);
+		return NULL;
+	}
+	
+	// scale elevations to the unit of the cell size
+	g->zScale = range > 0.f ? HILLSHADE_RELIEF * (cols > rows ? cols : rows) / range : 0.f;
+	
+	// light vector; x points east, y points north
+	const double azimuth = HILLSHADE_AZIMUTH * M_PI / 180.;
+	const double altitude = HILLSHADE_ALTITUDE * M_PI / 180.;
+	const float lx = cos(altitude) * sin(azimuth) * 255.;
+	const float ly = cos(altitude) * cos(azimuth) * 255.;
+	const float lz = sin(altitude) * 255.;
+	
+	long r, c;
+	loadWindowRow(g, 0);
+	if (rows > 1)
+		loadWindowRow(g, 1);
+	for (r = 0; r < rows; r++) {
+		
+		// the rolling window: the row below replaces the row two rows above
+		if (r > 0 && r + 1 < rows)
+			loadWindowRow(g, r + 1);
+		const float *above = windowRow(g, r > 0 ? r - 1 : 0);
+		const float *center = windowRow(g, r);
+		const float *below = windowRow(g, r + 1 < rows ? r + 1 : r);
+		unsigned char *gray = grayBuffer + r * cols;
+		
+		for (c = 0; c < cols; c++) {
+			float e = center[c];
+			if (e != e) {
+				gray[c] = 255;
+				continue;
+			}
+			
+			// replace void neighbors by the center
+			float a = above[c - 1], b = above[c], cc = above[c + 1];
+			float d = center[c - 1], f = center[c + 1];
+			float gg = below[c - 1], h = below[c], i = below[c + 1];
+			if (a != a) a = e;
+			if (b != b) b = e;
+			if (cc != cc) cc = e;
+			if (d != d) d = e;
+			if (f != f) f = e;
+			if (gg != gg) gg = e;
+			if (h != h) h = e;
+			if (i != i) i = e;
+			
+			// Horn's gradient; rows increase towards south
+			float dzdx = ((cc + 2.f * f + i) - (a + 2.f * d + gg)) * 0.125f;
+			float dzdy = ((a + 2.f * b + cc) - (gg + 2.f * h + i)) * 0.125f;
+			
+			// cosine of the angle between the surface normal and the light
+			float shade = (lz - lx * dzdx - ly * dzdy) / sqrtf(1.f + dzdx * dzdx + dzdy * dzdy);
+			gray[c] = shade > 0.f ? (unsigned char)shade : 0;
+		}
+	}
+	
+	releaseBuffer(g->window);
+	return grayBuffer;
+	
+}
+
+/* Returns gray values with the shading of a grid of floats. */
+unsigned char *hillshadeFloatGrid(const float *grid, long cols, long rows, 
+								  float minVal, float maxVal, float voidValue) {
+	ShadedGrid g = {grid, NULL, voidValue, NULL, 0, cols, 0.f, NULL};
+	return hillshade(&g, rows, maxVal - minVal);
+}
+
+/* Returns gray values with the shading of a grid of 16 bit values. */
+unsigned char *hillshadeShortGrid(const short *grid, long cols, long rows, 
+								  long minVal, long maxVal, 
+								  const short *voidValues, int nVoidValues) {
+	ShadedGrid g = {NULL, grid, 0.f, voidValues, nVoidValues, cols, 0.f, NULL};
+	return hillshade(&g, rows, maxVal - minVal);
+}
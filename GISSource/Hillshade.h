@@ -0,0 +1,28 @@
+/*
+ *  Hillshade.h
+ *  GISLook
+ *
+ */
+
+#include <CoreFoundation/CoreFoundation.h>
+
+#ifndef __GISLOOK_HILLSHADE__
+#define __GISLOOK_HILLSHADE__
+
+// direction of the light in degrees, clockwise from north, and above the horizon
+#define HILLSHADE_AZIMUTH 315.
+#define HILLSHADE_ALTITUDE 45.
+
+// the grid spacing is unknown for most formats; the relief is scaled such 
+// that its height is this fraction of the larger dimension of the grid
+#define HILLSHADE_RELIEF 0.1
+
+bool hillshadePreference(void);
+
+unsigned char *hillshadeFloatGrid(const float *grid, long cols, long rows, 
+								  float minVal, float maxVal, float voidValue);
+unsigned char *hillshadeShortGrid(const short *grid, long cols, long rows, 
+								  long minVal, long maxVal, 
+								  const short *voidValues, int nVoidValues);
+
+#endif
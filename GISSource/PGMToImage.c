@@ -9,6 +9,9 @@
 
 #include "PGMToImage.h"
 #include "ReadRaster.h"
+#include "BufferPool.h"
+#include "Stretch.h"
+#include "BoxFilter.h"
 #include "File.h"
 
 inline bool readLong (FILE *fp, long *l)
@@ -79,162 +82,411 @@ bool readPGMSize(FILE *fp, long *width, long *height) {
 
 unsigned char *scaleToByte(unsigned short *shortBuffer, 
 						   long minVal, long maxVal, 
+						   Histogram *histogram,
 						   long width, long height) {
 	
 	
-	unsigned char * grayBuffer = malloc(width * height);
+	unsigned char * grayBuffer = allocBuffer(width * height);
 	if (grayBuffer == NULL) {
 		return NULL;
 	}
-
-	long pixelCounter = 0;
-	long c, r;
+	
 	const long diff = maxVal - minVal;
-	if (diff > 0) {
-		for (r = 0; r < height; r++) {
-			for (c = 0; c < width; c++) {
-				long l = shortBuffer[pixelCounter];
-				l = (l - minVal) * 255 / diff;
-				grayBuffer[pixelCounter++] = (unsigned char)l;
-			}
-		}
+	if (diff <= 0) {
+		memset(grayBuffer, 0, width * height);
+		return grayBuffer;
+	}
+	
+	unsigned char * table = createStretchedShortToGrayTable(histogram, minVal, maxVal);
+	if (table == NULL) {
+		releaseBuffer(grayBuffer);
+		return NULL;
 	}
 	
+	// convert shorts to stretched and graded gray values
+	long i;
+	const long pixelCount = width * height;
+	for (i = 0; i < pixelCount; i++)
+		grayBuffer[i] = table[shortBuffer[i]];
+	
+	releaseBuffer(table);
 	return grayBuffer;
 }
 
+// number of bytes of ASCII files read at once
+#define PGM_BLOCK_SIZE (64 * 1024)
+
+// splits the samples of an ASCII file into tokens
+typedef struct {
+	FILE *fp;
+	unsigned char *block;
+	size_t length;
+	size_t pos;
+} PGMTokenizer;
+
+/* Reads the next block. Returns false at the end of the file. */
+bool fillPGMBlock(PGMTokenizer *tokenizer) {
+	tokenizer->pos = 0;
+	tokenizer->length = fread (tokenizer->block, 1, PGM_BLOCK_SIZE, tokenizer->fp);
+	return tokenizer->length > 0;
+}
+
+/* Skips white space and comments. Returns false at the end of the file. All
+ characters up to the space character are treated as white space. */
+bool skipPGMSpace(PGMTokenizer *tokenizer) {
+	bool comment = FALSE;
+	for (;;) {
+		if (tokenizer->pos == tokenizer->length && !fillPGMBlock(tokenizer))
+			return FALSE;
+		unsigned char c = tokenizer->block[tokenizer->pos];
+		if (comment)
+			comment = (c != '\n' && c != '\r');
+		else if (c == '#')
+			comment = TRUE;
+		else if (c > ' ')
+			return TRUE;
+		tokenizer->pos++;
+	}
+}
+
+/* Skips n tokens without converting them. Returns false if the file ends 
+ before. */
+bool skipPGMTokens(PGMTokenizer *tokenizer, long n) {
+	for (; n > 0; n--) {
+		if (!skipPGMSpace(tokenizer))
+			return FALSE;
+		for (;;) {
+			if (tokenizer->pos == tokenizer->length && !fillPGMBlock(tokenizer))
+				return n == 1;
+			unsigned char c = tokenizer->block[tokenizer->pos];
+			if (c <= ' ' || c == '#')
+				break;
+			tokenizer->pos++;
+		}
+	}
+	return TRUE;
+}
+
+/* Converts the next token to an unsigned integer. Returns false if the file
+ ends or if the token does not start with a digit. */
+bool readPGMToken(PGMTokenizer *tokenizer, long *value) {
+	if (!skipPGMSpace(tokenizer))
+		return FALSE;
+	long v = 0;
+	bool converted = FALSE;
+	for (;;) {
+		if (tokenizer->pos == tokenizer->length && !fillPGMBlock(tokenizer))
+			break;
+		unsigned int digit = tokenizer->block[tokenizer->pos] - '0';
+		if (digit > 9)
+			break;
+		v = v * 10 + digit;
+		converted = TRUE;
+		tokenizer->pos++;
+	}
+	*value = v;
+	return converted;
+}
+
 unsigned char *readPGMASCII(FILE * fp, 
 							long width, long height,
+							long maxSize,
 							QLPreviewRequestRef preview,
 							QLThumbnailRequestRef thumbnail) {
 	
-	long rw = resampledWidth(width, height);
-	long rh = resampledHeight(width, height);
-	int sdist = sampleDist(width, height);
-	unsigned short *shortBuffer = malloc(2 * rw * rh);
-	if (shortBuffer == NULL)
+	long rw = resampledWidth(width, height, maxSize);
+	long rh = resampledHeight(width, height, maxSize);
+	int sdist = sampleDist(width, height, maxSize);
+	PGMTokenizer tokenizer = {fp, allocBuffer(PGM_BLOCK_SIZE), 0, 0};
+	unsigned short *shortBuffer = allocBuffer(2 * rw * rh);
+	long *order = sequentialRowOrder(rh, FALSE);
+	if (tokenizer.block == NULL || shortBuffer == NULL || order == NULL) {
+		releaseBuffer(tokenizer.block);
+		releaseBuffer(shortBuffer);
+		free(order);
 		return NULL;
+	}
 	
 	unsigned long r, c;
 	long l;
+	Histogram *histogram = createHistogram(stretchForFormat(CFSTR("PGMStretch"), linearStretch));
 	long minVal = 2147483647L;
 	long maxVal = -2147483647 - 1; //-2147483648L;
-	long pixelCounter = 0;
-	for (r = 0; r < height; r++) {
+	long nRowsRead = 0;
+	bool read = TRUE;
+	for (r = 0; r < height && read; r++) {
 		
 		// check whether we should cancel
 		if (r % 10 == 0 && isCancelled(preview, thumbnail)) {
-			free (shortBuffer);
-			return NULL;;
+			releaseBuffer(tokenizer.block);
+			releaseBuffer(shortBuffer);
+			releaseHistogram(histogram);
+			free(order);
+			return NULL;
+		}
+		
+		// rows that are not sampled are skipped without converting values
+		if (r % sdist != 0) {
+			read = skipPGMTokens(&tokenizer, width);
+			continue;
 		}
 		
-		for (c = 0; c < width; c++) {
-			if (!readLong(fp, &l))
+		unsigned short *cell = shortBuffer + nRowsRead * rw;
+		for (c = 0; c < width && read; c += sdist) {
+			read = readPGMToken(&tokenizer, &l);
+			if (!read)
 				break;
-			if (r % sdist == 0 && c % sdist == 0) {
-				if (l < minVal)
-					minVal = l;
-				if (l > maxVal)
-					maxVal = l;
-
-#ifdef CHECK_GRID_WRITE
-				if (pixelCounter < 0 || pixelCounter >= rw * rh) {
-					printf("PGM ASCII %ld \n", pixelCounter);
-					free(shortBuffer);
-					return NULL;
-				}
-#endif
-				
-				shortBuffer[pixelCounter++] = (unsigned short)l;
-			}
+			if (l < minVal)
+				minVal = l;
+			if (l > maxVal)
+				maxVal = l;
+			if (histogram)
+				addShortToHistogram(histogram, l);
+			*cell++ = (unsigned short)l;
+			
+			// skip the samples between the sampled columns
+			long skip = (c + sdist < width ? sdist : width - c) - 1;
+			if (skip > 0)
+				read = skipPGMTokens(&tokenizer, skip);
 		}
+		if (c >= width)
+			nRowsRead++;
+	}
+	releaseBuffer(tokenizer.block);
+	
+	// a file that ends early repeats the last complete row
+	if (nRowsRead == 0) {
+		releaseBuffer(shortBuffer);
+		releaseHistogram(histogram);
+		free(order);
+		return NULL;
 	}
+	fillUnreadRows(shortBuffer, rw * sizeof(short), rh, order, nRowsRead);
+	free(order);
 	
 	// scale values to 0..255
-	unsigned char *grayBuffer = scaleToByte(shortBuffer, minVal, maxVal, rw, rh);
+	unsigned char *grayBuffer = scaleToByte(shortBuffer, minVal, maxVal, histogram, rw, rh);
 		
-	free(shortBuffer);
+	releaseBuffer(shortBuffer);
+	releaseHistogram(histogram);
 	return grayBuffer;
 	
 }
 
+/* Reads the single white space character between the maximum value and the
+ samples of a binary file. The first sample may start with a byte that is a
+ white space character. */
+bool readPGMDataSeparator(FILE *fp) {
+	return isspace(getc(fp));
+}
+
 unsigned char *readPGMBinary8Bit(FILE * fp, 
 							long width, long height,
+							long maxSize,
 							QLPreviewRequestRef preview,
 							QLThumbnailRequestRef thumbnail) {
 	
-	if (!overreadWhiteChars(fp))
+	if (!readPGMDataSeparator(fp))
 		return NULL;
 	
-	int sdist = sampleDist(width, height);
+	long rw = resampledWidth(width, height, maxSize);
+	long rh = resampledHeight(width, height, maxSize);
+	int sdist = sampleDist(width, height, maxSize);
+	
+	// read all rows and average them if only short rows would be skipped
+	long dataStart = ftell(fp);
+	BoxFilter box = {0};
+	bool boxFilter = useBoxFilter(sdist, width);
+	if (boxFilter && !initBoxFilter(&box, fp, dataStart, width, height, width,
+									 uint8Sample, FALSE, sdist, NULL))
+		return NULL;
 	
-	if (sdist == 1) {
-		unsigned char *grayBuffer = malloc(width * height);
-		if (grayBuffer == NULL)
+	unsigned char *grayBuffer = allocBuffer(rw * rh);
+	unsigned char *lineBuffer = allocBuffer(width);
+	long *order = boxFilter ? boxFilterRowOrder(&box, rh, FALSE) : rowReadingOrder(rh, width);
+	if (grayBuffer == NULL || lineBuffer == NULL || order == NULL) {
+		releaseBuffer(grayBuffer);
+		releaseBuffer(lineBuffer);
+		free(order);
+		releaseBoxFilter(&box);
+		return NULL;
+	}
+	long c, i;
+	for (i = 0; i < rh; i++) {
+		
+		// check whether we should cancel
+		if (i % 10 == 0 && isCancelled(preview, thumbnail)) {
+			releaseBuffer(grayBuffer);
+			releaseBuffer(lineBuffer);
+			free(order);
+			releaseBoxFilter(&box);
 			return NULL;
-		if (fread (grayBuffer, 1, width * height, fp) != width * height) {
-			free(grayBuffer);
+		}
+		
+		// stop when out of time and use the rows read so far
+		if (i > 0 && isPastDeadline())
+			break;
+		
+		// read one row, or average the rows of a row of boxes
+		long r = order[i] * sdist;
+		bool read;
+		if (boxFilter)
+			read = readBoxFilteredLine(&box, order[i], lineBuffer);
+		else
+			read = fseek (fp, dataStart + r * width, SEEK_SET) == 0
+				&& fread (lineBuffer, 1, width, fp) == width;
+		if (!read) {
+			releaseBuffer(grayBuffer);
+			releaseBuffer(lineBuffer);
+			free(order);
+			releaseBoxFilter(&box);
 			return NULL;
 		}
-		return grayBuffer;
-	} else {
-		long rw = resampledWidth(width, height);
-		long rh = resampledHeight(width, height);
-		unsigned char *grayBuffer = malloc(rw * rh);
-		unsigned char *lineBuffer = malloc(width);
-		long c, r;
-		long cell = 0;
-		for (r = 0; r < height; r+= sdist) {
-			
-			// check whether we should cancel
-			if (r % 10 == 0 && isCancelled(preview, thumbnail)) {
-				free (grayBuffer);
-				free(lineBuffer);
-				return NULL;;
-			}
-			
-			// read one row
-			size_t read = fread (lineBuffer, 1, width, fp);
-			if (read != width) {
-				free(grayBuffer);
-				free(lineBuffer);
-				return NULL;
-			}
-
-#ifdef CHECK_GRID_WRITE
-			if (cell >= rw * rh) {
-				printf("PGM Binary %ld \n", cell);
-				free(grayBuffer);
-				free(lineBuffer);
-				return NULL;
-			}
-#endif
-			// copy samples
-			for (c = 0; c < width; c += sdist) {
-				grayBuffer[cell++] = lineBuffer[c];
-			}
-			
-			// overread lines
-			if (r + sdist < height)
-				fseek ( fp , width * (sdist - 1), SEEK_CUR );			
+		
+		// copy samples
+		long cell = order[i] * rw;
+		for (c = 0; c < width; c += sdist) {
+			grayBuffer[cell++] = lineBuffer[c];
 		}
-		free(lineBuffer);
-		return grayBuffer;
+		
+		// show the rows read so far at the end of a coarse pass
+		if (isCoarseFrameDue(order, rh, i + 1))
+			drawCoarseFrame(copyGridWithUnreadRows(grayBuffer, rw, rh, order, i + 1), rw, rh, FALSE);
 	}
-	return NULL;
+	fillUnreadRows(grayBuffer, rw, rh, order, i);
+	releaseBuffer(lineBuffer);
+	free(order);
+	releaseBoxFilter(&box);
+	return grayBuffer;
 	
 }
 
+/* Copies every sdist-th of n big endian samples to cells in host byte order, 
+ and extends the range and the histogram of the values in the same pass. */
+void gatherPGMSamples(const unsigned short *samples, long n, int sdist,
+					  unsigned short *cells, long *minVal, long *maxVal,
+					  Histogram *histogram) {
+	const unsigned short *end = samples + n;
+	unsigned short lo = *minVal, hi = *maxVal;
+	for (; samples < end; samples += sdist) {
+		unsigned short v = CFSwapInt16BigToHost(*samples);
+		if (v < lo)
+			lo = v;
+		if (v > hi)
+			hi = v;
+		if (histogram)
+			addShortToHistogram(histogram, v);
+		*cells++ = v;
+	}
+	*minVal = lo;
+	*maxVal = hi;
+}
+
 unsigned char *readPGMBinary16Bit(FILE * fp, 
 								 long width, long height,
+								 long maxSize,
 								 QLPreviewRequestRef preview,
 								 QLThumbnailRequestRef thumbnail) {
 
-	return NULL;
+	if (!readPGMDataSeparator(fp))
+		return NULL;
+	
+	long rw = resampledWidth(width, height, maxSize);
+	long rh = resampledHeight(width, height, maxSize);
+	int sdist = sampleDist(width, height, maxSize);
+	
+	// read all rows and average them if only short rows would be skipped.
+	// the averages are stored in big endian order like the other values.
+	long rowBytes = width * 2;
+	long dataStart = ftell(fp);
+	BoxFilter box = {0};
+	bool boxFilter = useBoxFilter(sdist, rowBytes);
+#ifdef __LITTLE_ENDIAN__
+	bool swap = TRUE;
+#else
+	bool swap = FALSE;
+#endif
+	if (boxFilter && !initBoxFilter(&box, fp, dataStart, rowBytes, height, width,
+									 uint16Sample, swap, sdist, NULL))
+		return NULL;
+	
+	// only the samples up to the last sampled column are read from each row
+	long nSamples = (rw - 1) * sdist + 1;
+	unsigned short *shortBuffer = allocBuffer(2 * rw * rh);
+	unsigned short *lineBuffer = allocBuffer(rowBytes);
+	long *order = boxFilter ? boxFilterRowOrder(&box, rh, FALSE) : rowReadingOrder(rh, rowBytes);
+	Histogram *histogram = createHistogram(stretchForFormat(CFSTR("PGMStretch"), linearStretch));
+	if (shortBuffer == NULL || lineBuffer == NULL || order == NULL) {
+		releaseBuffer(shortBuffer);
+		releaseBuffer(lineBuffer);
+		free(order);
+		releaseHistogram(histogram);
+		releaseBoxFilter(&box);
+		return NULL;
+	}
+	long minVal = 65535;
+	long maxVal = 0;
+	long i;
+	for (i = 0; i < rh; i++) {
+		
+		// check whether we should cancel
+		if (i % 10 == 0 && isCancelled(preview, thumbnail)) {
+			releaseBuffer(shortBuffer);
+			releaseBuffer(lineBuffer);
+			free(order);
+			releaseHistogram(histogram);
+			releaseBoxFilter(&box);
+			return NULL;
+		}
+		
+		// stop when out of time and use the rows read so far
+		if (i > 0 && isPastDeadline())
+			break;
+		
+		// read one row, or average the rows of a row of boxes
+		long r = order[i] * sdist;
+		bool read;
+		if (boxFilter)
+			read = readBoxFilteredLine(&box, order[i], lineBuffer);
+		else
+			read = fseek (fp, dataStart + r * rowBytes, SEEK_SET) == 0
+				&& fread (lineBuffer, 2, nSamples, fp) == nSamples;
+		if (!read) {
+			releaseBuffer(shortBuffer);
+			releaseBuffer(lineBuffer);
+			free(order);
+			releaseHistogram(histogram);
+			releaseBoxFilter(&box);
+			return NULL;
+		}
+		
+		gatherPGMSamples(lineBuffer, nSamples, sdist, shortBuffer + order[i] * rw,
+						 &minVal, &maxVal, histogram);
+		
+		// show the rows read so far at the end of a coarse pass
+		if (isCoarseFrameDue(order, rh, i + 1)) {
+			unsigned short *frame = copyGridWithUnreadRows(shortBuffer, rw * sizeof(short), rh, order, i + 1);
+			if (frame) {
+				drawCoarseFrame(scaleToByte(frame, minVal, maxVal, histogram, rw, rh), rw, rh, TRUE);
+				releaseBuffer(frame);
+			}
+		}
+	}
+	fillUnreadRows(shortBuffer, rw * sizeof(short), rh, order, i);
+	releaseBuffer(lineBuffer);
+	free(order);
+	releaseBoxFilter(&box);
+	
+	// scale values to 0..255
+	unsigned char *grayBuffer = scaleToByte(shortBuffer, minVal, maxVal, histogram, rw, rh);
+	releaseBuffer(shortBuffer);
+	releaseHistogram(histogram);
+	return grayBuffer;
 
 }
 
 CGImageRef readPGMImage(FILE * fp, 
+						long maxSize,
 						QLPreviewRequestRef preview,
 						QLThumbnailRequestRef thumbnail) {
 	
@@ -265,16 +517,19 @@ CGImageRef readPGMImage(FILE * fp,
 	// read the grid
 	unsigned char *grayBuffer = NULL;
 	if (isASCII) {
-		grayBuffer = readPGMASCII(fp, width, height, preview, thumbnail);
+		grayBuffer = readPGMASCII(fp, width, height, maxSize, preview, thumbnail);
 	} else if (max < 256) {
-		grayBuffer = readPGMBinary8Bit(fp, width, height, preview, thumbnail);
+		grayBuffer = readPGMBinary8Bit(fp, width, height, maxSize, preview, thumbnail);
 	} else {
-		grayBuffer = readPGMBinary16Bit(fp, width, height, preview, thumbnail);
+		grayBuffer = readPGMBinary16Bit(fp, width, height, maxSize, preview, thumbnail);
 	}
 	
-	// convert to grayscale
-	long rw = resampledWidth(width, height);
-	long rh = resampledHeight(width, height);
+	// convert to grayscale. Grids with more than 8 bits are converted to 
+	// graded gray values with a table.
+	long rw = resampledWidth(width, height, maxSize);
+	long rh = resampledHeight(width, height, maxSize);
+	if (isASCII || max >= 256)
+		return createGradedGrayScaleImage(grayBuffer, rw, rh);
 	return createGrayScaleImage(grayBuffer, rw, rh);
 	
 }
\ No newline at end of file
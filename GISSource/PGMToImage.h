@@ -17,6 +17,7 @@
 
 bool readPGMSize(FILE *fp, long *width, long *height);
 CGImageRef readPGMImage(FILE * fp,
+						long maxSize,
 						QLPreviewRequestRef preview,
 						QLThumbnailRequestRef thumbnail);
 
@@ -0,0 +1,20 @@
+/*
+ *  Parallel.c
+ *  GISLook
+ *
+ */
+
+#include "Parallel.h"
+#include <unistd.h>
+
+/* Returns the number of worker threads a reader should start. This is the 
+ number of available processors, between 1 and MAX_WORKER_THREADS. 
+ */
+int workerThreadCount(void) {
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n < 1)
+		return 1;
+	if (n > MAX_WORKER_THREADS)
+		return MAX_WORKER_THREADS;
+	return (int)n;
+}
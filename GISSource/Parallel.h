@@ -0,0 +1,18 @@
+/*
+ *  Parallel.h
+ *  GISLook
+ *
+ */
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <pthread.h>
+
+#ifndef __GISLOOK_PARALLEL__
+#define __GISLOOK_PARALLEL__
+
+// upper limit for the number of worker threads used by a single reader
+#define MAX_WORKER_THREADS 8
+
+int workerThreadCount(void);
+
+#endif
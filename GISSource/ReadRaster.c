@@ -8,35 +8,47 @@
  */
 
 #include "ReadRaster.h"
-//#include "ArcInfoGridToImage.h"
+#include "ArcInfoGridToImage.h"
 #include "BILToImage.h"
 #include "E00GridToImage.h"
 #include "ESRIASCIIGridToImage.h"
 #include "ESRIBinaryGridToImage.h"
+#include "GeoTIFFToImage.h"
 #include "PGMToImage.h"
 #include "SRTMToImage.h"
 #include "SurferGridToImage.h"
 #include "USGSDEMToImage.h"
 #include "File.h"
+#include "Cache.h"
+#include "BufferPool.h"
+#include "Color.h"
+#include "Stretch.h"
+#include "Hillshade.h"
+#include <pthread.h>
+#include <string.h>
 
-const double  MAX_GRID_SIZE = 2000; // must be double
-
-int sampleDist (long width, long height) {
-	if (width > MAX_GRID_SIZE || height > MAX_GRID_SIZE) {
-		int h = ceil(width / MAX_GRID_SIZE);
-		int v = ceil(height / MAX_GRID_SIZE);
+/* Returns the distance between samples taken from a grid, such that the 
+ sampled grid is not larger than maxSize in either dimension. maxSize is the
+ size of the requested preview or thumbnail; MAX_GRID_SIZE is used if it is
+ not positive. */
+int sampleDist (long width, long height, long maxSize) {
+	if (maxSize < 1)
+		maxSize = MAX_GRID_SIZE;
+	if (width > maxSize || height > maxSize) {
+		int h = ceil(width / (double)maxSize);
+		int v = ceil(height / (double)maxSize);
 		return h > v ? h : v;
 	} else
 		return 1;
 }
 
-long resampledWidth(long width, long height) {
-	long sdist = sampleDist(width, height);
+long resampledWidth(long width, long height, long maxSize) {
+	long sdist = sampleDist(width, height, maxSize);
 	return width / sdist + (width % sdist > 0);
 }
 
-long resampledHeight(long width, long height) {
-	long sdist = sampleDist(width, height);
+long resampledHeight(long width, long height, long maxSize) {
+	long sdist = sampleDist(width, height, maxSize);
 	return height / sdist + (height % sdist > 0);
 }
 
@@ -80,15 +92,211 @@ bool isCancelled(QLPreviewRequestRef preview,
 	return FALSE;
 }
 
+/* The deadline of the request that is read on the current thread. QuickLook can
+ generate several previews and thumbnails concurrently, so the deadline is 
+ stored per thread. */
+static pthread_key_t deadlineKey;
+static pthread_once_t deadlineKeyOnce = PTHREAD_ONCE_INIT;
+
+void createDeadlineKey(void) {
+	pthread_key_create(&deadlineKey, NULL);
+}
+
+void setDeadline(CFAbsoluteTime *deadline) {
+	pthread_once(&deadlineKeyOnce, createDeadlineKey);
+	pthread_setspecific(deadlineKey, deadline);
+}
+
+/* Returns the deadline of the current thread, so that worker threads of a 
+ reader can adopt it with setDeadline(). */
+CFAbsoluteTime *getDeadline(void) {
+	pthread_once(&deadlineKeyOnce, createDeadlineKey);
+	return pthread_getspecific(deadlineKey);
+}
+
+/* Returns true if readers should stop reading and return what they have read 
+ so far. */
+bool isPastDeadline(void) {
+	pthread_once(&deadlineKeyOnce, createDeadlineKey);
+	CFAbsoluteTime *deadline = pthread_getspecific(deadlineKey);
+	return deadline != NULL && CFAbsoluteTimeGetCurrent() > *deadline;
+}
+
+/* Returns the order in which the rows of a sampled grid are read. rowBytes is
+ the number of bytes read from the file for each row. With a deadline and at
+ least COARSE_TO_FINE_MIN_BYTES to read, the rows are read in three passes: 
+ every 16th row, then the remaining rows of every 4th row, then all other 
+ rows. Rows read in a pass are kept by the following passes, and a reader that
+ stops early has a coarse version of the entire grid. Otherwise the rows are
+ read from top to bottom. The returned array must be released with free(). */
+long *rowReadingOrder(long rows, size_t rowBytes) {
+	pthread_once(&deadlineKeyOnce, createDeadlineKey);
+	if (pthread_getspecific(deadlineKey) == NULL || rows * rowBytes < COARSE_TO_FINE_MIN_BYTES)
+		return sequentialRowOrder(rows, FALSE);
+	long *order = malloc(rows * sizeof(long));
+	if (order == NULL)
+		return NULL;
+	long i = 0, row;
+	for (row = 0; row < rows; row += 16)
+		order[i++] = row;
+	for (row = 4; row < rows; row += 4) {
+		if (row % 16 != 0)
+			order[i++] = row;
+	}
+	for (row = 1; row < rows; row++) {
+		if (row % 4 != 0)
+			order[i++] = row;
+	}
+	return order;
+}
+
+/* Returns the rows from top to bottom, or from bottom to top, for readers that
+ read a file sequentially. The returned array must be released with free(). */
+long *sequentialRowOrder(long rows, bool bottomUp) {
+	long *order = malloc(rows * sizeof(long));
+	if (order == NULL)
+		return NULL;
+	long i;
+	for (i = 0; i < rows; i++)
+		order[i] = bottomUp ? rows - 1 - i : i;
+	return order;
+}
+
+/* Replaces each row that has not been read by the closest read row above it.
+ order and nRead are the reading order and the number of rows read. */
+void fillUnreadRows(void *grid, size_t rowBytes, long rows, const long *order, long nRead) {
+	if (nRead >= rows || nRead <= 0)
+		return;
+	bool *rowRead = calloc(rows, sizeof(bool));
+	if (rowRead == NULL)
+		return;
+	long i, lastRead = order[0];
+	for (i = 0; i < nRead; i++)
+		rowRead[order[i]] = TRUE;
+	for (i = 0; i < rows; i++) {
+		if (rowRead[i])
+			lastRead = i;
+		else
+			memcpy((char *)grid + i * rowBytes, (char *)grid + lastRead * rowBytes, rowBytes);
+	}
+	free(rowRead);
+}
+
+/* Colors the gray image of a grid with the color ramp chosen by the user. The
+ colors are applied with the color table of an indexed color space, so that 
+ the pixels are neither copied nor converted. The gray image is released. 
+ PGM files are images and are not colored. Hillshades are not colored either,
+ as the ramp would color the shading instead of the elevation. */
+CGImageRef colorGrid(CGImageRef grayImage, CFStringRef contentTypeUTI) {
+	
+	if (grayImage == NULL || UTTypeConformsTo(contentTypeUTI, CFSTR("net.sourceforge.netpbm.pgm")))
+		return grayImage;
+	if (hillshadePreference())
+		return grayImage;
+	ColorRampType type = colorRampPreference();
+	if (type == grayRamp)
+		return grayImage;
+	
+	ColorRamp ramp;
+	initColorRamp(&ramp, type);
+	CGImageRef image = createIndexedImage(CGImageGetDataProvider(grayImage), 
+										  CGImageGetWidth(grayImage),
+										  CGImageGetHeight(grayImage),
+										  &ramp);
+	if (image == NULL)
+		return grayImage;
+	CGImageRelease(grayImage);
+	return image;
+	
+}
+
+/* The preview that shows coarse frames of the grid read on the current 
+ thread. Stored per thread like the deadline. */
+static pthread_key_t coarseFramesKey;
+static pthread_once_t coarseFramesKeyOnce = PTHREAD_ONCE_INIT;
+
+void createCoarseFramesKey(void) {
+	pthread_key_create(&coarseFramesKey, NULL);
+}
+
+/* Sets the preview that readers draw coarse frames into while they read the
+ passes of rowReadingOrder(). frames may be NULL for thumbnails, which are not
+ shown before they are complete. */
+void setCoarseFrames(CoarseFrames *frames) {
+	pthread_once(&coarseFramesKeyOnce, createCoarseFramesKey);
+	pthread_setspecific(coarseFramesKey, frames);
+}
+
+/* Returns true if a reader has just completed a coarse pass after reading 
+ nRead rows in the order of rowReadingOrder() or boxFilterRowOrder(), and 
+ should draw a frame. A pass ends where the next row is above the last row 
+ read. */
+bool isCoarseFrameDue(const long *order, long rows, long nRead) {
+	pthread_once(&coarseFramesKeyOnce, createCoarseFramesKey);
+	if (pthread_getspecific(coarseFramesKey) == NULL)
+		return FALSE;
+	return nRead > 0 && nRead < rows && order[nRead] < order[nRead - 1];
+}
+
+/* Returns a copy of a grid of which nRead rows have been read, with the rows
+ that have not been read filled as by fillUnreadRows(). The copy must be 
+ released with releaseBuffer(). */
+void *copyGridWithUnreadRows(const void *grid, size_t rowBytes, long rows, const long *order, long nRead) {
+	void *copy = allocBuffer(rowBytes * rows);
+	if (copy == NULL)
+		return NULL;
+	memcpy(copy, grid, rowBytes * rows);
+	fillUnreadRows(copy, rowBytes, rows, order, nRead);
+	return copy;
+}
+
+/* Draws a coarse frame of a grid into the preview of the current thread and 
+ flushes it, so that the grid is shown while finer passes are read. The frame
+ is colored like the final image. grayPixels are released; graded tells 
+ whether the gradation curve has already been applied to them. */
+void drawCoarseFrame(unsigned char *grayPixels, size_t width, size_t height, bool graded) {
+	pthread_once(&coarseFramesKeyOnce, createCoarseFramesKey);
+	CoarseFrames *frames = pthread_getspecific(coarseFramesKey);
+	if (frames == NULL || grayPixels == NULL) {
+		releaseBuffer(grayPixels);
+		return;
+	}
+	CGImageRef image = graded ? createGradedGrayScaleImage(grayPixels, width, height)
+							  : createGrayScaleImage(grayPixels, width, height);
+	image = colorGrid(image, frames->contentTypeUTI);
+	if (image == NULL)
+		return;
+	CGSize size = CGSizeMake(width, height);
+	if (frames->context == NULL) {
+		frames->context = QLPreviewRequestCreateContext(frames->preview, size, false, NULL);
+		frames->size = size;
+	}
+	if (frames->context && CGSizeEqualToSize(frames->size, size)) {
+		CGContextDrawImage(frames->context, CGRectMake(0.f, 0.f, size.width, size.height), image);
+		QLPreviewRequestFlushContext(frames->preview, frames->context);
+	}
+	CGImageRelease(image);
+}
+
 CGImageRef readRaster(QLPreviewRequestRef preview,
 					  QLThumbnailRequestRef thumbnail,
 					  CFURLRef url, 
-					  CFStringRef contentTypeUTI) {
+					  CFStringRef contentTypeUTI,
+					  long maxSize,
+					  CFAbsoluteTime deadline) {
 	
 	FILE *fp = openFile(url);
 	if (fp == NULL) {
 		return NULL;
 	}
+	
+	// only GeoTIFF grids are read from TIFF files. Photos, scans and other 
+	// TIFF images are quickly left to the system preview.
+	bool isTIFF = UTTypeConformsTo(contentTypeUTI, kUTTypeTIFF);
+	if (isTIFF && !isGeoTIFFGrid(fp)) {
+		fclose(fp);
+		return NULL;
+	}
 	/*
 	CFStringRef ESRI_ARCIINFO_GRID_UTI = CFSTR("com.esri.arcinfogrid");
 	CFStringRef ESRI_ASCII_GRID_UTI = CFSTR("com.esri.asciigrid");
@@ -107,39 +315,72 @@ CGImageRef readRaster(QLPreviewRequestRef preview,
         return NULL;
 	}
 	
+	// an image of an unchanged file may have been read before
+	CacheType cacheType = thumbnail ? thumbnailCache : previewCache;
+	char cacheTag[256];
+	snprintf(cacheTag, sizeof(cacheTag), "image %ld", maxSize);
+	appendStretchCacheTag(cacheTag, sizeof(cacheTag));
+	if (hillshadePreference())
+		strncat(cacheTag, " hillshade", sizeof(cacheTag) - strlen(cacheTag) - 1);
+	appendSRTMMosaicCacheTag(path, cacheTag, sizeof(cacheTag));
+	image = readCachedImage(cacheType, path, cacheTag);
+	if (image) {
+		fclose(fp);
+		return colorGrid(image, contentTypeUTI);
+	}
+	
+	// a deadline of 0 means that there is no time limit
+	setDeadline(deadline > 0 ? &deadline : NULL);
+	
+	// TIFF files are read as GeoTIFF grids before other formats are tried
+	if (isTIFF) {
+		fseek (fp, 0 , SEEK_SET);
+		image = readGeoTIFFImage(fp, maxSize, preview, thumbnail);
+	}
+	
 	// only read PGM files with a pgm extension
 	if (UTTypeConformsTo (contentTypeUTI, PGM_UTI)) {
-		image = readPGMImage(fp, preview, thumbnail);
+		image = readPGMImage(fp, maxSize, preview, thumbnail);
 	}
 	
+	// ArcInfo grids are identified by the hdr.adf file in the folder
+	if (!image)
+		image = readArcInfoGridImage(path, maxSize, preview, thumbnail);
+	
 	// try the unequivocal binary formats first 
 	if (!image) {
 		fseek (fp, 0 , SEEK_SET);
-		image = readSRTMImage(fp, path, preview, thumbnail);
+		image = readSRTMImage(fp, path, maxSize, preview, thumbnail);
 	}
 	
 	// surfer grids are quickly identified by the first 4 bytes
 	if (!image) {
 		fseek (fp, 0 , SEEK_SET);
-		image = readSurferGridImage(fp, preview, thumbnail);
+		image = readSurferGridImage(fp, maxSize, preview, thumbnail);
+	}
+	
+	// GeoTIFF grids are identified by the TIFF header and the GeoTIFF tags
+	if (!image && !isTIFF) {
+		fseek (fp, 0 , SEEK_SET);
+		image = readGeoTIFFImage(fp, maxSize, preview, thumbnail);
 	}
 	
 	// read ascii formats
 	if (!image) {
 		fseek (fp, 0 , SEEK_SET);
-		image = readESRIASCIIGridImage(fp, preview, thumbnail);
+		image = readESRIASCIIGridImage(fp, maxSize, preview, thumbnail);
 	}
 	
 	// e00 is ascii
 	if (!image) {
 		fseek (fp, 0 , SEEK_SET);
-		image = readE00GridToImage(fp, path, preview, thumbnail);
+		image = readE00GridToImage(fp, path, maxSize, preview, thumbnail);
 	}
 	
 	// USGS DEM is also ascii
 	if (!image) {
 		fseek (fp, 0 , SEEK_SET);
-		image = readUSGSDEMImage(fp, preview, thumbnail);
+		image = readUSGSDEMImage(fp, maxSize, preview, thumbnail);
 	}
 
 	// read formats with external header files after all other formats to 
@@ -147,12 +388,12 @@ CGImageRef readRaster(QLPreviewRequestRef preview,
 	// as a ESRI binary grid.
 	if (!image) {
 		fseek (fp, 0 , SEEK_SET);
-		image = readESRIBinaryGridImage(fp, path, preview, thumbnail);
+		image = readESRIBinaryGridImage(fp, path, maxSize, preview, thumbnail);
 	}
 	
 	if (!image) {
 		fseek (fp, 0 , SEEK_SET);
-		image = readBILImage(fp, path, preview, thumbnail);
+		image = readBILImage(fp, path, maxSize, preview, thumbnail);
 	}
 	
 	/*
@@ -160,37 +401,42 @@ CGImageRef readRaster(QLPreviewRequestRef preview,
 	
 	 } else if (UTTypeConformsTo (contentTypeUTI, ESRI_ASCII_GRID_UTI)) {
 		
-		image = readESRIASCIIGridImage(fp, preview, thumbnail);
+		image = readESRIASCIIGridImage(fp, maxSize, preview, thumbnail);
 		
 		
 	} else if (UTTypeConformsTo (contentTypeUTI, ESRI_BINARY_GRID_UTI)) {
 		
 		char path[1024];
 		if (urlToPath(url, path, 1024))
-			image = readESRIBinaryGridImage(fp, path, preview, thumbnail);
+			image = readESRIBinaryGridImage(fp, path, maxSize, preview, thumbnail);
 		
 	} else if (UTTypeConformsTo (contentTypeUTI, PGM_UTI)) {
 		
-		image = readPGMImage(fp, preview, thumbnail);
+		image = readPGMImage(fp, maxSize, preview, thumbnail);
 		
 	} else if (UTTypeConformsTo (contentTypeUTI, SRTM_UTI)) {
 		
 		char path[1024];
 		if (urlToPath(url, path, 1024))
-			image = readSRTMImage(fp, path, preview, thumbnail);
+			image = readSRTMImage(fp, path, maxSize, preview, thumbnail);
 		
 	} else if (UTTypeConformsTo (contentTypeUTI, SURFER_UTI)) {
 		
-		image = readSurferGridImage(fp, preview, thumbnail);
+		image = readSurferGridImage(fp, maxSize, preview, thumbnail);
 		
 	} else if (UTTypeConformsTo (contentTypeUTI, DEM_UTI)) {
 		
-		image = readUSGSDEMImage(fp, preview, thumbnail);
+		image = readUSGSDEMImage(fp, maxSize, preview, thumbnail);
 		
 	}*/
 	
 	fclose(fp);
-	return image;
+	setDeadline(NULL);
+	
+	// only cache complete images, readers may have stopped at the deadline
+	if (image && (deadline <= 0 || CFAbsoluteTimeGetCurrent() <= deadline))
+		cacheImage(cacheType, path, cacheTag, image);
+	return colorGrid(image, contentTypeUTI);
 	
 }
 
@@ -198,10 +444,41 @@ void ProviderReleaseData (void *info,
 						  const void *data, 
 						  size_t size ) {
 	unsigned char *grayBuffer = info;
-	free(grayBuffer);
+	releaseBuffer(grayBuffer);
 }
 
+/* Fills lut with a square-root shaped gradation curve that brightens dark 
+ values. */
+void initGradationTable(unsigned char lut[256]) {
+	int i;
+	for (i = 0; i < 256; i++) {
+		lut[i] = sqrt(i / 255.) * 255;
+	}
+}
+
+/* Returns a table that converts 16 bit values between minVal and maxVal to gray 
+ values in a single lookup. The table combines the linear stretch from minVal 
+ and maxVal to 0..255 with the gradation curve, and replaces a division and a 
+ second pass over the pixels. The table has 65536 entries and is indexed with
+ the value cast to an unsigned short. Only entries for values between minVal 
+ and maxVal are initialized; entries for void values have to be set by the 
+ caller. The table must be released with releaseBuffer(). */
+unsigned char *createShortToGrayTable(long minVal, long maxVal) {
+	unsigned char *table = allocBuffer(65536);
+	if (table == NULL)
+		return NULL;
+	unsigned char lut [256];
+	initGradationTable(lut);
+	long diff = maxVal - minVal;
+	long v;
+	for (v = minVal; v <= maxVal && v - minVal < 65536; v++)
+		table[(unsigned short)v] = diff > 0 ? lut[(v - minVal) * 255 / diff] : 0;
+	return table;
+}
 
+/* Creates an 8 bit gray scale image from grayPixels. grayPixels must be 
+ allocated with allocBuffer() and is returned to the buffer pool when the 
+ image is released. */
 CGImageRef createGrayScaleImage(unsigned char * grayPixels, 
 								size_t width, 
 								size_t height) {
@@ -211,20 +488,38 @@ CGImageRef createGrayScaleImage(unsigned char * grayPixels,
 	
 	// brighten dark values with a square-root shaped gradation curve
 	unsigned char lut [256];
+	initGradationTable(lut);
 	int i;
-	for (i = 0; i < 256; i++) {
-		lut[i] = sqrt(i / 255.) * 255;
-	}
 	int pixelCount = width * height;
 	for (i = 0; i < pixelCount; i++) {
 		grayPixels[i] = lut[grayPixels[i]];
 	}
 	
+	return createGradedGrayScaleImage(grayPixels, width, height);
+}
+
+/* Same as createGrayScaleImage(), but for pixels that the gradation curve has 
+ already been applied to, e.g. with a table from createShortToGrayTable(). */
+CGImageRef createGradedGrayScaleImage(unsigned char * grayPixels, 
+									  size_t width, 
+									  size_t height) {
+	
+	if (grayPixels == NULL || width <= 0 || height <= 0)
+		return NULL;
+	
 	CGDataProviderRef prov = CGDataProviderCreateWithData (grayPixels, grayPixels, 
 														   width * height, 
 														   ProviderReleaseData);
 	if (prov == NULL)
 		return NULL;
+	return createImageWithGrayScaleProvider(prov, width, height);
+}
+
+/* Creates an 8 bit gray scale image with width * height pixels from a data 
+ provider. The provider is released. */
+CGImageRef createImageWithGrayScaleProvider(CGDataProviderRef prov, 
+											size_t width, 
+											size_t height) {
 	CGColorSpaceRef colorSpace = CGColorSpaceCreateDeviceGray();
 	if (colorSpace == NULL) {
 		CGDataProviderRelease (prov);
@@ -238,5 +533,27 @@ CGImageRef createGrayScaleImage(unsigned char * grayPixels,
 	CGDataProviderRelease (prov);
 	CGColorSpaceRelease (colorSpace);
 	
+	return image;
+}
+
+/* Creates an 8 bit image with width * height pixels from a data provider. The
+ pixels are indices into the colors of the ramp. The provider is retained. */
+CGImageRef createIndexedImage(CGDataProviderRef prov, 
+							  size_t width, 
+							  size_t height,
+							  const ColorRamp *ramp) {
+	CGColorSpaceRef rgbSpace = CGColorSpaceCreateDeviceRGB();
+	if (rgbSpace == NULL)
+		return NULL;
+	CGColorSpaceRef colorSpace = CGColorSpaceCreateIndexed(rgbSpace, 255, ramp->rgb);
+	CGColorSpaceRelease (rgbSpace);
+	if (colorSpace == NULL)
+		return NULL;
+	CGImageRef image = CGImageCreate (width, height, 8, 8, 
+									  width, colorSpace, 
+									  kCGImageAlphaNone,
+									  prov, NULL, 0,
+									  kCGRenderingIntentDefault);
+	CGColorSpaceRelease (colorSpace);
 	return image;
 }
\ No newline at end of file
@@ -15,26 +15,75 @@
 #include <CoreFoundation/CoreFoundation.h>
 #include <CoreServices/CoreServices.h>
 #include <QuickLook/QuickLook.h>
+#include "Color.h"
 
-int sampleDist (long width, long height);
-long resampledWidth(long width, long height);
-long resampledHeight(long width, long height);
+// default maximum size of a grid read for a preview
+#define MAX_GRID_SIZE 2000
+
+int sampleDist (long width, long height, long maxSize);
+long resampledWidth(long width, long height, long maxSize);
+long resampledHeight(long width, long height, long maxSize);
 
 short swapShort (short s);
 void swapLong (long *b);
 void swapFloat (float *b);
 void swapDouble (double *b);
 
+// Time in seconds after which readers stop and return a coarser grid
+#define PREVIEW_TIME_LIMIT 3.
+#define THUMBNAIL_TIME_LIMIT 1.
+
+// Grids with less data in the sampled rows are read from top to bottom, even
+// with a deadline, as they are read in time and sequential reading is faster
+#define COARSE_TO_FINE_MIN_BYTES (16 * 1024 * 1024)
+
 bool isCancelled(QLPreviewRequestRef preview,
 				 QLThumbnailRequestRef thumbnail);
 
+void setDeadline(CFAbsoluteTime *deadline);
+CFAbsoluteTime *getDeadline(void);
+bool isPastDeadline(void);
+long *rowReadingOrder(long rows, size_t rowBytes);
+long *sequentialRowOrder(long rows, bool bottomUp);
+void fillUnreadRows(void *grid, size_t rowBytes, long rows, const long *order, long nRead);
+
+// A preview that shows coarse frames of a grid while the grid is read
+typedef struct {
+	QLPreviewRequestRef preview;
+	CFStringRef contentTypeUTI;
+	CGContextRef context;	// created for the first frame, NULL before
+	CGSize size;
+} CoarseFrames;
+
+void setCoarseFrames(CoarseFrames *frames);
+bool isCoarseFrameDue(const long *order, long rows, long nRead);
+void *copyGridWithUnreadRows(const void *grid, size_t rowBytes, long rows, const long *order, long nRead);
+void drawCoarseFrame(unsigned char *grayPixels, size_t width, size_t height, bool graded);
+
 CGImageRef readRaster(QLPreviewRequestRef preview,
 					  QLThumbnailRequestRef thumbnail,
 					  CFURLRef url, 
-					  CFStringRef contentTypeUTI);
+					  CFStringRef contentTypeUTI,
+					  long maxSize,
+					  CFAbsoluteTime deadline);
+
+unsigned char *createShortToGrayTable(long minVal, long maxVal);
 
 CGImageRef createGrayScaleImage(unsigned char * grayPixels, 
 								size_t width, 
 								size_t heigth);
 
+CGImageRef createGradedGrayScaleImage(unsigned char * grayPixels, 
+									  size_t width, 
+									  size_t height);
+
+CGImageRef createImageWithGrayScaleProvider(CGDataProviderRef prov, 
+											size_t width, 
+											size_t height);
+
+CGImageRef createIndexedImage(CGDataProviderRef prov, 
+							  size_t width, 
+							  size_t height,
+							  const ColorRamp *ramp);
+
 #endif
\ No newline at end of file
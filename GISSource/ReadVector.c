@@ -135,6 +135,30 @@ void drawCircle(CGContextRef cgContext, double x, double y, double r) {
 		CGContextFillEllipseInRect (cgContext, CGRectMake(x, y, d, d));
 }
 
+/* Fills a circle around each point. All circles are added to a single path 
+ that is filled once, instead of filling each circle separately. Circles have 
+ the same color, so overlapping circles look identical with either approach. 
+ */
+void fillCircles(CGContextRef cgContext, const double *xy, long nPoints, double r) {
+	
+	// a circle is approximated by four Bézier curves
+	const long verticesPerCircle = 5;
+	
+	double d = 2. * r;
+	PathBatch batch;
+	beginPathBatch(&batch, cgContext, kCGPathFill);
+	long i;
+	for (i = 0; i < nPoints; i++) {
+		double x = xy[i * 2] - r;
+		double y = xy[i * 2 + 1] - r;
+		if (!isValidQuartzCoord(x) || !isValidQuartzCoord(y))
+			continue;
+		CGContextAddEllipseInRect(cgContext, CGRectMake(x, y, d, d));
+		addToPathBatch(&batch, verticesPerCircle);
+	}
+	flushPathBatch(&batch);
+}
+
 double circleRadius(int nCircles, double scale) {
 	double r = CIRCLE_RAD_1;
 	if (nCircles > CIRCLE_LIMIT_1)
@@ -146,3 +170,55 @@ double circleRadius(int nCircles, double scale) {
 	r /= scale;
 	return r;
 }
+
+void beginPathBatch(PathBatch *batch, CGContextRef cgContext, CGPathDrawingMode mode) {
+	batch->cgContext = cgContext;
+	batch->mode = mode;
+	batch->vertices = 0;
+	CGContextBeginPath(cgContext);
+}
+
+// Call after adding the geometry of a feature to the current path. Draws the
+// path if the batch is full and returns true in this case.
+bool addToPathBatch(PathBatch *batch, long nVertices) {
+	batch->vertices += nVertices;
+	if (batch->vertices <= MAX_PATH_VERTICES)
+		return FALSE;
+	flushPathBatch(batch);
+	return TRUE;
+}
+
+// draws the accumulated path and starts a new one
+void flushPathBatch(PathBatch *batch) {
+	if (batch->vertices > 0)
+		CGContextDrawPath(batch->cgContext, batch->mode);
+	CGContextBeginPath(batch->cgContext);
+	batch->vertices = 0;
+}
+
+void initPointBuffer(PointBuffer *buffer) {
+	buffer->xy = NULL;
+	buffer->count = 0;
+	buffer->capacity = 0;
+}
+
+// appends a point. Returns false if not enough memory is available.
+bool appendPoint(PointBuffer *buffer, double x, double y) {
+	if (buffer->count == buffer->capacity) {
+		long capacity = buffer->capacity < 256 ? 256 : buffer->capacity * 2;
+		double *xy = realloc(buffer->xy, sizeof(double) * 2 * capacity);
+		if (xy == NULL)
+			return FALSE;
+		buffer->xy = xy;
+		buffer->capacity = capacity;
+	}
+	buffer->xy[buffer->count * 2] = x;
+	buffer->xy[buffer->count * 2 + 1] = y;
+	buffer->count++;
+	return TRUE;
+}
+
+void freePointBuffer(PointBuffer *buffer) {
+	free(buffer->xy);
+	initPointBuffer(buffer);
+}
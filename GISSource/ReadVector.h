@@ -16,6 +16,29 @@
 
 #define LINE_WIDTH 1.
 
+// maximum number of vertices accumulated in a single path before it is drawn
+#define MAX_PATH_VERTICES 10000
+
+/* Accumulates the geometry of many features in the current path of a context.
+ The path is drawn when more than MAX_PATH_VERTICES vertices have been added,
+ so the cost of setting up a stroke or fill is paid once per batch instead of
+ once per feature. All features of a batch share the same color.
+ */
+typedef struct {
+	CGContextRef cgContext;
+	CGPathDrawingMode mode;
+	long vertices;
+} PathBatch;
+
+// Growable array of x/y coordinate pairs. The capacity grows geometrically,
+// so appending n points costs O(n). Coordinates are doubles, as floats are too
+// coarse for large projected coordinates.
+typedef struct {
+	double *xy;
+	long count;
+	long capacity;
+} PointBuffer;
+
 bool isVector (CFStringRef contentTypeUTI);
 
 void setColorForPolygons(CGContextRef cgContext, double scale);
@@ -28,8 +51,18 @@ bool readVector(QLPreviewRequestRef preview,
 
 void drawCircle(CGContextRef cgContext, double x, double y, double r);
 
+void fillCircles(CGContextRef cgContext, const double *xy, long nPoints, double r);
+
 double circleRadius(int nCircles, double scale);
 
 bool inline isValidQuartzCoord(double c);
 
+void beginPathBatch(PathBatch *batch, CGContextRef cgContext, CGPathDrawingMode mode);
+bool addToPathBatch(PathBatch *batch, long nVertices);
+void flushPathBatch(PathBatch *batch);
+
+void initPointBuffer(PointBuffer *buffer);
+bool appendPoint(PointBuffer *buffer, double x, double y);
+void freePointBuffer(PointBuffer *buffer);
+
 #endif
\ No newline at end of file
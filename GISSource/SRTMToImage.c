@@ -35,6 +35,18 @@
 
 #include "SRTMToImage.h"
 #include "ReadRaster.h"
+#include "BufferPool.h"
+#include "Stretch.h"
+#include "Hillshade.h"
+#include "BoxFilter.h"
+#include "Parallel.h"
+#include "File.h"
+#include <ctype.h>
+#include <dirent.h>
+#include <math.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #define	SRTM30WIDTH			(40 * 60 * 2)
 #define	SRTM30HEIGHT		(50 * 60 * 2)
@@ -49,17 +61,22 @@
 // this is safe, since SRTM grids will not contain values of -9999
 #define SRTM_ALTERNATIVE_NODATAVALUE	-9999
 
+// tiles are combined to mosaics of this many by this many degrees
+#define SRTM_MOSAIC_BLOCK	10
+
 bool isValidSRTMValue(short s) {
 	return s != SRTM_NODATAVALUE && s != SRTM_ALTERNATIVE_NODATAVALUE;
 }
 
-unsigned char *scaleSRTMToByte(short *shortBuffer, long gridSize, 
+unsigned char *scaleSRTMToByte(short *shortBuffer, long gridSize, long cols,
 							   QLPreviewRequestRef preview,
 							   QLThumbnailRequestRef thumbnail) {
 	
 	long i;
 	
-	// find min and max values
+	// find min and max values and count values for the stretch
+	bool hillshade = hillshadePreference();
+	Histogram *histogram = hillshade ? NULL : createHistogram(stretchForFormat(CFSTR("SRTMStretch"), percentileStretch));
 	short minVal = 32767;
 	short maxVal = -32768;
 	short s;
@@ -81,29 +98,44 @@ unsigned char *scaleSRTMToByte(short *shortBuffer, long gridSize,
 			maxVal = s;
 		if (s < minVal)
 			minVal = s;
+		if (histogram)
+			addShortToHistogram(histogram, s);
 	}
 	
 	// check whether we should abort
-	if (isCancelled(preview, thumbnail))
+	if (isCancelled(preview, thumbnail)) {
+		releaseHistogram(histogram);
 		return NULL;
+	}
+	
+	if (hillshade) {
+		const short voidValues[] = {SRTM_NODATAVALUE, SRTM_ALTERNATIVE_NODATAVALUE};
+		return hillshadeShortGrid(shortBuffer, cols, gridSize / cols, minVal, maxVal, voidValues, 2);
+	}
 	
 	long diff = maxVal - minVal;
-	if (diff <= 0)
-		return calloc(gridSize, 1); // return an empty gray buffer
+	if (diff <= 0) {
+		releaseHistogram(histogram);
+		return allocZeroedBuffer(gridSize); // return an empty gray buffer
+	}
 	
 	// allocate buffer for gray pixels
-	unsigned char * grayBuffer = malloc(gridSize);
-	if (grayBuffer == NULL)
+	unsigned char * grayBuffer = allocBuffer(gridSize);
+	unsigned char * table = createStretchedShortToGrayTable(histogram, minVal, maxVal);
+	releaseHistogram(histogram);
+	if (grayBuffer == NULL || table == NULL) {
+		releaseBuffer(grayBuffer);
+		releaseBuffer(table);
 		return NULL;
-	
-	// scale shorts to unsigned chars
-	for (i = 0; i < gridSize; i++) {
-		if (!isValidSRTMValue(shortBuffer[i]))
-			grayBuffer[i] = 255;
-		else
-			grayBuffer[i] = (unsigned char)((shortBuffer[i] - minVal) * 255 / diff);
 	}
+	table[(unsigned short)SRTM_NODATAVALUE] = 255;
+	table[(unsigned short)SRTM_ALTERNATIVE_NODATAVALUE] = 255;
+	
+	// convert shorts to stretched and graded gray values
+	for (i = 0; i < gridSize; i++)
+		grayBuffer[i] = table[(unsigned short)shortBuffer[i]];
 	
+	releaseBuffer(table);
 	return grayBuffer;
 }
 
@@ -127,71 +159,478 @@ bool readSRTMSize(char *filePath, long *width, long *height) {
 	
 }
 
+/* Reads n samples of a file, starting with sample first. pread does not move
+ the file position and does not copy the samples through the buffer of fp. 
+ Files opened with funopen() have no file descriptor and are read with fseek
+ and fread. */
+bool readSRTMSamples(FILE *fp, long first, long n, short *samples) {
+	off_t offset = (off_t)first * sizeof(short);
+	size_t bytes = n * sizeof(short);
+	int fd = fileno(fp);
+	if (fd < 0)
+		return fseek (fp, offset, SEEK_SET) == 0 && fread (samples, sizeof(short), n, fp) == n;
+	return pread(fd, samples, bytes, offset) == (ssize_t)bytes;
+}
+
+/* Copies every sdist-th of n samples to cells. */
+void gatherSRTMSamples(const short *samples, long n, int sdist, short *cells) {
+	const short *end = samples + n;
+	for (; samples < end; samples += sdist)
+		*cells++ = *samples;
+}
+
+/* Returns true if the tiles in the folder of an SRTM tile are to be shown as 
+ one mosaic. */
+bool srtmMosaicPreference(void) {
+	Boolean valid;
+	Boolean mosaic = CFPreferencesGetAppBooleanValue(CFSTR("SRTMMosaic"), 
+													 CFSTR("ch.bernhardjenny.gislook"), 
+													 &valid);
+	return valid && mosaic;
+}
+
+/* Extracts the latitude and longitude of the lower left corner of a tile from
+ a file name like N37W105.hgt. */
+bool parseSRTMTileName(const char *name, int *lat, int *lon) {
+	const char *s = strrchr(name, '/');
+	s = s ? s + 1 : name;
+	char ns = toupper(s[0]);
+	char ew = toupper(s[3]);
+	if ((ns != 'N' && ns != 'S') || (ew != 'E' && ew != 'W'))
+		return FALSE;
+	if (!isdigit(s[1]) || !isdigit(s[2]) 
+		|| !isdigit(s[4]) || !isdigit(s[5]) || !isdigit(s[6])
+		|| (s[7] != '.' && s[7] != '\0'))
+		return FALSE;
+	*lat = (s[1] - '0') * 10 + (s[2] - '0');
+	*lon = (s[4] - '0') * 100 + (s[5] - '0') * 10 + (s[6] - '0');
+	if (ns == 'S')
+		*lat = -*lat;
+	if (ew == 'W')
+		*lon = -*lon;
+	return TRUE;
+}
+
+/* Returns the first latitude or longitude of the block of tiles containing a tile. */
+int srtmMosaicBlockStart(int degree) {
+	return (int)floor(degree / (double)SRTM_MOSAIC_BLOCK) * SRTM_MOSAIC_BLOCK;
+}
+
+// a tile of a mosaic
+typedef struct {
+	char *path;
+	long row, col;		// position in the mosaic, row 0 is in the north
+} SRTMTile;
+
+/* Shared by the worker threads that decode the tiles of a mosaic. Workers take
+ the next tile and decimate it into its part of the shared grid. Each tile 
+ writes the rows and columns it shares with its southern and eastern 
+ neighbors only if it is the last tile in the mosaic, so that no two workers
+ write the same cell. */
+typedef struct {
+	SRTMTile *tiles;
+	long nTiles;
+	long nextTile;
+	pthread_mutex_t mutex;
+	
+	long tileSize;
+	long tileRows, tileCols;
+	int sdist;
+	long rw, rh;
+	short *grid;		// big endian values like in the files
+	
+	CFAbsoluteTime *deadline;
+	QLPreviewRequestRef preview;
+	QLThumbnailRequestRef thumbnail;
+} SRTMMosaic;
+
+/* Returns the first and the last sampled row or column of the mosaic that are
+ read from a tile. Returns false if none is read. */
+bool srtmTileSamples(const SRTMMosaic *mosaic, long tilePos, long nTilePos, 
+					 long resampledSize, long *first, long *last) {
+	long start = tilePos * (mosaic->tileSize - 1);
+	long end = start + mosaic->tileSize - (tilePos == nTilePos - 1 ? 1 : 2);
+	*first = (start + mosaic->sdist - 1) / mosaic->sdist;
+	*last = end / mosaic->sdist;
+	if (*last >= resampledSize)
+		*last = resampledSize - 1;
+	return *first <= *last;
+}
+
+/* Decimates one tile into the grid of the mosaic. The rows of the tile are 
+ read in the order of rowReadingOrder() into a grid of the tile. At the 
+ deadline, the rows not read are filled with the rows read, so that the tile 
+ is shown coarsely instead of being cut off. Rows that cannot be read stay 
+ void. */
+void decodeSRTMTile(SRTMMosaic *mosaic, const SRTMTile *tile, short *lineBuffer) {
+	
+	long r0, r1, c0, c1;
+	if (!srtmTileSamples(mosaic, tile->row, mosaic->tileRows, mosaic->rh, &r0, &r1)
+		|| !srtmTileSamples(mosaic, tile->col, mosaic->tileCols, mosaic->rw, &c0, &c1))
+		return;
+	
+	// only the samples between the first and the last sampled column are read
+	long firstRow = tile->row * (mosaic->tileSize - 1);
+	long firstSample = c0 * mosaic->sdist - tile->col * (mosaic->tileSize - 1);
+	long nSamples = (c1 - c0) * mosaic->sdist + 1;
+	long rows = r1 - r0 + 1;
+	size_t rowBytes = (c1 - c0 + 1) * sizeof(short);
+	short *tileGrid = allocBuffer(rows * rowBytes);
+	long *order = rowReadingOrder(rows, nSamples * sizeof(short));
+	FILE *fp = fopen(tile->path, "rb");
+	if (tileGrid == NULL || order == NULL || fp == NULL) {
+		releaseBuffer(tileGrid);
+		free(order);
+		if (fp)
+			fclose(fp);
+		return;
+	}
+	long i;
+	bool pastDeadline = FALSE;
+	for (i = 0; i < rows; i++) {
+		if (isCancelled(mosaic->preview, mosaic->thumbnail))
+			break;
+		if (i > 0 && isPastDeadline()) {
+			pastDeadline = TRUE;
+			break;
+		}
+		long row = (r0 + order[i]) * mosaic->sdist - firstRow;
+		if (!readSRTMSamples(fp, row * mosaic->tileSize + firstSample, nSamples, lineBuffer))
+			break;
+		gatherSRTMSamples(lineBuffer, nSamples, mosaic->sdist, 
+						  (short *)((char *)tileGrid + order[i] * rowBytes));
+	}
+	fclose(fp);
+	long nRead = i;
+	if (pastDeadline) {
+		fillUnreadRows(tileGrid, rowBytes, rows, order, nRead);
+		nRead = rows;
+	}
+	
+	// copy the rows to the part of the mosaic covered by the tile
+	for (i = 0; i < nRead; i++)
+		memcpy(mosaic->grid + (r0 + order[i]) * mosaic->rw + c0, 
+			   (char *)tileGrid + order[i] * rowBytes, rowBytes);
+	releaseBuffer(tileGrid);
+	free(order);
+}
+
+/* Worker thread: decodes tiles until all are decoded or the time is up. The 
+ first tile is always decoded, and tiles that are not decoded stay void. */
+void *decodeSRTMTiles(void *info) {
+	SRTMMosaic *mosaic = info;
+	setDeadline(mosaic->deadline);
+	short *lineBuffer = allocBuffer(mosaic->tileSize * 2);
+	while (lineBuffer != NULL) {
+		pthread_mutex_lock(&mosaic->mutex);
+		long t = mosaic->nTiles;
+		if (mosaic->nextTile == 0 || !isPastDeadline())
+			t = mosaic->nextTile++;
+		pthread_mutex_unlock(&mosaic->mutex);
+		if (t >= mosaic->nTiles || isCancelled(mosaic->preview, mosaic->thumbnail))
+			break;
+		decodeSRTMTile(mosaic, &mosaic->tiles[t], lineBuffer);
+	}
+	releaseBuffer(lineBuffer);
+	setDeadline(NULL);
+	return NULL;
+}
+
+/* Finds the tiles in the folder of an SRTM tile that are in the same block of
+ SRTM_MOSAIC_BLOCK by SRTM_MOSAIC_BLOCK degrees and have the same size. The 
+ mosaic covers the bounding box of these tiles. Returns false if there is no
+ other tile. */
+bool findSRTMTiles(char *filePath, SRTMMosaic *mosaic) {
+	
+	int lat, lon;
+	if (!parseSRTMTileName(filePath, &lat, &lon))
+		return FALSE;
+	unsigned long fileSize = getFileLength(filePath);
+	if (fileSize == SRTM3_FILE_SIZE)
+		mosaic->tileSize = SRTM3SIZE;
+	else if (fileSize == SRTM1_FILE_SIZE)
+		mosaic->tileSize = SRTM1SIZE;
+	else
+		return FALSE;
+	int blockLat = srtmMosaicBlockStart(lat);
+	int blockLon = srtmMosaicBlockStart(lon);
+	
+	char folder[10240], tilePath[10240];
+	strncpy(folder, filePath, sizeof(folder) - 1);
+	folder[sizeof(folder) - 1] = '\0';
+	char *slash = strrchr(folder, '/');
+	if (slash == NULL)
+		return FALSE;
+	*slash = '\0';
+	DIR *dir = opendir(slash == folder ? "/" : folder);
+	if (dir == NULL)
+		return FALSE;
+	
+	// collect the tiles with their latitude and longitude in row and col
+	mosaic->tiles = malloc(SRTM_MOSAIC_BLOCK * SRTM_MOSAIC_BLOCK * sizeof(SRTMTile));
+	mosaic->nTiles = 0;
+	if (mosaic->tiles == NULL) {
+		closedir(dir);
+		return FALSE;
+	}
+	int minLat = lat, maxLat = lat, minLon = lon, maxLon = lon;
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL && mosaic->nTiles < SRTM_MOSAIC_BLOCK * SRTM_MOSAIC_BLOCK) {
+		int tileLat, tileLon;
+		if (!parseSRTMTileName(entry->d_name, &tileLat, &tileLon)
+			|| srtmMosaicBlockStart(tileLat) != blockLat
+			|| srtmMosaicBlockStart(tileLon) != blockLon)
+			continue;
+		snprintf(tilePath, sizeof(tilePath), "%s/%s", folder, entry->d_name);
+		if (getFileLength(tilePath) != fileSize)
+			continue;
+		SRTMTile *tile = &mosaic->tiles[mosaic->nTiles];
+		tile->path = strdup(tilePath);
+		if (tile->path == NULL)
+			continue;
+		tile->row = tileLat;
+		tile->col = tileLon;
+		mosaic->nTiles++;
+		if (tileLat < minLat) minLat = tileLat;
+		if (tileLat > maxLat) maxLat = tileLat;
+		if (tileLon < minLon) minLon = tileLon;
+		if (tileLon > maxLon) maxLon = tileLon;
+	}
+	closedir(dir);
+	
+	// position the tiles in the bounding box
+	long t;
+	for (t = 0; t < mosaic->nTiles; t++) {
+		mosaic->tiles[t].row = maxLat - mosaic->tiles[t].row;
+		mosaic->tiles[t].col -= minLon;
+	}
+	mosaic->tileRows = maxLat - minLat + 1;
+	mosaic->tileCols = maxLon - minLon + 1;
+	return mosaic->nTiles > 1;
+}
+
+void releaseSRTMTiles(SRTMMosaic *mosaic) {
+	long t;
+	for (t = 0; t < mosaic->nTiles; t++)
+		free(mosaic->tiles[t].path);
+	free(mosaic->tiles);
+	mosaic->tiles = NULL;
+	mosaic->nTiles = 0;
+}
+
+/* Appends the number of tiles of the mosaic of an SRTM tile and the newest 
+ modification date of these tiles to the tag of a cached image, so that the 
+ image is read again when tiles of the mosaic are added, removed or changed. 
+ The modification date of the folder would not change when a tile is 
+ overwritten, and would change with any other file in the folder. */
+void appendSRTMMosaicCacheTag(char *filePath, char *tag, size_t tagLength) {
+	if (!srtmMosaicPreference())
+		return;
+	SRTMMosaic mosaic;
+	memset(&mosaic, 0, sizeof(mosaic));
+	// a tile without other tiles is tagged too, as tiles may be added later
+	findSRTMTiles(filePath, &mosaic);
+	if (mosaic.nTiles == 0) {
+		releaseSRTMTiles(&mosaic);
+		return;
+	}
+	time_t newest = 0;
+	long t;
+	for (t = 0; t < mosaic.nTiles; t++) {
+		struct stat st;
+		if (stat(mosaic.tiles[t].path, &st) == 0 && st.st_mtime > newest)
+			newest = st.st_mtime;
+	}
+	size_t used = strlen(tag);
+	if (used < tagLength)
+		snprintf(tag + used, tagLength - used, " mosaic %ld %ld", mosaic.nTiles, (long)newest);
+	releaseSRTMTiles(&mosaic);
+}
+
+/* Reads the tiles in the folder of an SRTM tile as one grid. The tiles are 
+ decoded in parallel. Returns NULL if the file is not a tile or if there is 
+ no other tile to combine it with. */
+CGImageRef readSRTMMosaicImage(char *filePath,
+							   long maxSize,
+							   QLPreviewRequestRef preview,
+							   QLThumbnailRequestRef thumbnail) {
+	
+	SRTMMosaic mosaic;
+	memset(&mosaic, 0, sizeof(mosaic));
+	if (!findSRTMTiles(filePath, &mosaic)) {
+		releaseSRTMTiles(&mosaic);
+		return NULL;
+	}
+	
+	// neighboring tiles share one row or column
+	long width = mosaic.tileCols * (mosaic.tileSize - 1) + 1;
+	long height = mosaic.tileRows * (mosaic.tileSize - 1) + 1;
+	mosaic.rw = resampledWidth(width, height, maxSize);
+	mosaic.rh = resampledHeight(width, height, maxSize);
+	mosaic.sdist = sampleDist(width, height, maxSize);
+	long gridSize = mosaic.rw * mosaic.rh;
+	mosaic.grid = allocBuffer(gridSize * sizeof(short));
+	if (mosaic.grid == NULL) {
+		releaseSRTMTiles(&mosaic);
+		return NULL;
+	}
+	
+	// areas without tiles are void
+#ifdef __LITTLE_ENDIAN__
+	short voidValue = swapShort(SRTM_NODATAVALUE);
+#else
+	short voidValue = SRTM_NODATAVALUE;
+#endif
+	long i;
+	for (i = 0; i < gridSize; i++)
+		mosaic.grid[i] = voidValue;
+	
+	// decode the tiles
+	mosaic.deadline = getDeadline();
+	mosaic.preview = preview;
+	mosaic.thumbnail = thumbnail;
+	pthread_mutex_init(&mosaic.mutex, NULL);
+	pthread_t threads[MAX_WORKER_THREADS];
+	int nThreads = 0;
+	int maxThreads = workerThreadCount();
+	while (nThreads < maxThreads && nThreads < mosaic.nTiles
+		   && pthread_create(&threads[nThreads], NULL, decodeSRTMTiles, &mosaic) == 0)
+		nThreads++;
+	if (nThreads == 0)
+		decodeSRTMTiles(&mosaic);
+	for (i = 0; i < nThreads; i++)
+		pthread_join(threads[i], NULL);
+	pthread_mutex_destroy(&mosaic.mutex);
+	if (nThreads == 0)
+		setDeadline(mosaic.deadline);
+	releaseSRTMTiles(&mosaic);
+	
+	if (isCancelled(preview, thumbnail)) {
+		releaseBuffer(mosaic.grid);
+		return NULL;
+	}
+	
+	// the range of values and the stretch are found for all tiles together
+	unsigned char *grayBuffer = scaleSRTMToByte(mosaic.grid, gridSize, mosaic.rw, preview, thumbnail);
+	releaseBuffer(mosaic.grid);
+	if (grayBuffer == NULL)
+		return NULL;
+	return createGradedGrayScaleImage(grayBuffer, mosaic.rw, mosaic.rh);
+}
+
 CGImageRef readSRTMImage(FILE * fp,
 						 char *filePath,
+						 long maxSize,
 						 QLPreviewRequestRef preview,
 						 QLThumbnailRequestRef thumbnail) {
 	
+	// show the tiles in the folder of a tile together if asked to
+	if (srtmMosaicPreference()) {
+		CGImageRef image = readSRTMMosaicImage(filePath, maxSize, preview, thumbnail);
+		if (image)
+			return image;
+	}
+	
 	// compute the size of the grid from the file size
 	long width, height;
-	bool halfSize = false;
-	unsigned long fileSize = getFileLength(filePath);
-	if (fileSize == SRTM30_FILE_SIZE) {
-		width = SRTM30WIDTH;
-		height = SRTM30HEIGHT;
-		halfSize = true;
-	} else if (fileSize == SRTM3_FILE_SIZE)
-		width = height = SRTM3SIZE;
-	else if (fileSize == SRTM1_FILE_SIZE)
-		width = height = SRTM1SIZE;
-	else
+	if (!readSRTMSize(filePath, &width, &height))
 		return NULL;
 	
-	// read the grid values
-	short *shortBuffer = NULL;
-	if (halfSize) {
-		shortBuffer = (short *)malloc(width * height);
-		short *lineBuffer = malloc(width * 2);
-		int col, row, cell = 0;
-		for (row = 0; row < height; row += 2) {
-			if (fread (lineBuffer, 2, width, fp) != width) {
-				free(lineBuffer);
-				free(shortBuffer);
-				return NULL;
-			}
-			fseek (fp , width * 2, SEEK_CUR);
-			for (col = 0; col < width; col += 2) {
-				shortBuffer[cell++] = lineBuffer[col];
-			}
-		}
-		free(lineBuffer);
-		width /= 2;
-		height /= 2;
-	} else {
-		shortBuffer = (short *)malloc(2 * width * height);
-		if (shortBuffer == NULL)
+	long rw = resampledWidth(width, height, maxSize);
+	long rh = resampledHeight(width, height, maxSize);
+	int sdist = sampleDist(width, height, maxSize);
+	
+	// read all rows and average them if only short rows would be skipped.
+	// the averages are stored in big endian order like the other values.
+	BoxFilter box = {0};
+	VoidSamples voids;
+	initVoidSamples(&voids);
+	voids.voidValues[0] = SRTM_NODATAVALUE;
+	voids.voidValues[1] = SRTM_ALTERNATIVE_NODATAVALUE;
+	bool boxFilter = useBoxFilter(sdist, width * 2);
+#ifdef __LITTLE_ENDIAN__
+	bool swap = TRUE;
+#else
+	bool swap = FALSE;
+#endif
+	if (boxFilter && !initBoxFilter(&box, fp, 0, width * 2, height, width,
+									 int16Sample, swap, sdist, &voids))
+		return NULL;
+	
+	// read the grid values. Only the samples up to the last sampled column are
+	// read from each row, and memory is bounded by the size of the sampled grid.
+	long nSamples = (rw - 1) * sdist + 1;
+	short *shortBuffer = (short *)allocBuffer(2 * rw * rh);
+	short *lineBuffer = allocBuffer(width * 2);
+	long *order = boxFilter ? boxFilterRowOrder(&box, rh, FALSE) : rowReadingOrder(rh, nSamples * 2);
+	if (shortBuffer == NULL || lineBuffer == NULL || order == NULL) {
+		releaseBuffer(lineBuffer);
+		free(order);
+		releaseBuffer(shortBuffer);
+		releaseBoxFilter(&box);
+		return NULL;
+	}
+	long i;
+	for (i = 0; i < rh; i++) {
+		
+		// stop when out of time and use the rows read so far
+		if (i > 0 && isPastDeadline())
+			break;
+		
+		if (i % 20 == 0 && isCancelled(preview, thumbnail)) {
+			releaseBuffer(lineBuffer);
+			free(order);
+			releaseBuffer(shortBuffer);
+			releaseBoxFilter(&box);
 			return NULL;
-		size_t read = fread (shortBuffer, 2, width * height, fp);
-		if (read != width * height) {
-			free(shortBuffer);
+		}
+		
+		long row = order[i] * sdist;
+		bool read;
+		if (boxFilter)
+			read = readBoxFilteredLine(&box, order[i], lineBuffer);
+		else
+			read = readSRTMSamples(fp, row * width, nSamples, lineBuffer);
+		if (!read) {
+			releaseBuffer(lineBuffer);
+			free(order);
+			releaseBuffer(shortBuffer);
+			releaseBoxFilter(&box);
 			return NULL;
 		}
+		gatherSRTMSamples(lineBuffer, nSamples, sdist, shortBuffer + order[i] * rw);
+		
+		// show the rows read so far at the end of a coarse pass
+		if (isCoarseFrameDue(order, rh, i + 1)) {
+			short *frame = copyGridWithUnreadRows(shortBuffer, rw * sizeof(short), rh, order, i + 1);
+			if (frame) {
+				unsigned char *gray = scaleSRTMToByte(frame, rw * rh, rw, preview, thumbnail);
+				releaseBuffer(frame);
+				drawCoarseFrame(gray, rw, rh, TRUE);
+			}
+		}
 	}
+	fillUnreadRows(shortBuffer, rw * sizeof(short), rh, order, i);
+	releaseBoxFilter(&box);
+	releaseBuffer(lineBuffer);
+	free(order);
+	width = rw;
+	height = rh;
 	
 	// check whether we should abort
 	if (isCancelled(preview, thumbnail)) {
-		free (shortBuffer);
+		releaseBuffer(shortBuffer);
 		return NULL;
 	}
 	
 	// convert to grayscale image
-	unsigned char *grayBuffer = scaleSRTMToByte(shortBuffer, width * height, preview, thumbnail);
-	free (shortBuffer);
+	unsigned char *grayBuffer = scaleSRTMToByte(shortBuffer, width * height, width, preview, thumbnail);
+	releaseBuffer(shortBuffer);
 	if (grayBuffer == NULL || isCancelled(preview, thumbnail)) {
-		free (grayBuffer);
+		releaseBuffer(grayBuffer);
 		return NULL;
 	}
 	
-	return createGrayScaleImage(grayBuffer, width, height);
+	return createGradedGrayScaleImage(grayBuffer, width, height);
 
 }
\ No newline at end of file
@@ -15,8 +15,10 @@
 #define __SRTM2IMAGE__
 
 bool readSRTMSize(char *filePath, long *width, long *height);
+void appendSRTMMosaicCacheTag(char *filePath, char *tag, size_t tagLength);
 CGImageRef readSRTMImage(FILE * fp,
 						 char *filePath,
+						long maxSize,
 						QLPreviewRequestRef preview,
 						QLThumbnailRequestRef thumbnail);
 
@@ -0,0 +1,278 @@
+/*
+ *  Stretch.c
+ *  GISLook
+ *
+ */
+
+/* A linear stretch between the minimum and the maximum of a grid results in a
+ dark or bright image if the grid contains a few extreme values, e.g. spikes 
+ or void values that are not flagged. Readers therefore add values to a 
+ histogram in the same pass that finds the minimum and the maximum. The 
+ histogram is used to stretch between two percentiles, or to equalize the 
+ histogram, without another pass over the grid. 16 bit values are counted
+ exactly. Float values are counted in logarithmic bins, as the range of 
+ float values is not known when the histogram is accumulated. A bin of large
+ values is wide, e.g. 8 units between 1024 and 2048, so values are 
+ interpolated linearly inside their bin. Otherwise all values of a bin would
+ get the same gray value, and a grid with a small range would be posterized. */
+
+#include "Stretch.h"
+#include "ReadRaster.h"
+#include "BufferPool.h"
+#include <math.h>
+#include <string.h>
+
+/* Returns the stretch for a format. The stretch can be changed with the 
+ preferenceKey default of GISLook, e.g. 
+ defaults write ch.bernhardjenny.gislook SRTMStretch equalize */
+Stretch stretchForFormat(CFStringRef preferenceKey, Stretch defaultStretch) {
+	Stretch stretch = defaultStretch;
+	CFPropertyListRef value = CFPreferencesCopyAppValue(preferenceKey, CFSTR("ch.bernhardjenny.gislook"));
+	if (value == NULL)
+		return stretch;
+	if (CFGetTypeID(value) == CFStringGetTypeID()) {
+		if (CFStringCompare(value, CFSTR("linear"), kCFCompareCaseInsensitive) == kCFCompareEqualTo)
+			stretch = linearStretch;
+		else if (CFStringCompare(value, CFSTR("percentile"), kCFCompareCaseInsensitive) == kCFCompareEqualTo)
+			stretch = percentileStretch;
+		else if (CFStringCompare(value, CFSTR("equalize"), kCFCompareCaseInsensitive) == kCFCompareEqualTo)
+			stretch = equalizeStretch;
+	}
+	CFRelease(value);
+	return stretch;
+}
+
+/* Appends the stretches of all grid formats to the tag of a cached image. The
+ format of a file is only known after it has been read, and a cached image
+ must not be reused after the stretch for its format has been changed. The
+ preference keys and default stretches are those used by the readers. */
+void appendStretchCacheTag(char *tag, size_t tagLength) {
+	struct {
+		CFStringRef preferenceKey;
+		Stretch defaultStretch;
+	} formats[] = {
+		{ CFSTR("ArcInfoGridStretch"), percentileStretch },
+		{ CFSTR("BILStretch"), percentileStretch },
+		{ CFSTR("E00GridStretch"), percentileStretch },
+		{ CFSTR("ESRIASCIIGridStretch"), percentileStretch },
+		{ CFSTR("ESRIBinaryGridStretch"), percentileStretch },
+		{ CFSTR("GeoTIFFStretch"), percentileStretch },
+		{ CFSTR("PGMStretch"), linearStretch },
+		{ CFSTR("SRTMStretch"), percentileStretch },
+		{ CFSTR("USGSDEMStretch"), percentileStretch }
+	};
+	int nFormats = sizeof(formats) / sizeof(formats[0]);
+	char stretches[sizeof(formats) / sizeof(formats[0]) + 1];
+	int i;
+	for (i = 0; i < nFormats; i++)
+		stretches[i] = '0' + stretchForFormat(formats[i].preferenceKey, formats[i].defaultStretch);
+	stretches[nFormats] = '\0';
+	size_t used = strlen(tag);
+	if (used < tagLength)
+		snprintf(tag + used, tagLength - used, " stretch %s", stretches);
+}
+
+/* Returns an empty histogram, or NULL for a linear stretch, which does not 
+ need a histogram. */
+Histogram *createHistogram(Stretch stretch) {
+	if (stretch == linearStretch)
+		return NULL;
+	Histogram *histogram = allocZeroedBuffer(sizeof(Histogram));
+	if (histogram != NULL)
+		histogram->stretch = stretch;
+	return histogram;
+}
+
+void releaseHistogram(Histogram *histogram) {
+	releaseBuffer(histogram);
+}
+
+/* Adds a signed or unsigned 16 bit value. */
+void addShortToHistogram(Histogram *histogram, long v) {
+	histogram->counts[(unsigned short)v]++;
+	histogram->total++;
+}
+
+/* Adds the counts of other to histogram. Used by readers that count values in
+ several threads. */
+void mergeHistogram(Histogram *histogram, const Histogram *other) {
+	long i;
+	for (i = 0; i < HISTOGRAM_BINS; i++)
+		histogram->counts[i] += other->counts[i];
+	histogram->total += other->total;
+}
+
+/* Returns the bin of a float. The bits of the float are changed such that 
+ they sort like the float values, and the upper 16 bits are the bin. */
+unsigned short floatBin(float f) {
+	union { float f; UInt32 u; } bits;
+	bits.f = f;
+	UInt32 u = (bits.u & 0x80000000) ? ~bits.u : (bits.u | 0x80000000);
+	return u >> 16;
+}
+
+/* Returns the smallest float in a bin. */
+float binFloat(long bin) {
+	union { float f; UInt32 u; } bits;
+	UInt32 u = (UInt32)bin << 16;
+	bits.u = (u & 0x80000000) ? (u & 0x7FFFFFFF) : ~u;
+	return bits.f;
+}
+
+void addFloatToHistogram(Histogram *histogram, float f) {
+	histogram->counts[floatBin(f)]++;
+	histogram->total++;
+}
+
+/* Returns a table that converts 16 bit values between minVal and maxVal to 
+ gray values, with the stretch of the histogram. See createShortToGrayTable()
+ for how the table is used. The histogram may be NULL for a linear stretch. */
+unsigned char *createStretchedShortToGrayTable(Histogram *histogram, long minVal, long maxVal) {
+	
+	if (histogram == NULL || histogram->total == 0 || maxVal - minVal >= HISTOGRAM_BINS)
+		return createShortToGrayTable(minVal, maxVal);
+	
+	long v;
+	unsigned long cumulated = 0;
+	
+	if (histogram->stretch == equalizeStretch) {
+		unsigned char *table = allocBuffer(65536);
+		if (table == NULL)
+			return NULL;
+		for (v = minVal; v <= maxVal; v++) {
+			unsigned long count = histogram->counts[(unsigned short)v];
+			table[(unsigned short)v] = (cumulated + count / 2) * 255 / histogram->total;
+			cumulated += count;
+		}
+		return table;
+	}
+	
+	// find the values at the two percentiles
+	unsigned long lowerCount = histogram->total * STRETCH_LOWER_PERCENTILE;
+	unsigned long upperCount = histogram->total * STRETCH_UPPER_PERCENTILE;
+	long lower = minVal, upper = maxVal;
+	for (v = minVal; v <= maxVal; v++) {
+		cumulated += histogram->counts[(unsigned short)v];
+		if (cumulated <= lowerCount)
+			lower = v;
+		if (cumulated < upperCount)
+			upper = v + 1;
+	}
+	if (upper > maxVal)
+		upper = maxVal;
+	if (upper <= lower)
+		return createShortToGrayTable(minVal, maxVal);
+	
+	// stretch between the percentiles, and clip values outside
+	unsigned char *table = createShortToGrayTable(lower, upper);
+	if (table == NULL)
+		return NULL;
+	for (v = minVal; v < lower; v++)
+		table[(unsigned short)v] = 0;
+	for (v = upper + 1; v <= maxVal; v++)
+		table[(unsigned short)v] = 255;
+	return table;
+}
+
+/* Writes the range of the values in a bin to start and end. The first and the
+ last bin are only filled up to minVal and maxVal. */
+void floatBinRange(long bin, float minVal, float maxVal, float *start, float *end) {
+	*start = binFloat(bin);
+	*end = bin + 1 < HISTOGRAM_BINS ? binFloat(bin + 1) : maxVal;
+	if (!(*start >= minVal))
+		*start = minVal;
+	if (!(*end <= maxVal))
+		*end = maxVal;
+}
+
+/* Returns the value below which count values of the histogram lie. The value
+ is interpolated linearly inside its bin. */
+float floatAtCount(const Histogram *histogram, unsigned long count, float minVal, float maxVal) {
+	long bin;
+	unsigned long cumulated = 0;
+	for (bin = 0; bin < HISTOGRAM_BINS; bin++) {
+		unsigned long binCount = histogram->counts[bin];
+		if (cumulated + binCount > count) {
+			float start, end;
+			floatBinRange(bin, minVal, maxVal, &start, &end);
+			if (!(end > start))
+				return start;
+			return start + (end - start) * (float)(count - cumulated) / binCount;
+		}
+		cumulated += binCount;
+	}
+	return maxVal;
+}
+
+/* Initializes the conversion of floats between minVal and maxVal to gray 
+ values with the stretch of the histogram. The histogram may be NULL for a 
+ linear stretch. Returns FALSE if all values are equal, or if there is not 
+ enough memory. */
+bool initFloatStretch(FloatStretch *stretch, Histogram *histogram, float minVal, float maxVal) {
+	
+	stretch->equalization = NULL;
+	if (!(maxVal > minVal))
+		return FALSE;
+	stretch->minVal = minVal;
+	stretch->scale = 255.f / (maxVal - minVal);
+	stretch->gridMin = minVal;
+	stretch->gridMax = maxVal;
+	if (histogram == NULL || histogram->total == 0)
+		return TRUE;
+	
+	if (histogram->stretch == equalizeStretch) {
+		// the gray values at the start of the bins and at the end of the last
+		stretch->equalization = allocBuffer((HISTOGRAM_BINS + 1) * sizeof(float));
+		if (stretch->equalization == NULL)
+			return FALSE;
+		long bin;
+		unsigned long cumulated = 0;
+		for (bin = 0; bin < HISTOGRAM_BINS; bin++) {
+			stretch->equalization[bin] = 255.f * cumulated / histogram->total;
+			cumulated += histogram->counts[bin];
+		}
+		stretch->equalization[HISTOGRAM_BINS] = 255.f;
+		return TRUE;
+	}
+	
+	// find the two percentiles
+	unsigned long lowerCount = histogram->total * STRETCH_LOWER_PERCENTILE;
+	unsigned long upperCount = histogram->total * STRETCH_UPPER_PERCENTILE;
+	float lower = floatAtCount(histogram, lowerCount, minVal, maxVal);
+	float upper = floatAtCount(histogram, upperCount, minVal, maxVal);
+	if (!(lower >= minVal))
+		lower = minVal;
+	if (!(upper <= maxVal))
+		upper = maxVal;
+	if (upper > lower) {
+		stretch->minVal = lower;
+		stretch->scale = 255.f / (upper - lower);
+	}
+	return TRUE;
+}
+
+/* Converts a float to a gray value. Values outside the stretched range are 
+ clipped. */
+unsigned char stretchFloat(float f, const FloatStretch *stretch) {
+	float g;
+	if (stretch->equalization != NULL) {
+		// interpolate between the gray values at the start and the end of the bin
+		long bin = floatBin(f);
+		float start, end;
+		floatBinRange(bin, stretch->gridMin, stretch->gridMax, &start, &end);
+		g = stretch->equalization[bin];
+		if (end > start)
+			g += (stretch->equalization[bin + 1] - g) * (f - start) / (end - start);
+	} else
+		g = (f - stretch->minVal) * stretch->scale;
+	if (!(g > 0.f))
+		return 0;
+	if (g >= 255.f)
+		return 255;
+	return (unsigned char)g;
+}
+
+void releaseFloatStretch(FloatStretch *stretch) {
+	releaseBuffer(stretch->equalization);
+	stretch->equalization = NULL;
+}
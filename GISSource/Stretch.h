@@ -0,0 +1,56 @@
+/*
+ *  Stretch.h
+ *  GISLook
+ *
+ */
+
+#include <CoreFoundation/CoreFoundation.h>
+
+#ifndef __GISLOOK_STRETCH__
+#define __GISLOOK_STRETCH__
+
+// how grid values are converted to gray values
+typedef enum {
+	linearStretch,		// linear between the minimum and the maximum
+	percentileStretch,	// linear between two percentiles, ignores outliers
+	equalizeStretch		// histogram equalization
+} Stretch;
+
+// percentiles used by percentileStretch
+#define STRETCH_LOWER_PERCENTILE 0.02
+#define STRETCH_UPPER_PERCENTILE 0.98
+
+// 16 bit values have one bin each, float values are binned by their
+// exponent and the first 7 bits of their mantissa.
+#define HISTOGRAM_BINS 65536
+
+typedef struct {
+	Stretch stretch;
+	unsigned long total;
+	UInt32 counts[HISTOGRAM_BINS];
+} Histogram;
+
+// converts a float to a gray value, initialized with initFloatStretch()
+typedef struct {
+	float minVal;
+	float scale;
+	float gridMin, gridMax;
+	float *equalization;	// gray values at the start of each bin
+} FloatStretch;
+
+Stretch stretchForFormat(CFStringRef preferenceKey, Stretch defaultStretch);
+void appendStretchCacheTag(char *tag, size_t tagLength);
+
+Histogram *createHistogram(Stretch stretch);
+void releaseHistogram(Histogram *histogram);
+void addShortToHistogram(Histogram *histogram, long v);
+void addFloatToHistogram(Histogram *histogram, float f);
+void mergeHistogram(Histogram *histogram, const Histogram *other);
+
+unsigned char *createStretchedShortToGrayTable(Histogram *histogram, long minVal, long maxVal);
+
+bool initFloatStretch(FloatStretch *stretch, Histogram *histogram, float minVal, float maxVal);
+unsigned char stretchFloat(float f, const FloatStretch *stretch);
+void releaseFloatStretch(FloatStretch *stretch);
+
+#endif
@@ -9,27 +9,77 @@
 
 #include "SurferGridToImage.h"
 #include "ReadRaster.h"
+#include "BufferPool.h"
+#include "BoxFilter.h"
+#include <math.h>
+#include <unistd.h>
 
+// Surfer grids are little endian. The bytes are swapped, not the values 
+// converted to integers.
 double swapSurferDouble(double d) {
-#ifdef __LITTLE_ENDIAN__
-	return d;
-#else
-	return CFSwapInt64(d);
+#ifndef __LITTLE_ENDIAN__
+	swapDouble(&d);
 #endif
+	return d;
 }
 
 float swapSurferFloat(float f) {
-#ifdef __LITTLE_ENDIAN__
-	return f;
-#else
-	return CFSwapInt32(f);
+#ifndef __LITTLE_ENDIAN__
+	swapFloat(&f);
 #endif
+	return f;
 }
 
+/* Reads n samples of size bytes at offset. pread does not move the file 
+ position and does not copy the samples through the buffer of fp. Files 
+ opened with funopen() have no file descriptor and are read with fseek and 
+ fread. */
+bool readSurferSamples(FILE *fp, long offset, long n, size_t size, void *samples) {
+	int fd = fileno(fp);
+	if (fd < 0)
+		return fseek (fp, offset, SEEK_SET) == 0 && fread (samples, size, n, fp) == n;
+	return pread(fd, samples, n * size, offset) == (ssize_t)(n * size);
+}
+
+/* Converts every sdist-th of n samples of a Surfer 7 row to gray values. 
+ Samples at or above blank are void. The values are clamped and selected 
+ without branches, so that the loop can be compiled to vector instructions. */
+void surfer7RowToGray(const double *samples, long n, int sdist, double blank,
+					  double zmin, float scale, unsigned char *gray) {
+	const double *end = samples + n;
+	for (; samples < end; samples += sdist) {
+		double z = swapSurferDouble(*samples);
+		float v = (float)(z - zmin) * scale;
+		v = v < 0.f ? 0.f : v;
+		v = v > 255.f ? 255.f : v;
+		*gray++ = z >= blank ? 255 : (unsigned char)v;
+	}
+}
+
+/* Converts every sdist-th of n samples of a Surfer 6 row to gray values. 
+ Samples outside zmin..zmax are void. */
+void surfer6RowToGray(const float *samples, long n, int sdist, 
+					  double zmin, double zmax, float scale, unsigned char *gray) {
+	const float *end = samples + n;
+	for (; samples < end; samples += sdist) {
+		float z = swapSurferFloat(*samples);
+		float v = (float)(z - zmin) * scale;
+		*gray++ = (z > zmax || z < zmin) ? 255 : (unsigned char)v;
+	}
+}
+
+
+// the box filter has to swap bytes where swapSurferDouble() and swapSurferFloat() do
+#ifdef __LITTLE_ENDIAN__
+#define SURFER_SWAP FALSE
+#else
+#define SURFER_SWAP TRUE
+#endif
 
 unsigned char *readSurferBinary7(FILE * fp,
 						   long *width, long *height,
 						   bool onlyReadSize,
+						   long maxSize,
 						   QLPreviewRequestRef preview,
 						   QLThumbnailRequestRef thumbnail) {
 	
@@ -106,63 +156,89 @@ unsigned char *readSurferBinary7(FILE * fp,
 				if (cols < 1L || rows < 1L)
 					return NULL;
 				
-				long rw = resampledWidth(cols, rows);
-				long rh = resampledHeight(cols, rows);
-				int sdist = sampleDist(cols, rows);
+				long rw = resampledWidth(cols, rows, maxSize);
+				long rh = resampledHeight(cols, rows, maxSize);
+				int sdist = sampleDist(cols, rows, maxSize);
 				
 				// initialize grid
 				float diff = zmax - zmin;
 				if (zmin >= zmax)
-					return calloc(rw * rh, 1);
-				double * bufIterator;
+					return allocZeroedBuffer(rw * rh);
+				
+				// read all rows and average them if only short rows would be skipped
+				long dataStart = ftell(fp);
+				// samples at or above the blank value are void
+				BoxFilter box = {0};
+				VoidSamples voids;
+				initVoidSamples(&voids);
+				voids.validMax = nextafter(blank, -HUGE_VAL);
+				bool boxFilter = useBoxFilter(sdist, cols * sizeof(double));
+				if (boxFilter && !initBoxFilter(&box, fp, dataStart, cols * sizeof(double), rows, cols,
+												 float64Sample, SURFER_SWAP, sdist, &voids))
+					return NULL;
+				
+				// only the samples up to the last sampled column are read
+				long nSamples = (rw - 1) * sdist + 1;
+				float scale = 255.f / diff;
 				double * lineBuffer = nil;
-				unsigned char *grayBuffer = malloc(rw * rh);
+				unsigned char *grayBuffer = allocBuffer(rw * rh);
 				
 				// read data
-				lineBuffer = malloc(cols * sizeof(double));
-				long col, row;
-				for (row = 0; row < rows; row += sdist)
+				lineBuffer = allocBuffer(cols * sizeof(double));
+				long *order = boxFilter ? boxFilterRowOrder(&box, rh, TRUE) : rowReadingOrder(rh, cols * sizeof(double));
+				if (grayBuffer == NULL || lineBuffer == NULL || order == NULL) {
+					releaseBuffer(grayBuffer);
+					releaseBuffer(lineBuffer);
+					free(order);
+					releaseBoxFilter(&box);
+					return NULL;
+				}
+				
+				// rows are stored from south to north, the order is for the rows of the image
+				long i;
+				for (i = 0; i < rh; i++)
 				{
 					// check whether we should cancel
-					if (row % 10 == 0 && isCancelled(preview, thumbnail)) {
-						free(lineBuffer);
-						free(grayBuffer);
+					if (i % 10 == 0 && isCancelled(preview, thumbnail)) {
+						releaseBuffer(lineBuffer);
+						releaseBuffer(grayBuffer);
+						free(order);
+						releaseBoxFilter(&box);
 						return NULL;
 					}
 					
-					// read one line
-					if (fread (lineBuffer, sizeof(double) * cols, 1, fp) != 1) {
-						free(grayBuffer);
-						free(lineBuffer);
-						return NULL;
-					}
-					
-					// copy samples from line to grid
-					bufIterator = lineBuffer;
+					// stop when out of time and use the rows read so far
+					if (i > 0 && isPastDeadline())
+						break;
 					
-					long cell = rw * (rh - 1 - row / sdist);
-#ifdef CHECK_GRID_WRITE	
-					if (cell < 0 || cell >= rw * rh) {
-						printf("Surfer 7 %ld \n", cell);
-						free(grayBuffer);
-						free(lineBuffer);
+					// read one line, or average the rows of a row of boxes
+					long row = (rh - 1 - order[i]) * sdist;
+					bool read;
+					if (boxFilter)
+						read = readBoxFilteredLine(&box, rh - 1 - order[i], lineBuffer);
+					else
+						read = readSurferSamples(fp, dataStart + row * cols * sizeof(double),
+												 nSamples, sizeof(double), lineBuffer);
+					if (!read) {
+						releaseBuffer(grayBuffer);
+						releaseBuffer(lineBuffer);
+						free(order);
+						releaseBoxFilter(&box);
 						return NULL;
 					}
-#endif
 					
-					for (col = 0; col < cols; col += sdist, bufIterator += sdist) {
-						double z = swapSurferDouble(*bufIterator);
-						if (z >= blank)
-							grayBuffer[cell++] = 255;
-						else
-							grayBuffer[cell++] = (z - zmin) / diff * 255.f;
-					}
+					// convert samples from line to grid
+					surfer7RowToGray(lineBuffer, nSamples, sdist, blank, zmin, scale, 
+									 grayBuffer + rw * order[i]);
 					
-					// overread lines
-					if (row + sdist < rows)
-						fseek ( fp , cols * (sdist - 1) * sizeof(double), SEEK_CUR);
+					// show the rows read so far at the end of a coarse pass
+					if (isCoarseFrameDue(order, rh, i + 1))
+						drawCoarseFrame(copyGridWithUnreadRows(grayBuffer, rw, rh, order, i + 1), rw, rh, FALSE);
 				}
-				free(lineBuffer);
+				fillUnreadRows(grayBuffer, rw, rh, order, i);
+				free(order);
+				releaseBoxFilter(&box);
+				releaseBuffer(lineBuffer);
 				return grayBuffer;
 			}	
 			default:	// overread tag
@@ -179,7 +255,7 @@ unsigned char *readSurferBinary7(FILE * fp,
 
 bool readSurferBinary7Size(FILE * fp, long *width, long *height) {
 	
-	return (((void*)TRUE) == readSurferBinary7(fp, width, height, true, NULL, NULL));
+	return (((void*)TRUE) == readSurferBinary7(fp, width, height, true, 0, NULL, NULL));
 	
 }
 	
@@ -198,12 +274,12 @@ bool readSurferBinary6Size(FILE * fp, long *width, long *height) {
 
 unsigned char *readSurferBinary6(FILE * fp,
 						   long *width, long *height,
+						   long maxSize,
 						   QLPreviewRequestRef preview,
 						   QLThumbnailRequestRef thumbnail) {
 	
 	double 	west, south, east, north, zmin, zmax;
 	short	rows, cols;
-	float * bufIterator;
 	float * lineBuffer = nil;
 	
 	if (fread (&cols, sizeof(short), 1, fp) != 1)
@@ -235,64 +311,94 @@ unsigned char *readSurferBinary6(FILE * fp,
 	if (cols <= 0 || rows <= 0)
 		return NULL;
 	
-	long rw = resampledWidth(cols, rows);
-	long rh = resampledHeight(cols, rows);
-	int sdist = sampleDist(cols, rows);
+	long rw = resampledWidth(cols, rows, maxSize);
+	long rh = resampledHeight(cols, rows, maxSize);
+	int sdist = sampleDist(cols, rows, maxSize);
 	
 	// initialize grid
 	float diff = zmax - zmin;
 	if (zmin >= zmax)
-		return calloc(rw * rh, 1);
-	unsigned char *grayBuffer = malloc(rw * rh);
-	if (grayBuffer == NULL)
+		return allocZeroedBuffer(rw * rh);
+	
+	// read all rows and average them if only short rows would be skipped
+	long dataStart = ftell(fp);
+	// samples outside of the range of the header are void
+	BoxFilter box = {0};
+	VoidSamples voids;
+	initVoidSamples(&voids);
+	voids.validMin = zmin;
+	voids.validMax = zmax;
+	bool boxFilter = useBoxFilter(sdist, cols * sizeof(float));
+	if (boxFilter && !initBoxFilter(&box, fp, dataStart, cols * sizeof(float), rows, cols,
+									 float32Sample, SURFER_SWAP, sdist, &voids))
 		return NULL;
 	
+	unsigned char *grayBuffer = allocBuffer(rw * rh);
+	if (grayBuffer == NULL) {
+		releaseBoxFilter(&box);
+		return NULL;
+	}
+	
+	// only the samples up to the last sampled column are read
+	long nSamples = (rw - 1) * sdist + 1;
+	float scale = 255.f / diff;
+	
 	// read grid
-	lineBuffer = malloc(sizeof(float) * cols);		
-	if (lineBuffer == NULL) {
-		free (grayBuffer);
+	lineBuffer = allocBuffer(sizeof(float) * cols);		
+	long *order = boxFilter ? boxFilterRowOrder(&box, rh, TRUE) : rowReadingOrder(rh, cols * sizeof(float));
+	if (lineBuffer == NULL || order == NULL) {
+		releaseBuffer(lineBuffer);
+		free (order);
+		releaseBuffer(grayBuffer);
+		releaseBoxFilter(&box);
 		return NULL;
 	}
 	
-	long row, col;
-	for (row = 0; row < rows; row += sdist) {
+	// rows are stored from south to north, the order is for the rows of the image
+	long i;
+	for (i = 0; i < rh; i++) {
 		// check whether we should cancel
-		if (row % 10 == 0 && isCancelled(preview, thumbnail)) {
-			free(lineBuffer);
-			free(grayBuffer);
+		if (i % 10 == 0 && isCancelled(preview, thumbnail)) {
+			releaseBuffer(lineBuffer);
+			free(order);
+			releaseBoxFilter(&box);
+			releaseBuffer(grayBuffer);
 			return NULL;
 		}
 		
-		// read one line
-		if (fread (lineBuffer, sizeof(float) * cols, 1, fp) != 1) {
-			free(grayBuffer);
-			free(lineBuffer);
+		// stop when out of time and use the rows read so far
+		if (i > 0 && isPastDeadline())
+			break;
+		
+		// read one line, or average the rows of a row of boxes
+		long row = (rh - 1 - order[i]) * sdist;
+		bool read;
+		if (boxFilter)
+			read = readBoxFilteredLine(&box, rh - 1 - order[i], lineBuffer);
+		else
+			read = readSurferSamples(fp, dataStart + row * cols * sizeof(float),
+									 nSamples, sizeof(float), lineBuffer);
+		if (!read) {
+			releaseBuffer(grayBuffer);
+			releaseBuffer(lineBuffer);
+			free(order);
+			releaseBoxFilter(&box);
 			return NULL;
 		}
 		
-		// copy samples
-		bufIterator = lineBuffer;
-		long cell = rw * (rh - 1 - row / sdist);
-		for (col = 0; col < cols; col += sdist, bufIterator += sdist) {
-			float z = swapSurferFloat(*bufIterator);
-#ifdef CHECK_GRID_WRITE			
-			if (cell < 0 || cell >= rw * rh) {
-				printf("Surfer 6 %ld \n", cell);
-				free(lineBuffer);
-			}
-#endif			
-			if ((z > zmax || z < zmin))
-				grayBuffer[cell++] = 255;
-			else
-				grayBuffer[cell++] = (z - zmin) / diff * 255.f;
-		}
+		// convert samples
+		surfer6RowToGray(lineBuffer, nSamples, sdist, zmin, zmax, scale, 
+						 grayBuffer + rw * order[i]);
 		
-		// overread lines
-		if (row + sdist < rows)
-			fseek ( fp , cols * (sdist - 1) * sizeof(float) , SEEK_CUR );
+		// show the rows read so far at the end of a coarse pass
+		if (isCoarseFrameDue(order, rh, i + 1))
+			drawCoarseFrame(copyGridWithUnreadRows(grayBuffer, rw, rh, order, i + 1), rw, rh, FALSE);
 	}
+	fillUnreadRows(grayBuffer, rw, rh, order, i);
+	free(order);
+	releaseBoxFilter(&box);
 	
-	free(lineBuffer);
+	releaseBuffer(lineBuffer);
 	*width = cols;
 	*height = rows;
 	return grayBuffer;
@@ -307,6 +413,7 @@ bool readSurferASCIISize(FILE *fp, long *width, long *height) {
 
 unsigned char *readSurferASCIIGrid(FILE *fp,
 						 long *width, long *height,
+						 long maxSize,
 						 QLPreviewRequestRef preview,
 						 QLThumbnailRequestRef thumbnail) {
 	
@@ -331,20 +438,20 @@ unsigned char *readSurferASCIIGrid(FILE *fp,
 	if (fscanf (fp, "%lf", &zmax) == EOF)		// zmax
 		return NULL;
 	
-	long rw = resampledWidth(cols, rows);
-	long rh = resampledHeight(cols, rows);
-	int sdist = sampleDist(cols, rows);
+	long rw = resampledWidth(cols, rows, maxSize);
+	long rh = resampledHeight(cols, rows, maxSize);
+	int sdist = sampleDist(cols, rows, maxSize);
 	
 	float diff = zmax - zmin;
 	if (zmin >= zmax)
-		return calloc(rw * rh, 1);
-	unsigned char *grid = malloc(rw * rh);
+		return allocZeroedBuffer(rw * rh);
+	unsigned char *grid = allocBuffer(rw * rh);
 	long row, col;
 	for (row = 0; row < rows; row++)
 	{
 		// check whether we should cancel
 		if (row % 10 == 0 && isCancelled(preview, thumbnail)) {
-			free(grid);
+			releaseBuffer(grid);
 			return NULL;
 		}
 		long cell = rw * (rh - 1 - row / sdist);
@@ -352,14 +459,14 @@ unsigned char *readSurferASCIIGrid(FILE *fp,
 		{
 			if (row % sdist == 0 && col % sdist == 0) {
 				if (fscanf (fp, "%f", &z) != 1) {
-					free(grid);
+					releaseBuffer(grid);
 					return NULL;
 				}
 				
 #ifdef CHECK_GRID_WRITE
 				if (cell < 0 || cell >= rw * rh) {
 				   printf("Surfer ASCII %ld \n", cell);
-					free(grid);
+					releaseBuffer(grid);
 				}
 #endif
 				if ((z > zmax || z < zmin))
@@ -398,6 +505,7 @@ bool readSurferGridSize(FILE *fp, long *width, long *height) {
 }
 
 CGImageRef readSurferGridImage(FILE * fp,
+							   long maxSize,
 							   QLPreviewRequestRef preview,
 							   QLThumbnailRequestRef thumbnail) {
 	
@@ -410,18 +518,18 @@ CGImageRef readSurferGridImage(FILE * fp,
 	switch (l)
 	{
 		case 'AASD':
-			grayBuffer = readSurferASCIIGrid(fp, &width, &height, preview, thumbnail);
+			grayBuffer = readSurferASCIIGrid(fp, &width, &height, maxSize, preview, thumbnail);
 			break;
 		case 'BBSD':
-			grayBuffer = readSurferBinary6(fp, &width, &height, preview, thumbnail);
+			grayBuffer = readSurferBinary6(fp, &width, &height, maxSize, preview, thumbnail);
 			break;
 		case 'BRSD':
-			grayBuffer = readSurferBinary7(fp, &width, &height, false, preview, thumbnail);
+			grayBuffer = readSurferBinary7(fp, &width, &height, false, maxSize, preview, thumbnail);
 			break;
 	}
 	
-	long rw = resampledWidth(width, height);
-	long rh = resampledHeight(width, height);
+	long rw = resampledWidth(width, height, maxSize);
+	long rh = resampledHeight(width, height, maxSize);
 	return createGrayScaleImage(grayBuffer, rw, rh);
 	
 }
\ No newline at end of file
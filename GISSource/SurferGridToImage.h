@@ -17,6 +17,7 @@
 
 bool readSurferGridSize(FILE *fp, long *width, long *height);
 CGImageRef readSurferGridImage(FILE * fp,
+								  long maxSize,
 								  QLPreviewRequestRef preview,
 								  QLThumbnailRequestRef thumbnail);
 
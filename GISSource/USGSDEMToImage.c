@@ -9,6 +9,14 @@
 
 #include "USGSDEMToImage.h"
 #include "ReadRaster.h"
+#include "BufferPool.h"
+#include "Stretch.h"
+#include "Hillshade.h"
+#include "Parallel.h"
+#include <ctype.h>
+#include <math.h>
+#include <string.h>
+#include <unistd.h>
 
 #define MIN(a,b) ((a)>(b)?(b):(a))
 
@@ -16,6 +24,19 @@
 
 #define USGSDEM_NODATA	-32767
 
+// Standard DEM files consist of records of 1024 bytes. Each profile starts with
+// a new record. The profile header has four I6 and five D24.15 fields and is
+// followed by the elevations in I6 fields: 146 in the first record and 170 in
+// each following record.
+#define DEM_RECORD_LENGTH				1024
+#define DEM_PROFILE_HEADER_LENGTH		144
+#define DEM_ELEVATIONS_IN_FIRST_RECORD	146
+#define DEM_ELEVATIONS_PER_RECORD		170
+#define DEM_ELEVATION_LENGTH			6
+
+// number of records read at once
+#define DEM_RECORDS_PER_BLOCK			64
+
 bool read_dem_double(FILE *fp, double *d)
 {
 	char buffer[32];
@@ -32,27 +53,35 @@ bool read_dem_I6(FILE *fp, int *i) {
 	return fscanf(fp, "%6d", i) == 1;	
 }
 
-unsigned char *scaleUSGSDEMToByte(float *floatBuffer, long gridSize,
-								  float minVal, float maxVal) {
+unsigned char *scaleUSGSDEMToByte(float *floatBuffer, long gridSize, long cols,
+								  float minVal, float maxVal,
+								  Histogram *histogram,
+								  bool hillshade) {
+	
+	if (hillshade)
+		return hillshadeFloatGrid(floatBuffer, cols, gridSize / cols, minVal, maxVal, NAN);
 	
 	long i;
-	float diff = maxVal - minVal;
-	if (diff <= 0)
-		return calloc(gridSize, 1); // return an empty gray buffer
+	FloatStretch stretch;
+	if (!initFloatStretch(&stretch, histogram, minVal, maxVal))
+		return allocZeroedBuffer(gridSize); // return an empty gray buffer
 	
 	// allocate buffer for gray pixels
-	unsigned char * grayBuffer = malloc(gridSize);
-	if (grayBuffer == NULL)
+	unsigned char * grayBuffer = allocBuffer(gridSize);
+	if (grayBuffer == NULL) {
+		releaseFloatStretch(&stretch);
 		return NULL;
+	}
 	
 	// scale to unsigned chars
 	for (i = 0; i < gridSize; i++) {
 		if (!finite(floatBuffer[i]))
 			grayBuffer[i] = 255;
 		else
-			grayBuffer[i] = (unsigned char)((floatBuffer[i] - minVal) * 255 / diff);
+			grayBuffer[i] = stretchFloat(floatBuffer[i], &stretch);
 	}
 	
+	releaseFloatStretch(&stretch);
 	return grayBuffer;
 }
 
@@ -61,22 +90,410 @@ typedef struct {
     double	y;
 } DPoint2;
 
+/* Converts a Fortran I6 field. Returns false if the field is blank. */
+bool parseDEMInt(const char *field, int width, int *value) {
+	const char *c = field, *end = field + width;
+	while (c < end && *c == ' ')
+		c++;
+	bool negative = (c < end && *c == '-');
+	if (c < end && (*c == '-' || *c == '+'))
+		c++;
+	if (c == end || !isdigit(*c))
+		return FALSE;
+	int v = 0;
+	for (; c < end && isdigit(*c); c++)
+		v = v * 10 + (*c - '0');
+	*value = negative ? -v : v;
+	return TRUE;
+}
+
+/* Converts a Fortran D24.15 or D12.6 field like "  0.123456789012345D+04". 
+ The digits are accumulated in an integer, which is scaled once by a power of
+ ten. */
+double parseDEMDouble(const char *field, int width) {
+	static const double powersOfTen[] = {
+		1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+	};
+	const char *c = field, *end = field + width;
+	while (c < end && *c == ' ')
+		c++;
+	bool negative = (c < end && *c == '-');
+	if (c < end && (*c == '-' || *c == '+'))
+		c++;
+	
+	// at most 18 digits fit into the mantissa, later digits are dropped
+	long long mantissa = 0;
+	int digits = 0, exponent = 0;
+	for (; c < end && isdigit(*c); c++) {
+		if (digits < 18) {
+			mantissa = mantissa * 10 + (*c - '0');
+			digits += (mantissa != 0);
+		} else
+			exponent++;
+	}
+	if (c < end && *c == '.') {
+		for (c++; c < end && isdigit(*c); c++) {
+			if (digits < 18) {
+				mantissa = mantissa * 10 + (*c - '0');
+				digits += (mantissa != 0);
+				exponent--;
+			}
+		}
+	}
+	if (c < end && (*c == 'D' || *c == 'd' || *c == 'E' || *c == 'e')) {
+		int e;
+		c++;
+		if (parseDEMInt(c, end - c, &e))
+			exponent += e;
+	}
+	
+	double v = (double)mantissa;
+	int n = exponent < 0 ? -exponent : exponent;
+	double scale = n < sizeof(powersOfTen) / sizeof(powersOfTen[0]) ? powersOfTen[n] : pow(10., n);
+	v = exponent < 0 ? v / scale : v * scale;
+	return negative ? -v : v;
+}
+
 static double DConvert( FILE *fp, int nCharCount )
 
 {
     char	szBuffer[100];
-    int		i;
 	
-    VSIFRead( szBuffer, nCharCount, 1, fp );
-    szBuffer[nCharCount] = '\0';
+    if (nCharCount > sizeof(szBuffer) || fread( szBuffer, 1, nCharCount, fp ) != nCharCount)
+		return 0;
+    return parseDEMDouble(szBuffer, nCharCount);
+}
+
+// the sampled grid of a DEM and the range of its values
+typedef struct {
+	float *grid;
+	long width, height, rw;
+	int sdist;
+	double verticalResolution;
+	float minVal, maxVal;
+	Histogram *histogram;
+} DEMGrid;
+
+/* Stores an elevation if it is on a sampled row. Profiles are the columns of
+ the grid, and the first elevation of a profile is in the south. */
+void addDEMElevation(DEMGrid *dem, long profile, long j, int nElev, double elevOffset) {
+	long iY = dem->height - j - 1;
+	if (iY < 0 || iY >= dem->height || iY % dem->sdist != 0 || nElev == USGSDEM_NODATA)
+		return;
+	float v = (float)(nElev * dem->verticalResolution + elevOffset);
+	if (v < dem->minVal)
+		dem->minVal = v;
+	if (v > dem->maxVal)
+		dem->maxVal = v;
+	if (dem->histogram)
+		addFloatToHistogram(dem->histogram, v);
+	dem->grid[profile / dem->sdist + iY / dem->sdist * dem->rw] = v;
+}
+
+// reads the 1024 byte records of a DEM in blocks
+typedef struct {
+	FILE *fp;
+	char *block;
+	long firstRecord;
+	long nRecords;
+} DEMRecordReader;
+
+/* Returns the record with index record, counted from the start of the file, or
+ NULL if the file ends before. */
+const char *readDEMRecord(DEMRecordReader *reader, long record) {
+	if (record < reader->firstRecord || record >= reader->firstRecord + reader->nRecords) {
+		reader->firstRecord = record;
+		reader->nRecords = 0;
+		if (fseek (reader->fp, record * DEM_RECORD_LENGTH, SEEK_SET) != 0)
+			return NULL;
+		reader->nRecords = fread (reader->block, DEM_RECORD_LENGTH, DEM_RECORDS_PER_BLOCK, reader->fp);
+		if (reader->nRecords == 0)
+			return NULL;
+	}
+	return reader->block + (record - reader->firstRecord) * DEM_RECORD_LENGTH;
+}
+
+/* Returns the number of records of a profile with nElev elevations. */
+long demProfileRecords(int nElev) {
+	if (nElev <= DEM_ELEVATIONS_IN_FIRST_RECORD)
+		return 1;
+	return 1 + (nElev - DEM_ELEVATIONS_IN_FIRST_RECORD + DEM_ELEVATIONS_PER_RECORD - 1) / DEM_ELEVATIONS_PER_RECORD;
+}
+
+// a sampled profile of a DEM file with 1024 byte records
+typedef struct {
+	long column;
+	long record;		// first record of the profile
+	long nRecords;
+	int nCPoints;		// number of elevations
+} DEMProfile;
+
+/* Finds the records of the sampled profiles from the profile headers. Profiles
+ that are not sampled are skipped without converting their elevations. Stops 
+ at the first profile whose column number does not match its position or that
+ has more elevations than the grid has rows. Returns
+ the number of profiles found, or -1 if reading failed. */
+long locateDEMProfiles(FILE *fp, long dataStart, const DEMGrid *dem, DEMProfile *profiles) {
+	
+	DEMRecordReader reader = {fp, allocBuffer(DEM_RECORDS_PER_BLOCK * DEM_RECORD_LENGTH), 0, 0};
+	if (reader.block == NULL)
+		return -1;
+	long record = dataStart / DEM_RECORD_LENGTH;
+	long i, nProfiles = 0;
+	for (i = 0; i < dem->width; i++) {
+		const char *r = readDEMRecord(&reader, record);
+		int column, nCPoints;
+		if (r == NULL || !parseDEMInt(r + 6, 6, &column) || column != i + 1
+			|| !parseDEMInt(r + 12, 6, &nCPoints) || nCPoints < 0 || nCPoints > dem->height)
+			break;
+		long nRecords = demProfileRecords(nCPoints);
+		if (i % dem->sdist == 0) {
+			profiles[nProfiles].column = i;
+			profiles[nProfiles].record = record;
+			profiles[nProfiles].nRecords = nRecords;
+			profiles[nProfiles].nCPoints = nCPoints;
+			nProfiles++;
+		}
+		record += nRecords;
+	}
+	releaseBuffer(reader.block);
+	return nProfiles;
+}
+
+/* Converts the elevations of a profile on sampled rows. records contains all 
+ records of the profile. */
+void decodeDEMProfile(DEMGrid *dem, const DEMProfile *profile, const char *records,
+					  bool arcSeconds, double dfYMin, double yRes) {
+	
+	double dyStart = parseDEMDouble(records + 48, 24);
+	double dfElevOffset = parseDEMDouble(records + 72, 24);
+	if (arcSeconds)
+		dyStart = dyStart / 3600.0;
+	long lygap = (long)((dfYMin - dyStart) / yRes + 0.5);
+	
+	// the elevations, continued in following records
+	const char *field = records + DEM_PROFILE_HEADER_LENGTH;
+	int inRecord = DEM_ELEVATIONS_IN_FIRST_RECORD;
+	int j, nElev;
+	for (j = 0; j < profile->nCPoints; j++) {
+		if (inRecord == 0) {
+			records += DEM_RECORD_LENGTH;
+			field = records;
+			inRecord = DEM_ELEVATIONS_PER_RECORD;
+		}
+		// only elevations on sampled rows are converted
+		if ((lygap + j) % dem->sdist == (dem->height - 1) % dem->sdist
+			&& parseDEMInt(field, DEM_ELEVATION_LENGTH, &nElev))
+			addDEMElevation(dem, profile->column, lygap + j, nElev, dfElevOffset);
+		field += DEM_ELEVATION_LENGTH;
+		inRecord--;
+	}
+}
+
+/* Shared by the worker threads that decode the sampled profiles. Workers take 
+ the next profile and write its elevations to its own column of the grid. Each
+ worker finds the range and the histogram of the values it decodes, which are
+ merged when all workers are done. */
+typedef struct {
+	FILE *fp;
+	int fd;
+	const DEMProfile *profiles;
+	long nProfiles;
+	long nextProfile;
+	size_t maxProfileLength;
+	pthread_mutex_t mutex;
+	CFAbsoluteTime *deadline;
+	
+	bool arcSeconds;
+	double dfYMin, yRes;
+	bool failed;
+	QLPreviewRequestRef preview;
+	QLThumbnailRequestRef thumbnail;
+} DEMDecoder;
+
+typedef struct {
+	DEMDecoder *decoder;
+	DEMGrid dem;
+} DEMWorker;
+
+/* Reads bytes at offset. Worker threads use pread on the shared file 
+ descriptor. Files opened with funopen() have no file descriptor and are 
+ decoded by a single thread with fseek and fread. */
+bool readDEMBytes(DEMDecoder *decoder, long offset, size_t length, char *buffer) {
+	if (decoder->fd < 0)
+		return fseek (decoder->fp, offset, SEEK_SET) == 0 
+			&& fread (buffer, 1, length, decoder->fp) == length;
+	return pread(decoder->fd, buffer, length, offset) == (ssize_t)length;
+}
+
+/* Worker thread: decodes profiles until all are decoded, the time is up or 
+ reading failed. Profiles that are not decoded stay void. */
+void *decodeDEMProfiles(void *info) {
+	DEMWorker *worker = info;
+	DEMDecoder *decoder = worker->decoder;
+	setDeadline(decoder->deadline);
+	char *records = allocBuffer(decoder->maxProfileLength);
+	if (records == NULL)
+		decoder->failed = TRUE;
+	while (records != NULL) {
+		pthread_mutex_lock(&decoder->mutex);
+		long p = decoder->nProfiles;
+		if (!decoder->failed && (decoder->nextProfile == 0 || !isPastDeadline()))
+			p = decoder->nextProfile++;
+		pthread_mutex_unlock(&decoder->mutex);
+		if (p >= decoder->nProfiles)
+			break;
+		const DEMProfile *profile = &decoder->profiles[p];
+		if ((p % 50 == 0 && isCancelled(decoder->preview, decoder->thumbnail))
+			|| !readDEMBytes(decoder, profile->record * DEM_RECORD_LENGTH, 
+							 profile->nRecords * DEM_RECORD_LENGTH, records)) {
+			decoder->failed = TRUE;
+			break;
+		}
+		decodeDEMProfile(&worker->dem, profile, records, 
+						 decoder->arcSeconds, decoder->dfYMin, decoder->yRes);
+	}
+	releaseBuffer(records);
+	setDeadline(NULL);
+	return NULL;
+}
+
+/* Reads the profiles of a file with 1024 byte records. The records of the 
+ sampled profiles are located first, then these profiles are decoded in 
+ parallel until the deadline. Returns false if reading was cancelled. */
+bool readDEMRecordProfiles(FILE *fp, long dataStart, DEMGrid *dem,
+						   bool arcSeconds, double dfYMin, double yRes,
+						   QLPreviewRequestRef preview,
+						   QLThumbnailRequestRef thumbnail) {
+	
+	DEMProfile *profiles = malloc(dem->rw * sizeof(DEMProfile));
+	if (profiles == NULL)
+		return FALSE;
+	long nProfiles = locateDEMProfiles(fp, dataStart, dem, profiles);
+	if (nProfiles < 0 || isCancelled(preview, thumbnail)) {
+		free(profiles);
+		return FALSE;
+	}
 	
-    for( i = 0; i < nCharCount; i++ )
+	DEMDecoder decoder;
+	memset(&decoder, 0, sizeof(decoder));
+	decoder.fp = fp;
+	decoder.fd = fileno(fp);
+	decoder.profiles = profiles;
+	decoder.nProfiles = nProfiles;
+	decoder.arcSeconds = arcSeconds;
+	decoder.dfYMin = dfYMin;
+	decoder.yRes = yRes;
+	decoder.preview = preview;
+	decoder.thumbnail = thumbnail;
+	decoder.deadline = getDeadline();
+	long p;
+	for (p = 0; p < nProfiles; p++) {
+		size_t length = profiles[p].nRecords * DEM_RECORD_LENGTH;
+		if (length > decoder.maxProfileLength)
+			decoder.maxProfileLength = length;
+	}
+	pthread_mutex_init(&decoder.mutex, NULL);
+	
+	// each worker has its own range and histogram
+	DEMWorker workers[MAX_WORKER_THREADS];
+	pthread_t threads[MAX_WORKER_THREADS];
+	int maxThreads = decoder.fd < 0 ? 1 : workerThreadCount();
+	if (maxThreads > nProfiles)
+		maxThreads = nProfiles > 0 ? nProfiles : 1;
+	int w, nWorkers, nThreads = 0;
+	for (nWorkers = 0; nWorkers < maxThreads; nWorkers++) {
+		workers[nWorkers].decoder = &decoder;
+		workers[nWorkers].dem = *dem;
+		workers[nWorkers].dem.histogram = NULL;
+		if (dem->histogram) {
+			workers[nWorkers].dem.histogram = createHistogram(dem->histogram->stretch);
+			if (workers[nWorkers].dem.histogram == NULL)
+				break;
+		}
+	}
+	if (nWorkers == 0)
+		decoder.failed = TRUE;
+	else if (decoder.fd >= 0) {
+		while (nThreads < nWorkers
+			   && pthread_create(&threads[nThreads], NULL, decodeDEMProfiles, &workers[nThreads]) == 0)
+			nThreads++;
+	}
+	if (nWorkers > 0 && nThreads == 0)
+		decodeDEMProfiles(&workers[0]);
+	for (w = 0; w < nThreads; w++)
+		pthread_join(threads[w], NULL);
+	pthread_mutex_destroy(&decoder.mutex);
+	if (nThreads == 0)
+		setDeadline(decoder.deadline);
+	free(profiles);
+	
+	// merge the ranges and histograms of the workers
+	for (w = 0; w < nWorkers; w++) {
+		if (workers[w].dem.minVal < dem->minVal)
+			dem->minVal = workers[w].dem.minVal;
+		if (workers[w].dem.maxVal > dem->maxVal)
+			dem->maxVal = workers[w].dem.maxVal;
+		if (workers[w].dem.histogram) {
+			mergeHistogram(dem->histogram, workers[w].dem.histogram);
+			releaseHistogram(workers[w].dem.histogram);
+		}
+	}
+	return !decoder.failed;
+}
+
+/* Reads the profiles of a file that is not organized in records of 1024 bytes.
+ Stops at the deadline, at a profile with more elevations than the grid has 
+ rows, or at the end of the file. Returns false if reading was cancelled. */
+bool readDEMFreeFormatProfiles(FILE *fp, long dataStart, DEMGrid *dem,
+							   bool arcSeconds, double dfYMin, double yRes,
+							   QLPreviewRequestRef preview,
+							   QLThumbnailRequestRef thumbnail) {
+	
+	fseek(fp, dataStart, SEEK_SET);
+	long i;
+    for(i = 0; i < dem->width; i++)
     {
-        if( szBuffer[i] == 'D' )
-            szBuffer[i] = 'E';
+        int	njunk, nCPoints, lygap;
+        double	dyStart, dfElevOffset;
+		
+		// test for abort
+		if (i % 50 == 0 && isCancelled(preview, thumbnail))
+			return FALSE;
+		
+		// stop when out of time and use the profiles read so far
+		if (i > 0 && isPastDeadline())
+			break;
+		
+        fscanf(fp, "%d", &njunk);
+        fscanf(fp, "%d", &njunk);
+        if (fscanf(fp, "%d", &nCPoints) != 1 || nCPoints < 0 || nCPoints > dem->height)
+			break;
+        fscanf(fp, "%d", &njunk);
+		
+        DConvert(fp, 24);
+        dyStart = DConvert(fp, 24);
+        dfElevOffset = DConvert(fp, 24);
+        DConvert(fp, 24);
+        DConvert(fp, 24);
+		
+		if (arcSeconds)
+            dyStart = dyStart / 3600.0;
+		
+        lygap = (int)((dfYMin - dyStart)/yRes+ 0.5);
+		
+		int j;
+        for (j=lygap; j < (nCPoints+(int)lygap); j++)
+        {
+            int nElev;
+            if (fscanf(fp, "%d", &nElev) != 1)
+				return TRUE;
+			if (i % dem->sdist == 0)
+				addDEMElevation(dem, i, j, nElev, dfElevOffset);
+        }
     }
-	
-    return atof(szBuffer);
+	return TRUE;
 }
 
 bool isUSGSDEMFile(FILE *fp) {
@@ -184,11 +601,10 @@ bool readUSGSDEMSize(FILE *fp, long *width, long *height) {
 }
 
 CGImageRef readUSGSDEMImage(FILE * fp, 
+							long maxSize,
 							QLPreviewRequestRef preview,
 							QLThumbnailRequestRef thumbnail) {
 	
-	int		bad = FALSE;
-	
 	if (!isUSGSDEMFile(fp))
 		return NULL;
 	
@@ -293,73 +709,49 @@ CGImageRef readUSGSDEMImage(FILE * fp,
 	if (width < 1 || height < 1)
 		return NULL;
 	
-	long rw = resampledWidth(width, height);
-	long rh = resampledHeight(width, height);
-	int sdist = sampleDist(width, height);
+	long rw = resampledWidth(width, height, maxSize);
+	long rh = resampledHeight(width, height, maxSize);
+	int sdist = sampleDist(width, height, maxSize);
 	
-	float *grid = malloc(sizeof(float) * rw * rh);
-	for (i = rw * rh; i >= 0; i--)
-		grid[i] = NAN;
-	
-	fseek(fp, nDataStartOffset, SEEK_SET);
+	float *grid = allocBuffer(sizeof(float) * rw * rh);
+	if (grid == NULL)
+		return NULL;
+	long cell;
+	for (cell = 0; cell < rw * rh; cell++)
+		grid[cell] = NAN;
 	
     double dfYMin = adfGeoTransform[3] + (height-0.5) * adfGeoTransform[5];
 	
-	//Read all the profiles
-	float minVal = FLT_MAX;
-	float maxVal = -FLT_MAX;
-    for(i = 0; i < width; i++)
-    {
-        int	njunk, nCPoints, lygap;
-        double	djunk, dxStart, dyStart, dfElevOffset;
-		
-        fscanf(fp, "%d", &njunk);
-        fscanf(fp, "%d", &njunk);
-        fscanf(fp, "%d", &nCPoints);
-        fscanf(fp, "%d", &njunk);
-		
-        dxStart = DConvert(fp, 24);
-        dyStart = DConvert(fp, 24);
-        dfElevOffset = DConvert(fp, 24);
-        djunk = DConvert(fp, 24);
-        djunk = DConvert(fp, 24);
-		
-		if (nCoordSystem == 0)
-            dyStart = dyStart / 3600.0;
-		
-        lygap = (int)((dfYMin - dyStart)/adfGeoTransform[5]+ 0.5);
-		
-		int j;
-        for (j=lygap; j < (nCPoints+(int)lygap); j++)
-        {
-            int	iY = height - j - 1;
-            int nElev;
-			
-            fscanf(fp, "%d", &nElev);
-            if (iY < 0 || iY >= height )
-                bad = TRUE;
-            else if ((i % sdist == 0) && (iY % sdist == 0) && (nElev != USGSDEM_NODATA)){
-				float v = (float)(nElev * fVRes + dfElevOffset);
-				if (v < minVal)
-					minVal = v;
-				if (v > maxVal)
-					maxVal = v;
-				grid[i / sdist + iY / sdist * rw] = v;
-			}
-			
-			// test for abort
-			if (((i + iY * width) % 50 == 0) && isCancelled(preview, thumbnail)) {
-				free(grid);
-				return NULL;
-			}
-			
-        }
-    }
+	// read all the profiles
+	bool hillshade = hillshadePreference();
+	DEMGrid dem = {grid, width, height, rw, sdist, fVRes, FLT_MAX, -FLT_MAX, NULL};
+	dem.histogram = hillshade ? NULL : createHistogram(stretchForFormat(CFSTR("USGSDEMStretch"), percentileStretch));
+	bool recordFormat = nDataStartOffset == DEM_RECORD_LENGTH
+		&& fseek(fp, 0, SEEK_END) == 0 && ftell(fp) % DEM_RECORD_LENGTH == 0;
+	bool read;
+	if (recordFormat)
+		read = readDEMRecordProfiles(fp, nDataStartOffset, &dem, nCoordSystem == 0, 
+									 dfYMin, adfGeoTransform[5], preview, thumbnail);
+	else
+		read = readDEMFreeFormatProfiles(fp, nDataStartOffset, &dem, nCoordSystem == 0, 
+										 dfYMin, adfGeoTransform[5], preview, thumbnail);
+	Histogram *histogram = dem.histogram;
+	if (!read) {
+		releaseBuffer(grid);
+		releaseHistogram(histogram);
+		return NULL;
+	}
+	float minVal = dem.minVal;
+	float maxVal = dem.maxVal;
 	
-	unsigned char *grayBuffer = scaleUSGSDEMToByte(grid, rw * rh, minVal, maxVal);
-	free (grid);
+	unsigned char *grayBuffer = scaleUSGSDEMToByte(grid, rw * rh, rw, minVal, maxVal, histogram, hillshade);
+	releaseBuffer(grid);
+	releaseHistogram(histogram);
 	if (grayBuffer == NULL)
 		return NULL;
 	
+	// the gradation curve is only applied to stretched values
+	if (hillshade)
+		return createGradedGrayScaleImage(grayBuffer, rw, rh);
 	return createGrayScaleImage(grayBuffer, rw, rh);
 }
\ No newline at end of file
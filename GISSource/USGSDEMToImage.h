@@ -17,6 +17,7 @@
 
 bool readUSGSDEMSize(FILE *fp, long *width, long *height);
 CGImageRef readUSGSDEMImage(FILE * fp,
+								  long maxSize,
 								  QLPreviewRequestRef preview,
 								  QLThumbnailRequestRef thumbnail);
 
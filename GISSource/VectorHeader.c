@@ -0,0 +1,306 @@
+/*
+ *  VectorHeader.c
+ *  GISMeta
+ *
+ */
+
+#include "VectorHeader.h"
+#include "File.h"
+#include "e00compr.h"
+
+#define SHAPEFILE_HEADER_SIZE 100
+#define SHAPEFILE_CODE 9994
+
+// maximum length of a line in an uncompressed E00 file
+#define E00_LINE_LENGTH 80
+
+// maximum number of decompressed bytes examined in a compressed E00 file
+#define E00_DECOMPRESSED_LENGTH (16 * METADATA_READ_BUDGET)
+
+void initVectorHeader(VectorHeader *header) {
+	header->hasBounds = FALSE;
+	header->xmin = header->ymin = header->xmax = header->ymax = 0;
+	header->featureCount = -1;
+}
+
+void setBounds(VectorHeader *header, double xmin, double ymin, double xmax, double ymax) {
+	if (isfinite(xmin) && isfinite(ymin) && isfinite(xmax) && isfinite(ymax)
+		&& xmin <= xmax && ymin <= ymax) {
+		header->xmin = xmin;
+		header->ymin = ymin;
+		header->xmax = xmax;
+		header->ymax = ymax;
+		header->hasBounds = TRUE;
+	}
+}
+
+double littleEndianDouble(const unsigned char *bytes) {
+	UInt64 i;
+	double d;
+	memcpy(&i, bytes, 8);
+	i = CFSwapInt64LittleToHost(i);
+	memcpy(&d, &i, 8);
+	return d;
+}
+
+/* Reads the bounding box from the 100 bytes header of the .shp file. The 
+ number of shapes is derived from the size of the .shx index, which has an 
+ entry of 8 bytes per shape after a 100 bytes header. path can point to any 
+ of the files of the shapefile. */
+bool readShapefileHeader(char *path, VectorHeader *header) {
+	
+	initVectorHeader(header);
+	
+	char *shpPath = changeExtension(path, "shp");
+	if (shpPath == NULL)
+		return FALSE;
+	FILE *fp = openFileWithBudget(shpPath, SHAPEFILE_HEADER_SIZE);
+	free(shpPath);
+	if (fp == NULL)
+		return FALSE;
+	unsigned char buf[SHAPEFILE_HEADER_SIZE];
+	bool headerRead = fread(buf, SHAPEFILE_HEADER_SIZE, 1, fp) == 1;
+	fclose(fp);
+	if (!headerRead)
+		return FALSE;
+	
+	UInt32 fileCode;
+	memcpy(&fileCode, buf, 4);
+	if (CFSwapInt32BigToHost(fileCode) != SHAPEFILE_CODE)
+		return FALSE;
+	setBounds(header, 
+			  littleEndianDouble(buf + 36), 
+			  littleEndianDouble(buf + 44), 
+			  littleEndianDouble(buf + 52), 
+			  littleEndianDouble(buf + 60));
+	
+	char *shxPath = changeExtension(path, "shx");
+	if (shxPath != NULL) {
+		unsigned long shxLength = getFileLength(shxPath);
+		free(shxPath);
+		if (shxLength >= SHAPEFILE_HEADER_SIZE)
+			header->featureCount = (shxLength - SHAPEFILE_HEADER_SIZE) / 8;
+	}
+	
+	return TRUE;
+}
+
+/* Returns the next line in a buffer and terminates it with a null character. 
+ Returns NULL at the end of the buffer. */
+char *nextBufferLine(char **cursor, char *end) {
+	char *line = *cursor;
+	if (line >= end)
+		return NULL;
+	char *eol = line;
+	while (eol < end && *eol != '\n' && *eol != '\r')
+		eol++;
+	*cursor = eol;
+	while (*cursor < end && (**cursor == '\n' || **cursor == '\r'))
+		(*cursor)++;
+	*eol = '\0';
+	return line;
+}
+
+// integer in a fixed width column, as written by ARC/INFO
+long fixedWidthInt(const char *line, int start, int width) {
+	char str[16];
+	if (strlen(line) < start + width || width >= sizeof(str))
+		return 0;
+	strncpy(str, line + start, width);
+	str[width] = '\0';
+	return atol(str);
+}
+
+/* Reads the values of a BND table record following the item definitions. 
+ The four coordinates can be split over two lines in double precision. */
+void readE00Bounds(char **cursor, char *end, long nItems, VectorHeader *header) {
+	
+	long i, size = 0;
+	for (i = 0; i < nItems; i++) {
+		char *item = nextBufferLine(cursor, end);
+		if (item == NULL)
+			return;
+		if (i == 0)
+			size = fixedWidthInt(item, 16, 3);
+	}
+	
+	// single precision numbers are 14 characters wide, double precision 24
+	int width = size == 8 ? 24 : 14;
+	char record[4 * 24 + 1] = "";
+	while (strlen(record) < 4 * width) {
+		char *line = nextBufferLine(cursor, end);
+		if (line == NULL)
+			return;
+		strncat(record, line, 4 * width - strlen(record));
+	}
+	
+	double v[4];
+	char str[25];
+	for (i = 0; i < 4; i++) {
+		strncpy(str, record + i * width, width);
+		str[width] = '\0';
+		v[i] = strtod(str, NULL);
+	}
+	setBounds(header, v[0], v[1], v[2], v[3]);
+}
+
+/* Searches a part of an uncompressed E00 file for the INFO tables with the 
+ bounding box (BND) and the attributes of polygons or points (PAT) and of 
+ arcs (AAT). The PAT has a record per feature of a polygon or point coverage
+ and is preferred for the number of features. */
+void scanE00Tables(char *text, char *end, VectorHeader *header, long *aatRecords, long *patRecords) {
+	
+	char *cursor = text;
+	char *line;
+	while ((line = nextBufferLine(&cursor, end)) != NULL) {
+		
+		// a table header line has the table name in the first 32 columns
+		if (strlen(line) < 56 || strlen(line) > E00_LINE_LENGTH)
+			continue;
+		char *nameEnd = line + 31;
+		while (nameEnd > line && *nameEnd == ' ')
+			nameEnd--;
+		if (nameEnd - line < 4 || nameEnd[-3] != '.')
+			continue;
+		
+		long nItems = fixedWidthInt(line, 38, 4);
+		long nRecords = fixedWidthInt(line, 46, 10);
+		if (strncmp(nameEnd - 2, "BND", 3) == 0)
+			readE00Bounds(&cursor, end, nItems, header);
+		else if (strncmp(nameEnd - 2, "AAT", 3) == 0)
+			*aatRecords = nRecords;
+		else if (strncmp(nameEnd - 2, "PAT", 3) == 0)
+			*patRecords = nRecords;
+	}
+}
+
+// lines of E00 text in memory, read by the E00 decompressor
+typedef struct {
+	const char *start, *cursor, *end;
+	char line[E00_READ_BUF_SIZE];
+} E00BufferReader;
+
+const char *readE00BufferLine(void *refData) {
+	E00BufferReader *reader = refData;
+	if (reader->cursor >= reader->end)
+		return NULL;
+	size_t length = 0;
+	while (reader->cursor < reader->end && *reader->cursor != '\n' && *reader->cursor != '\r') {
+		if (length < sizeof(reader->line) - 1)
+			reader->line[length++] = *reader->cursor;
+		reader->cursor++;
+	}
+	reader->line[length] = '\0';
+	if (reader->cursor < reader->end && *reader->cursor == '\r')
+		reader->cursor++;
+	if (reader->cursor < reader->end && *reader->cursor == '\n')
+		reader->cursor++;
+	return reader->line;
+}
+
+void rewindE00BufferReader(void *refData) {
+	E00BufferReader *reader = refData;
+	reader->cursor = reader->start;
+}
+
+/* Decompresses the lines of a compressed E00 file, as far as they have been
+ read, into a null terminated text of at most E00_DECOMPRESSED_LENGTH bytes. 
+ The returned text must be released with free(). */
+char *decompressE00(E00ReadPtr e00Ptr, size_t *textLength) {
+	char *text = malloc(E00_DECOMPRESSED_LENGTH + 1);
+	if (text == NULL)
+		return NULL;
+	size_t length = 0;
+	const char *line;
+	while ((line = E00ReadNextLine(e00Ptr)) != NULL) {
+		size_t lineLength = strlen(line);
+		if (length + lineLength + 1 > E00_DECOMPRESSED_LENGTH)
+			break;
+		memcpy(text + length, line, lineLength);
+		length += lineLength;
+		text[length++] = '\n';
+	}
+	text[length] = '\0';
+	*textLength = length;
+	return text;
+}
+
+/* The INFO tables are at the end of an E00 file. At most budget bytes are 
+ read from the start and the end of the file, so the tables are not found in
+ files with large attribute tables. Compressed E00 files and gzip compressed
+ files cannot be read from the end. Their start is read until the budget is
+ used up and decompressed, so their tables are only found in small files. */
+bool readE00Header(char *path, long budget, VectorHeader *header) {
+	
+	initVectorHeader(header);
+	
+	unsigned long fileLength = getFileLength(path);
+	bool gzip = isGzipPath(path);
+	FILE *fp = openFileWithBudget(path, budget);
+	if (fp == NULL)
+		return FALSE;
+	// without a stdio buffer, the budget counts the bytes that are used. A
+	// buffered stream would count its read-ahead, and the block it reads 
+	// before the position of a seek to the end.
+	setvbuf(fp, NULL, _IONBF, 0);
+	
+	// the budget of a gzip compressed file counts compressed bytes
+	size_t bufLength = gzip ? E00_DECOMPRESSED_LENGTH : budget;
+	char *buf = malloc(bufLength + 1);
+	if (buf == NULL) {
+		fclose(fp);
+		return FALSE;
+	}
+	
+	// first line: EXP, compression flag and path
+	int compressed;
+	size_t headLength = fread(buf, 1, gzip ? bufLength : budget / 2, fp);
+	buf[headLength] = '\0';
+	if (sscanf(buf, "EXP %d", &compressed) != 1) {
+		free(buf);
+		fclose(fp);
+		return FALSE;
+	}
+	
+	// the compression flag is not reliable, the decompressor tests the lines
+	E00BufferReader reader;
+	reader.start = reader.cursor = buf;
+	reader.end = buf + headLength;
+	E00ReadPtr e00Ptr = E00ReadCallbackOpen(&reader, readE00BufferLine, rewindE00BufferReader);
+	bool isCompressed = e00Ptr != NULL && e00Ptr->bIsCompressed;
+	
+	long aatRecords = -1, patRecords = -1;
+	if (isCompressed) {
+		if (!gzip) {
+			headLength += fread(buf + headLength, 1, budget - headLength, fp);
+			buf[headLength] = '\0';
+			reader.end = buf + headLength;
+		}
+		size_t textLength;
+		char *text = decompressE00(e00Ptr, &textLength);
+		if (text != NULL)
+			scanE00Tables(text, text + textLength, header, &aatRecords, &patRecords);
+		free(text);
+	} else
+		scanE00Tables(buf, buf + headLength, header, &aatRecords, &patRecords);
+	if (e00Ptr != NULL)
+		E00ReadClose(e00Ptr);
+	
+	if (!gzip && !isCompressed && fileLength > headLength) {
+		long tailLength = fileLength - headLength;
+		if (tailLength > budget - headLength)
+			tailLength = budget - headLength;
+		if (fseek(fp, -tailLength, SEEK_END) == 0) {
+			tailLength = fread(buf, 1, tailLength, fp);
+			// the first line is likely incomplete
+			char *cursor = buf;
+			nextBufferLine(&cursor, buf + tailLength);
+			scanE00Tables(cursor, buf + tailLength, header, &aatRecords, &patRecords);
+		}
+	}
+	free(buf);
+	fclose(fp);
+	
+	header->featureCount = patRecords >= 0 ? patRecords : aatRecords;
+	return TRUE;
+}
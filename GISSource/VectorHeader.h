@@ -0,0 +1,24 @@
+/*
+ *  VectorHeader.h
+ *  GISMeta
+ *
+ */
+
+#include <CoreFoundation/CoreFoundation.h>
+#include <CoreServices/CoreServices.h>
+
+#ifndef __VECTORHEADER__
+#define __VECTORHEADER__
+
+// Bounding box and number of features of a vector file, as far as they can be
+// found without reading the entire file.
+typedef struct {
+	bool hasBounds;
+	double xmin, ymin, xmax, ymax;
+	long featureCount;	// -1 if unknown
+} VectorHeader;
+
+bool readShapefileHeader(char *path, VectorHeader *header);
+bool readE00Header(char *path, long budget, VectorHeader *header);
+
+#endif
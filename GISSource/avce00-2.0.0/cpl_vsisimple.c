@@ -52,6 +52,9 @@
 
 #include "cpl_vsi.h"
 
+/* defined in GISSource/File.c */
+FILE *openFileForReading(const char *path);
+
 /* for stat() */
 
 #ifndef WIN32
@@ -70,6 +73,10 @@
 FILE *VSIFOpen( const char * pszFilename, const char * pszAccess )
 
 {
+    /* files opened for reading only may be gzip compressed, and are */
+    /* decompressed by openFileForReading() */
+    if( pszAccess[0] == 'r' && strchr( pszAccess, '+' ) == NULL )
+        return( openFileForReading( pszFilename ) );
     return( fopen( (char *) pszFilename, (char *) pszAccess ) );
 }
 